@@ -1,31 +1,361 @@
 #include "./jobs.h"
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+// pids of a job kept in the record itself; longer pipelines spill to the heap
+#define JOB_INLINE_PROCS 2
+// size of a chunk of the command string arena
+#define ARENA_CHUNK 8192
 
 struct job_element {
     int jid;
     pid_t pid;
     process_state_t state;
-    char *command;
-    struct job_element *next;
+    char *command;  // stored in the job list's arena
+    char *policy;   // how its processes are confined, in the arena or NULL
+    // every process of the job, 0 once it has been reaped; procs is only
+    // set once the job outgrows first_procs
+    pid_t *procs;
+    pid_t first_procs[JOB_INLINE_PROCS];
+    int nprocs;
+    int nlive;   // number of processes not yet reaped
+    int status;  // wait status of the last process of the pipeline
+    struct rusage usage;      // summed over the processes reaped so far
+    struct timespec started;  // CLOCK_MONOTONIC time the job was added
+    int prev;    // neighbours in jid order, -1 at either end
+    int next;    // (next also links the free slots together)
 };
 typedef struct job_element job_element_t;
 
-// head is the head of the list
-// current is the current element being iterated over
+// open-addressed hash table (linear probing) from a jid or a pid to the
+// slot of its job
+typedef struct job_index {
+    int *keys;
+    int *slots;  // -1 marks an empty bucket
+    size_t mask;
+    size_t count;
+} job_index_t;
+
+// chunk of the bump allocator holding command strings
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_chunk_t;
+
+// slots is a slab of job records addressed by index, with removed records
+// kept on a free list for reuse
+// head and tail are the first and last job in jid order
+// current is the slot of the job being iterated over by get_next_pid
 struct job_list {
-    job_element_t *head;
-    job_element_t *current;
+    job_element_t *slots;
+    int capacity;
+    int free_slot;
+    int count;
+    int head;
+    int tail;
+    int current;
+    job_index_t by_jid;
+    job_index_t by_pid;
+    arena_chunk_t *arena;
+    size_t arena_live;     // bytes of strings of jobs still in the list
+    size_t arena_garbage;  // bytes of strings of removed jobs
+    int state_count[QUEUED + 1];  // number of jobs in each state
     pid_t shell_pid;
 };
 
+/* hashes a jid or pid into a bucket of the index */
+static size_t index_hash(const job_index_t *index, int key) {
+    uint32_t h = (uint32_t)key * 2654435769u;
+    h ^= h >> 16;
+    return (size_t)h & index->mask;
+}
+
+/* sets up an empty index with room for capacity buckets (a power of 2) */
+static int index_init(job_index_t *index, size_t capacity) {
+    index->keys = (int *)malloc(sizeof(int) * capacity);
+    index->slots = (int *)malloc(sizeof(int) * capacity);
+    if (index->keys == NULL || index->slots == NULL) {
+        free(index->keys);
+        free(index->slots);
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        index->slots[i] = -1;
+    }
+    index->mask = capacity - 1;
+    index->count = 0;
+    return 0;
+}
+
+/* returns the slot stored for key, -1 if there is none */
+static int index_find(const job_index_t *index, int key) {
+    size_t i = index_hash(index, key);
+    while (index->slots[i] != -1) {
+        if (index->keys[i] == key) {
+            return index->slots[i];
+        }
+        i = (i + 1) & index->mask;
+    }
+    return -1;
+}
+
+/* stores key -> slot, growing the index to stay at most half full,
+    returns 0 on success, -1 on failure */
+static int index_insert(job_index_t *index, int key, int slot) {
+    if ((index->count + 1) * 2 > index->mask + 1) {
+        job_index_t bigger;
+        if (index_init(&bigger, (index->mask + 1) * 2) == -1) {
+            return -1;
+        }
+        for (size_t i = 0; i <= index->mask; i++) {
+            if (index->slots[i] != -1) {
+                index_insert(&bigger, index->keys[i], index->slots[i]);
+            }
+        }
+        free(index->keys);
+        free(index->slots);
+        *index = bigger;
+    }
+    size_t i = index_hash(index, key);
+    while (index->slots[i] != -1) {
+        if (index->keys[i] == key) {
+            index->slots[i] = slot;
+            return 0;
+        }
+        i = (i + 1) & index->mask;
+    }
+    index->keys[i] = key;
+    index->slots[i] = slot;
+    index->count++;
+    return 0;
+}
+
+/* removes key from the index, shifting later entries of its probe run back
+    so that no tombstones are needed */
+static void index_remove(job_index_t *index, int key) {
+    size_t i = index_hash(index, key);
+    while (index->slots[i] != -1 && index->keys[i] != key) {
+        i = (i + 1) & index->mask;
+    }
+    if (index->slots[i] == -1) {
+        return;
+    }
+    size_t hole = i;
+    while (1) {
+        i = (i + 1) & index->mask;
+        if (index->slots[i] == -1) {
+            break;
+        }
+        // an entry may fill the hole only if the hole lies between its home
+        // bucket and where it currently sits
+        size_t home = index_hash(index, index->keys[i]);
+        if (((i - home) & index->mask) >= ((i - hole) & index->mask)) {
+            index->keys[hole] = index->keys[i];
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+    index->slots[hole] = -1;
+    index->count--;
+}
+
+/* copies a string into the job list's arena, returns NULL on failure */
+static char *arena_strdup(job_list_t *job_list, const char *str) {
+    size_t len = strlen(str) + 1;
+    arena_chunk_t *chunk = job_list->arena;
+    if (chunk == NULL || chunk->size - chunk->used < len) {
+        size_t size = len > ARENA_CHUNK ? len : ARENA_CHUNK;
+        chunk = (arena_chunk_t *)malloc(sizeof(arena_chunk_t) + size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = job_list->arena;
+        chunk->used = 0;
+        chunk->size = size;
+        job_list->arena = chunk;
+    }
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, str, len);
+    chunk->used += len;
+    job_list->arena_live += len;
+    return copy;
+}
+
+/* frees every chunk of an arena */
+static void arena_free(arena_chunk_t *chunk) {
+    while (chunk != NULL) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/*
+ * gives back len bytes of arena space taken by a removed job's strings
+ * once removed strings take up more room than live ones the live ones are
+ * copied into a fresh arena, so memory stays proportional to the job count
+ */
+static void arena_release(job_list_t *job_list, size_t len) {
+    job_list->arena_live -= len;
+    job_list->arena_garbage += len;
+    if (job_list->arena_garbage < ARENA_CHUNK ||
+        job_list->arena_garbage < job_list->arena_live) {
+        return;
+    }
+    arena_chunk_t *old = job_list->arena;
+    size_t live = job_list->arena_live;
+    size_t garbage = job_list->arena_garbage;
+    job_list->arena = NULL;
+    job_list->arena_live = 0;
+    job_list->arena_garbage = 0;
+    for (int slot = job_list->head; slot != -1;
+         slot = job_list->slots[slot].next) {
+        job_element_t *job = &job_list->slots[slot];
+        char *copy = arena_strdup(job_list, job->command);
+        char *policy = copy;
+        if (copy != NULL && job->policy != NULL) {
+            policy = arena_strdup(job_list, job->policy);
+        }
+        if (copy == NULL || policy == NULL) {
+            // keeps the old arena around rather than lose any command; what
+            // was copied so far leaves its old copy behind as garbage, along
+            // with a command copied without its policy
+            job_list->arena_garbage = garbage + job_list->arena_live;
+            job_list->arena_live = live;
+            arena_chunk_t *fresh = job_list->arena;
+            if (fresh == NULL) {
+                job_list->arena = old;
+                return;
+            }
+            while (fresh->next != NULL) {
+                fresh = fresh->next;
+            }
+            fresh->next = old;
+            return;
+        }
+        job->command = copy;
+        job->policy = job->policy != NULL ? policy : NULL;
+    }
+    arena_free(old);
+}
+
+/* returns the array of pids of a job */
+static pid_t *job_procs(job_element_t *job) {
+    return job->procs != NULL ? job->procs : job->first_procs;
+}
+
+/* returns the slot of the job with the given jid, -1 if there is none */
+static int find_jid(job_list_t *job_list, int jid) {
+    if (job_list == NULL) {
+        return -1;
+    }
+    return index_find(&job_list->by_jid, jid);
+}
+
+/* returns the slot of the job one of whose processes has the given pid,
+    -1 if there is none */
+static int find_pid(job_list_t *job_list, pid_t pid) {
+    if (job_list == NULL) {
+        return -1;
+    }
+    return index_find(&job_list->by_pid, (int)pid);
+}
+
+/* takes a slot off the free list, growing the slab if needed,
+    returns -1 on failure */
+static int alloc_slot(job_list_t *job_list) {
+    if (job_list->free_slot == -1) {
+        int capacity = job_list->capacity * 2;
+        job_element_t *slots = (job_element_t *)realloc(
+            job_list->slots, sizeof(job_element_t) * (size_t)capacity);
+        if (slots == NULL) {
+            return -1;
+        }
+        for (int i = job_list->capacity; i < capacity; i++) {
+            slots[i].next = i + 1 < capacity ? i + 1 : -1;
+        }
+        job_list->free_slot = job_list->capacity;
+        job_list->slots = slots;
+        job_list->capacity = capacity;
+    }
+    int slot = job_list->free_slot;
+    job_list->free_slot = job_list->slots[slot].next;
+    return slot;
+}
+
+/* unlinks a job from jid order and both indexes, and frees its slot */
+static void free_slot(job_list_t *job_list, int slot) {
+    job_element_t *job = &job_list->slots[slot];
+    pid_t *procs = job_procs(job);
+
+    index_remove(&job_list->by_jid, job->jid);
+    if (index_find(&job_list->by_pid, (int)job->pid) == slot) {
+        index_remove(&job_list->by_pid, (int)job->pid);
+    }
+    for (int i = 0; i < job->nprocs; i++) {
+        if (procs[i] != 0 &&
+            index_find(&job_list->by_pid, (int)procs[i]) == slot) {
+            index_remove(&job_list->by_pid, (int)procs[i]);
+        }
+    }
+
+    if (job->prev != -1) {
+        job_list->slots[job->prev].next = job->next;
+    } else {
+        job_list->head = job->next;
+    }
+    if (job->next != -1) {
+        job_list->slots[job->next].prev = job->prev;
+    } else {
+        job_list->tail = job->prev;
+    }
+    if (job_list->current == slot) {
+        job_list->current = job->next;
+    }
+
+    size_t len = strlen(job->command) + 1;
+    if (job->policy != NULL) {
+        len += strlen(job->policy) + 1;
+    }
+    job->command = NULL;
+    job->policy = NULL;
+    arena_release(job_list, len);
+    free(job->procs);
+    job->procs = NULL;
+
+    job->next = job_list->free_slot;
+    job_list->free_slot = slot;
+    job_list->state_count[job->state]--;
+    job_list->count--;
+}
+
 /* initializes job list, returns pointer */
 job_list_t *init_job_list() {
     job_list_t *job_list = (job_list_t *)malloc(sizeof(job_list_t));
-    job_list->head = NULL;
-    job_list->current = NULL;
+    job_list->capacity = 16;
+    job_list->slots = (job_element_t *)malloc(sizeof(job_element_t) *
+                                              (size_t)job_list->capacity);
+    for (int i = 0; i < job_list->capacity; i++) {
+        job_list->slots[i].next = i + 1 < job_list->capacity ? i + 1 : -1;
+    }
+    job_list->free_slot = 0;
+    job_list->count = 0;
+    job_list->head = -1;
+    job_list->tail = -1;
+    job_list->current = -1;
+    index_init(&job_list->by_jid, 32);
+    index_init(&job_list->by_pid, 32);
+    job_list->arena = NULL;
+    job_list->arena_live = 0;
+    job_list->arena_garbage = 0;
+    memset(job_list->state_count, 0, sizeof(job_list->state_count));
     job_list->shell_pid = getpid();
     return job_list;
 }
@@ -40,29 +370,29 @@ void cleanup_job_list(job_list_t *job_list) {
         return;
     }
 
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        job_element_t *nextElement = cur->next;
+    int slot = job_list->head;
+    while (slot != -1) {
+        job_element_t *cur = &job_list->slots[slot];
 
         // if we are cleaning up the shell's job list and not a child's
-        if (getpid() == job_list->shell_pid) {
+        // (a queued job has no processes yet)
+        if (getpid() == job_list->shell_pid && cur->state != QUEUED) {
             /* kill process */
             if (kill(-cur->pid, SIGKILL) < 0) {
                 perror("kill");
             }
         }
 
-        if (cur->command != NULL) {
-            free(cur->command);
-            cur->command = NULL;
-        }
-
-        free(cur);
-        cur = nextElement;
+        free(cur->procs);
+        slot = cur->next;
     }
 
-    job_list->head = NULL;
-    job_list->current = NULL;
+    free(job_list->slots);
+    free(job_list->by_jid.keys);
+    free(job_list->by_jid.slots);
+    free(job_list->by_pid.keys);
+    free(job_list->by_pid.slots);
+    arena_free(job_list->arena);
     job_list->shell_pid = 0;
 
     free(job_list);
@@ -71,189 +401,322 @@ void cleanup_job_list(job_list_t *job_list) {
 /* adds new job to list, returns 0 on success, -1 on failure */
 int add_job(job_list_t *job_list, int jid, pid_t pid, process_state_t state,
             char *command) {
-    if (job_list == NULL || (state != RUNNING && state != STOPPED) ||
-        command == NULL) {
+    if (job_list == NULL || state == _STATE_NONE || state > QUEUED ||
+        (state == QUEUED) != (pid == 0) || command == NULL ||
+        find_jid(job_list, jid) != -1) {
+        return -1;
+    }
+
+    int slot = alloc_slot(job_list);
+    if (slot == -1) {
+        return -1;
+    }
+    // copy command into the arena to protect our code
+    char *copy = arena_strdup(job_list, command);
+    if (copy == NULL) {
+        job_list->slots[slot].next = job_list->free_slot;
+        job_list->free_slot = slot;
+        return -1;
+    }
+    if (index_insert(&job_list->by_jid, jid, slot) == -1) {
+        job_list->slots[slot].next = job_list->free_slot;
+        job_list->free_slot = slot;
+        arena_release(job_list, strlen(copy) + 1);
+        return -1;
+    }
+    if (pid != 0 && index_insert(&job_list->by_pid, (int)pid, slot) == -1) {
+        index_remove(&job_list->by_jid, jid);
+        job_list->slots[slot].next = job_list->free_slot;
+        job_list->free_slot = slot;
+        arena_release(job_list, strlen(copy) + 1);
         return -1;
     }
 
-    job_element_t *new = (job_element_t *)malloc(sizeof(job_element_t));
+    job_element_t *new = &job_list->slots[slot];
     new->jid = jid;
     new->pid = pid;
-
-    // allocate new char*'s and copy buffers in to protect our code
     new->state = state;
-
-    size_t cmdlen = strlen(command);
-    new->command = (char *)malloc(sizeof(char) * (cmdlen + 1));
-    memcpy(new->command, command, cmdlen);
-    new->command[cmdlen] = 0;
-    new->next = NULL;
-
-    if (job_list->head == NULL) {
-        // add to head
-        job_list->head = new;
-        job_list->current = new;
+    new->command = copy;
+    new->policy = NULL;
+    new->procs = NULL;
+    new->first_procs[0] = pid;
+    new->nprocs = pid != 0;
+    new->nlive = pid != 0;
+    new->status = 0;
+    memset(&new->usage, 0, sizeof(new->usage));
+    clock_gettime(CLOCK_MONOTONIC, &new->started);
+
+    // links into jid order, walking back from the tail since jids are
+    // almost always handed out in increasing order
+    int after = job_list->tail;
+    while (after != -1 && job_list->slots[after].jid > jid) {
+        after = job_list->slots[after].prev;
+    }
+    new->prev = after;
+    new->next = after == -1 ? job_list->head : job_list->slots[after].next;
+    if (new->prev != -1) {
+        job_list->slots[new->prev].next = slot;
     } else {
-        // add to tail
-        job_element_t *cur = job_list->head;
-        while (cur->next != NULL) {
-            cur = cur->next;
-        }
-        cur->next = new;
+        job_list->head = slot;
     }
+    if (new->next != -1) {
+        job_list->slots[new->next].prev = slot;
+    } else {
+        job_list->tail = slot;
+    }
+    if (job_list->count == 0) {
+        job_list->current = slot;
+    }
+    job_list->state_count[state]++;
+    job_list->count++;
 
     return 0;
 }
 
-/* removes job from list, given job's JID,
+/* adds another process to an existing job (e.g. a later pipeline stage),
     returns 0 on success, -1 on failure */
-int remove_job_jid(job_list_t *job_list, int jid) {
-    if (job_list == NULL) {
+int add_job_process(job_list_t *job_list, int jid, pid_t pid) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1) {
         return -1;
     }
 
-    job_element_t *prev = NULL;
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        if (cur->jid == jid) {
-            if (prev != NULL) {
-                prev->next = cur->next;
-            }
-            if (job_list->head == cur) {
-                job_list->head = cur->next;
+    job_element_t *cur = &job_list->slots[slot];
+    if (cur->nprocs >= JOB_INLINE_PROCS) {
+        // spills to the heap once the inline array is full, doubling after
+        int n = cur->nprocs;
+        if (cur->procs == NULL || (n & (n - 1)) == 0) {
+            pid_t *procs = (pid_t *)realloc(cur->procs,
+                                            sizeof(pid_t) * (size_t)n * 2);
+            if (procs == NULL) {
+                return -1;
             }
-            if (job_list->current == cur) {
-                job_list->current = cur->next;
+            if (cur->procs == NULL) {
+                memcpy(procs, cur->first_procs, sizeof(cur->first_procs));
             }
-
-            if (cur->command != NULL) {
-                free(cur->command);
-                cur->command = NULL;
-            }
-
-            free(cur);
-            cur = NULL;
-
-            return 0;
+            cur->procs = procs;
         }
-
-        prev = cur;
-        cur = cur->next;
     }
+    if (index_insert(&job_list->by_pid, (int)pid, slot) == -1) {
+        return -1;
+    }
+    job_procs(cur)[cur->nprocs] = pid;
+    cur->nprocs++;
+    cur->nlive++;
+    return 0;
+}
 
-    return -1;
+/* adds the resource usage of one process to the total of its job */
+static void add_usage(struct rusage *total, const struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    // the job needed as much memory as its largest process
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_inblock += usage->ru_inblock;
+    total->ru_oublock += usage->ru_oublock;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
 }
 
-/* removes job from list, given job's PID,
-    returns 0 on success, -1 on failure */
-int remove_job_pid(job_list_t *job_list, pid_t pid) {
-    if (job_list == NULL) {
+/* marks one process of a job as terminated with the given wait status and
+    adds its resource usage (if not NULL) to the job's,
+    returns the number of the job's processes still alive, -1 on failure */
+int finish_job_process(job_list_t *job_list, pid_t pid, int status,
+                       const struct rusage *usage) {
+    if (pid <= 0) {
+        return -1;
+    }
+    int slot = find_pid(job_list, pid);
+    if (slot == -1) {
         return -1;
     }
 
-    job_element_t *prev = NULL;
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        if (cur->pid == pid) {
-            if (prev != NULL) {
-                prev->next = cur->next;
+    job_element_t *cur = &job_list->slots[slot];
+    pid_t *procs = job_procs(cur);
+    for (int i = 0; i < cur->nprocs; i++) {
+        if (procs[i] == pid) {
+            // the pipeline's status is that of its last process
+            if (i == cur->nprocs - 1) {
+                cur->status = status;
             }
-            if (job_list->head == cur) {
-                job_list->head = cur->next;
+            if (usage != NULL) {
+                add_usage(&cur->usage, usage);
             }
-            if (job_list->current == cur) {
-                job_list->current = cur->next;
+            procs[i] = 0;
+            cur->nlive--;
+            // the first pid stays indexed as it names the process group
+            if (pid != cur->pid) {
+                index_remove(&job_list->by_pid, (int)pid);
             }
+            return cur->nlive;
+        }
+    }
 
-            if (cur->command != NULL) {
-                free(cur->command);
-                cur->command = NULL;
-            }
-            free(cur);
-            cur = NULL;
+    return -1;
+}
 
-            return 0;
-        }
+/* removes job from list, given job's JID,
+    returns 0 on success, -1 on failure */
+int remove_job_jid(job_list_t *job_list, int jid) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1) {
+        return -1;
+    }
 
-        prev = cur;
-        cur = cur->next;
+    free_slot(job_list, slot);
+    return 0;
+}
+
+/* removes job from list, given the PID of any of its processes,
+    returns 0 on success, -1 on failure */
+int remove_job_pid(job_list_t *job_list, pid_t pid) {
+    int slot = find_pid(job_list, pid);
+    if (slot == -1) {
+        return -1;
     }
 
-    return -1;
+    free_slot(job_list, slot);
+    return 0;
 }
 
 /* updates job's state, given job's JID, returns 0 on success, -1 on failure */
 int update_job_jid(job_list_t *job_list, int jid, process_state_t state) {
-    if (job_list == NULL) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1 || state == _STATE_NONE || state > QUEUED) {
         return -1;
     }
 
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        if (cur->jid == jid) {
-            cur->state = state;
-            return 0;
-        }
+    job_list->state_count[job_list->slots[slot].state]--;
+    job_list->state_count[state]++;
+    job_list->slots[slot].state = state;
+    return 0;
+}
 
-        cur = cur->next;
+/* updates job's state, given the PID of any of its processes,
+    returns 0 on success, -1 on failure */
+int update_job_pid(job_list_t *job_list, pid_t pid, process_state_t state) {
+    int slot = find_pid(job_list, pid);
+    if (slot == -1 || state == _STATE_NONE || state > QUEUED) {
+        return -1;
     }
 
-    return -1;
+    job_list->state_count[job_list->slots[slot].state]--;
+    job_list->state_count[state]++;
+    job_list->slots[slot].state = state;
+    return 0;
 }
 
-/* updates job's state, given job's PID, returns 0 on success, -1 on failure */
-int update_job_pid(job_list_t *job_list, pid_t pid, process_state_t state) {
-    if (job_list == NULL) {
+/* records how a job's processes are confined (CPU affinity, resource limits,
+    cgroup) for the jobs command, given job's JID,
+    returns 0 on success, -1 on failure */
+int set_job_policy(job_list_t *job_list, int jid, const char *policy) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1 || policy == NULL) {
         return -1;
     }
 
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        if (cur->pid == pid) {
-            cur->state = state;
-            return 0;
-        }
+    // the old policy is let go first, as releasing it may move the strings
+    job_element_t *job = &job_list->slots[slot];
+    if (job->policy != NULL) {
+        size_t len = strlen(job->policy) + 1;
+        job->policy = NULL;
+        arena_release(job_list, len);
+    }
+    job->policy = arena_strdup(job_list, policy);
+    return job->policy != NULL ? 0 : -1;
+}
 
-        cur = cur->next;
+/* gets PID of job, given job's JID, returns PID on success (0 if the job is
+    QUEUED), -1 on failure */
+pid_t get_job_pid(job_list_t *job_list, int jid) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1) {
+        return -1;
     }
 
-    return -1;
+    return job_list->slots[slot].pid;
 }
 
-/* gets PID of job, given job's JID, returns PID on success, -1 on failure */
-pid_t get_job_pid(job_list_t *job_list, int jid) {
-    if (job_list == NULL) {
+/* gets JID of job, given the PID of any of its processes,
+    returns JID on success, -1 on failure */
+int get_job_jid(job_list_t *job_list, pid_t pid) {
+    int slot = find_pid(job_list, pid);
+    if (slot == -1) {
         return -1;
     }
 
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        if (cur->jid == jid) {
-            return cur->pid;
-        }
+    return job_list->slots[slot].jid;
+}
 
-        cur = cur->next;
+/* gets state of job, given job's JID, returns _STATE_NONE on failure */
+process_state_t get_job_state(job_list_t *job_list, int jid) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1) {
+        return _STATE_NONE;
     }
 
-    return -1;
+    return job_list->slots[slot].state;
 }
 
-/* gets JID of job, given job's PID, returns JID on success, -1 on failure */
-int get_job_jid(job_list_t *job_list, pid_t pid) {
-    if (job_list == NULL) {
+/* gets wait status of the last process of a job's pipeline, given job's JID,
+    returns -1 on failure */
+int get_job_status(job_list_t *job_list, int jid) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1) {
         return -1;
     }
 
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        if (cur->pid == pid) {
-            return cur->jid;
+    return job_list->slots[slot].status;
+}
+
+/* gets the PIDs of a job's processes that have not terminated yet, given
+    job's JID, storing up to max of them in pids,
+    returns their number (which may exceed max) on success, -1 on failure */
+int get_job_pids(job_list_t *job_list, int jid, pid_t *pids, int max) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1) {
+        return -1;
+    }
+
+    job_element_t *cur = &job_list->slots[slot];
+    pid_t *procs = job_procs(cur);
+    int count = 0;
+    for (int i = 0; i < cur->nprocs; i++) {
+        if (procs[i] != 0) {
+            if (count < max) {
+                pids[count] = procs[i];
+            }
+            count++;
         }
+    }
+    return count;
+}
 
-        cur = cur->next;
+/* gets the resource usage of a job's processes reaped so far and the time
+    it was started (CLOCK_MONOTONIC), given job's JID,
+    returns 0 on success, -1 on failure */
+int get_job_usage(job_list_t *job_list, int jid, struct rusage *usage,
+                  struct timespec *started) {
+    int slot = find_jid(job_list, jid);
+    if (slot == -1) {
+        return -1;
     }
 
-    return -1;
+    *usage = job_list->slots[slot].usage;
+    *started = job_list->slots[slot].started;
+    return 0;
+}
+
+/* gets the number of jobs in the given state */
+int get_job_count(job_list_t *job_list, process_state_t state) {
+    if (job_list == NULL || state > QUEUED) {
+        return 0;
+    }
+    return job_list->state_count[state];
 }
 
 /*
@@ -267,31 +730,137 @@ pid_t get_next_pid(job_list_t *job_list) {  // circular iterator
         return -1;
     }
 
-    if (job_list->current == NULL) {
+    if (job_list->current == -1) {
         job_list->current = job_list->head;
         return -1;
     } else {
-        pid_t pid = job_list->current->pid;
-        job_list->current = job_list->current->next;
-        return pid;
+        job_element_t *cur = &job_list->slots[job_list->current];
+        job_list->current = cur->next;
+        return cur->pid;
     }
 }
 
-/* jobs command, prints out the jobs list */
-void jobs(job_list_t *job_list) {
+/*
+ * gets next JID in list, sharing get_next_pid's position
+ * returns the JID if there is one, -1 if the end of the list has been reached,
+ * after which it will start at the head of the list again
+ */
+int get_next_jid(job_list_t *job_list) {  // circular iterator
+    if (job_list == NULL) {
+        return -1;
+    }
+
+    if (job_list->current == -1) {
+        job_list->current = job_list->head;
+        return -1;
+    } else {
+        job_element_t *cur = &job_list->slots[job_list->current];
+        job_list->current = cur->next;
+        return cur->jid;
+    }
+}
+
+/* adds the resource usage so far of a process that is still running, as
+    found in /proc, to total; returns 0 on success, -1 on failure */
+static int add_live_usage(struct rusage *total, pid_t pid) {
+    char path[64];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *file = fopen(path, "re");
+    if (file == NULL) {
+        return -1;
+    }
+    size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+    // fields after the command name, which is in parentheses and may
+    // itself contain spaces: state ppid pgrp session tty_nr tpgid flags
+    // minflt cminflt majflt cmajflt utime stime
+    char *fields = strrchr(buf, ')');
+    unsigned long minflt;
+    unsigned long majflt;
+    unsigned long utime;
+    unsigned long stime;
+    if (fields == NULL ||
+        sscanf(fields + 1,
+               " %*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+               &minflt, &majflt, &utime, &stime) != 4) {
+        return -1;
+    }
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    long ticks = sysconf(_SC_CLK_TCK);
+    usage.ru_utime.tv_sec = utime / ticks;
+    usage.ru_utime.tv_usec = utime % ticks * 1000000 / ticks;
+    usage.ru_stime.tv_sec = stime / ticks;
+    usage.ru_stime.tv_usec = stime % ticks * 1000000 / ticks;
+    usage.ru_minflt = minflt;
+    usage.ru_majflt = majflt;
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((file = fopen(path, "re")) != NULL) {
+        while (fgets(buf, sizeof(buf), file) != NULL) {
+            sscanf(buf, "VmHWM: %ld", &usage.ru_maxrss);
+            sscanf(buf, "voluntary_ctxt_switches: %ld", &usage.ru_nvcsw);
+            sscanf(buf, "nonvoluntary_ctxt_switches: %ld", &usage.ru_nivcsw);
+        }
+        fclose(file);
+    }
+    add_usage(total, &usage);
+    return 0;
+}
+
+/* jobs command, prints out the jobs list, with each job's policy if it has
+    one, and its running time and resource usage if long_format is set */
+void jobs(job_list_t *job_list, int long_format) {
     if (job_list == NULL) {
         return;
     }
 
-    job_element_t *cur = job_list->head;
-    while (cur != NULL) {
-        char *state_string = cur->state == RUNNING ? "Running" : "Stopped";
-        if (printf("[%d] (%d) %s %s\n", cur->jid, cur->pid, state_string,
-                   cur->command) < 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int slot = job_list->head;
+    while (slot != -1) {
+        job_element_t *cur = &job_list->slots[slot];
+        char *state_string = cur->state == RUNNING   ? "Running"
+                             : cur->state == STOPPED ? "Stopped"
+                                                     : "Queued";
+        int ret;
+        if (long_format) {
+            // the usage of the processes still running comes from /proc
+            struct rusage usage = cur->usage;
+            struct rusage *ru = &usage;
+            pid_t *procs = job_procs(cur);
+            for (int i = 0; i < cur->nprocs; i++) {
+                if (procs[i] != 0) {
+                    add_live_usage(&usage, procs[i]);
+                }
+            }
+            double elapsed = (double)(now.tv_sec - cur->started.tv_sec) +
+                             (now.tv_nsec - cur->started.tv_nsec) / 1e9;
+            ret = printf("[%d] (%d) %s %.2fs real %ld.%02lds user "
+                         "%ld.%02lds sys %ldKB maxrss %ld/%ld csw %ld/%ld "
+                         "faults %s",
+                         cur->jid, cur->pid, state_string, elapsed,
+                         (long)ru->ru_utime.tv_sec,
+                         (long)ru->ru_utime.tv_usec / 10000,
+                         (long)ru->ru_stime.tv_sec,
+                         (long)ru->ru_stime.tv_usec / 10000, ru->ru_maxrss,
+                         ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt,
+                         ru->ru_majflt, cur->command);
+        } else {
+            ret = printf("[%d] (%d) %s %s", cur->jid, cur->pid,
+                         state_string, cur->command);
+        }
+        if (ret >= 0) {
+            ret = cur->policy != NULL ? printf(" {%s}\n", cur->policy)
+                                      : printf("\n");
+        }
+        if (ret < 0) {
             fprintf(stderr, "error printing jobs list\n");
             cleanup_job_list(job_list);
             exit(1);
         }
-        cur = cur->next;
+        slot = cur->next;
     }
-}
\ No newline at end of file
+}
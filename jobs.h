@@ -0,0 +1,105 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* a QUEUED job is waiting to be started and has no processes (its pid is 0) */
+typedef enum { _STATE_NONE, RUNNING, STOPPED, QUEUED } process_state_t;
+
+typedef struct job_list job_list_t;
+
+/* initializes job list, returns pointer */
+job_list_t *init_job_list();
+
+/* cleans up jobs list, killing every job if called from the shell */
+void cleanup_job_list(job_list_t *job_list);
+
+/* adds new job to list, returns 0 on success, -1 on failure
+ * pid is the first process of the job and doubles as its process group id,
+ * or 0 for a QUEUED job */
+int add_job(job_list_t *job_list, int jid, pid_t pid, process_state_t state,
+            char *command);
+
+/* adds another process to an existing job (e.g. a later pipeline stage),
+ * returns 0 on success, -1 on failure */
+int add_job_process(job_list_t *job_list, int jid, pid_t pid);
+
+/* marks one process of a job as terminated with the given wait status and
+ * adds its resource usage (if not NULL) to the job's,
+ * returns the number of the job's processes still alive, -1 on failure */
+int finish_job_process(job_list_t *job_list, pid_t pid, int status,
+                       const struct rusage *usage);
+
+/* removes job from list, given job's JID,
+    returns 0 on success, -1 on failure */
+int remove_job_jid(job_list_t *job_list, int jid);
+
+/* removes job from list, given the PID of any of its processes,
+    returns 0 on success, -1 on failure */
+int remove_job_pid(job_list_t *job_list, pid_t pid);
+
+/* updates job's state, given job's JID, returns 0 on success, -1 on failure */
+int update_job_jid(job_list_t *job_list, int jid, process_state_t state);
+
+/* updates job's state, given the PID of any of its processes,
+    returns 0 on success, -1 on failure */
+int update_job_pid(job_list_t *job_list, pid_t pid, process_state_t state);
+
+/* records how a job's processes are confined (CPU affinity, resource limits,
+    cgroup) for the jobs command, given job's JID,
+    returns 0 on success, -1 on failure */
+int set_job_policy(job_list_t *job_list, int jid, const char *policy);
+
+/* gets PID of job, given job's JID, returns PID on success (0 if the job is
+    QUEUED), -1 on failure */
+pid_t get_job_pid(job_list_t *job_list, int jid);
+
+/* gets JID of job, given the PID of any of its processes,
+    returns JID on success, -1 on failure */
+int get_job_jid(job_list_t *job_list, pid_t pid);
+
+/* gets state of job, given job's JID, returns _STATE_NONE on failure */
+process_state_t get_job_state(job_list_t *job_list, int jid);
+
+/* gets wait status of the last process of a job's pipeline, given job's JID,
+    returns -1 on failure */
+int get_job_status(job_list_t *job_list, int jid);
+
+/* gets the PIDs of a job's processes that have not terminated yet, given
+    job's JID, storing up to max of them in pids,
+    returns their number (which may exceed max) on success, -1 on failure */
+int get_job_pids(job_list_t *job_list, int jid, pid_t *pids, int max);
+
+/* gets the resource usage of a job's processes reaped so far and the time
+    it was started (CLOCK_MONOTONIC), given job's JID,
+    returns 0 on success, -1 on failure */
+int get_job_usage(job_list_t *job_list, int jid, struct rusage *usage,
+                  struct timespec *started);
+
+/* gets the number of jobs in the given state */
+int get_job_count(job_list_t *job_list, process_state_t state);
+
+/*
+ * gets next PID in list
+ * call this in a loop to get the PID of the next job in the list
+ * returns the PID if there is one, -1 if the end of the list has been reached,
+ * after which it will start at the head of the list again
+ */
+pid_t get_next_pid(job_list_t *job_list);
+
+/*
+ * gets next JID in list, sharing get_next_pid's position
+ * returns the JID if there is one, -1 if the end of the list has been reached,
+ * after which it will start at the head of the list again
+ */
+int get_next_jid(job_list_t *job_list);
+
+/* jobs command, prints out the jobs list, with each job's policy if it has
+    one, and its running time and resource usage (from /proc for processes
+    still running) if long_format is set */
+void jobs(job_list_t *job_list, int long_format);
+
+#endif
@@ -1,122 +1,935 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "./jobs.h"
-#define BUFSIZE 1024
+// pidfd_open has no glibc wrapper before 2.36, close_range none before 2.34
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+// Initial size of the input buffer, which grows to fit longer lines
+#define BUFSIZE 65536
+// Returned by a built-in that leaves the command to the program of that name
+#define RUN_EXTERNAL -1
+// Argument the shell is executed with to run as its own fork server, the
+// socket to the shell being fd 3
+#define FORK_SERVER_ARG "--fork-server"
+// Largest launch request sent to the fork server; longer commands are forked
+// by the shell itself
+#define SERVER_REQUEST_MAX 131072
+// Pipe size asked for by an output relay, and so the most bytes it moves at
+// once
+#define RELAY_CHUNK (1 << 20)
+// Size of the batches of directory entries read by globbing
+#define GLOB_BATCH (1 << 20)
+// Room made in the buffer of a command substitution before each read of
+// its output, and how often a job writing it is checked for being stopped
+#define CAPTURE_CHUNK (1 << 16)
+#define CAPTURE_POLL_MS 100
+// Deepest nesting of function calls, each of which takes C stack
+#define MAX_FUNCTION_NESTING 1000
+// How long children must be quiet before the prompt is drawn again under
+// the job notices printed while it was waiting for input
+#define NOTICE_QUIET_MS 20
 // Job ID and jobList global variables
 int job = 1;
 job_list_t *jobList;
+// Exit status of the last pipeline that ran, which && and || test
+int lastStatus = 0;
+// Resource usage of the last foreground job, which time reports
+struct rusage lastJobUsage;
+// SIGCHLD is blocked in the shell and delivered through this signalfd, so
+// reaping only happens when some child actually changed state
+int sigchldFd = -1;
+sigset_t shellMask;
+// Whether stdin is a terminal whose control is handed to foreground jobs;
+// when commands are fed through a pipe or file there is no job control
+int terminal = 0;
+// Whether this process is a copy of the shell running a command
+// substitution, which hands its output over when it exits
+int subshell = 0;
+// How execute launches each child: fork() followed by runChild, a single
+// posix_spawn() (which glibc implements with clone(CLONE_VM | CLONE_VFORK),
+// so its cost does not grow with the shell's address space), or a request
+// to the fork server, a freshly executed copy of the shell that forks the
+// child off its own small address space
+enum { SPAWN_FORK, SPAWN_POSIX, SPAWN_SERVER } spawnBackend = SPAWN_FORK;
+// Socket to the fork server, -1 while it is not running, and the envVersion
+// of the environment it holds (0 for none, or one of a single command)
+int serverFd = -1;
+unsigned long serverEnvVersion = 0;
+// Admission control for background jobs: a job started with & is queued
+// while jobLimit jobs are running or the 1 minute load average is at least
+// loadLimit (0 disables either limit)
+int jobLimit = 0;
+double loadLimit = 0;
+// Priority in the queue given with the queue prefix to the job being started
+int launchPriority = 0;
+// How the processes of the job being started run, as given with the queue
+// and limit prefixes; posix_spawn can apply none of it, so a job with a
+// policy is always forked
+typedef struct launch_policy {
+    int nice;
+    int pinned;  // whether the job is bound to cpus
+    cpu_set_t cpus;
+    int nlimits;
+    struct {
+        int resource;
+        struct rlimit limit;
+    } limits[16];
+    char cgroup[PATH_MAX];  // cgroup v2 directory to join, empty for none
+    char text[256];         // the above but nice, as shown by jobs
+} launch_policy_t;
+launch_policy_t launchPolicy;
+extern char **environ;
+// Environment of the program being launched: envp, or one of its own for a
+// command with assignments
+char **launchEnv = NULL;
+
+/* A remembered PATH lookup, like the entries of bash's hash table */
+typedef struct hash_entry {
+    char *name;
+    char *path;
+    int dir;   // index into pathDirs of the directory it was found in
+    int hits;  // times the entry was used
+} hash_entry_t;
+
+/* A directory of the PATH the table was built from */
+typedef struct path_dir {
+    char *name;
+    struct timespec mtime;
+} path_dir_t;
+
+// Open-addressed table from command name to its full path; it is flushed
+// whenever PATH changes or one of its directories gains or loses an entry
+hash_entry_t *hashTable = NULL;
+size_t hashCapacity = 0;
+size_t hashCount = 0;
+long hashHits = 0;
+long hashMisses = 0;
+char *hashedPath = NULL;  // the PATH value the table was built for
+path_dir_t *pathDirs = NULL;
+int numPathDirs = 0;
+// inotify watches on pathDirs, -1 if unavailable, in which case the mtime of
+// an entry's directory is checked on every hit instead
+int pathWatchFd = -1;
+
+/* An output redirect of a command beyond its first */
+typedef struct redirect {
+    char *file;
+    int append;
+} redirect_t;
+
+// Flags of command_t's coproc: its input or output is the name of a
+// coprocess (<&NAME, >&NAME) rather than a file
+#define COPROC_IN 1
+#define COPROC_OUT 2
+
+/* A single command of a pipeline along with its own redirections; with
+ * further output files in tees, its output is relayed to all of them */
+typedef struct command {
+    char **argv;
+    char *path;  // program to execute, resolved from argv[0] by execute
+    char *input;
+    char *output;
+    int append;
+    redirect_t *tees;
+    int ntees;
+    int coproc;  // COPROC_IN, COPROC_OUT: input, output name a coprocess
+    char **assigns;  // NAME=value words before the command, for its
+    int nassigns;    // environment
+    int expand;  // its words still hold $, wildcards and quotes, for
+                 // expandPipeline
+} command_t;
+
+/* One pipeline of a command list, with how it is joined to the one before:
+ * TOK_SEMI (first pipeline, or after ; or &), TOK_AND or TOK_OR */
+typedef struct pipeline {
+    command_t *cmds;
+    int ncmds;
+    int background;
+    int connector;
+} pipeline_t;
+
+/* Character classes driving the lexer */
+enum { C_WORD = 0, C_SPACE, C_OP, C_QUOTE, C_ESCAPE, C_END };
+static const unsigned char charClass[256] = {
+    ['\0'] = C_END,  [' '] = C_SPACE, ['\t'] = C_SPACE, ['\n'] = C_SPACE,
+    ['|'] = C_OP,    ['<'] = C_OP,    ['>'] = C_OP,     ['&'] = C_OP,
+    [';'] = C_OP,
+    ['\''] = C_QUOTE, ['"'] = C_QUOTE, ['\\'] = C_ESCAPE,
+};
+
+/* Kinds of tokens produced by lex */
+typedef enum {
+    TOK_WORD,
+    TOK_PIPE,    // |
+    TOK_IN,      // <
+    TOK_OUT,     // >
+    TOK_APPEND,  // >>
+    TOK_AMP,     // &
+    TOK_SEMI,    // ;
+    TOK_AND,     // &&
+    TOK_OR,      // ||
+    TOK_DUP_IN,  // <& (input from a coprocess)
+    TOK_DUP_OUT, // >& (output to a coprocess)
+} token_kind_t;
+
+/* Text of each operator token, for error messages */
+static const char *tokenText[] = {"word", "|",  "<",  ">",  ">>", "&",
+                                  ";",    "&&", "||", "<&", ">&"};
+
+/* A token as a span of the input buffer */
+typedef struct token {
+    size_t offset;
+    size_t len;
+    token_kind_t kind;
+    int quoted;  // word contains quotes or backslashes to be removed
+    int expand;  // word contains a $ or ` outside single quotes, or an
+                 // unquoted wildcard
+} token_t;
+
+/*  Description:
+        Finds the end of the command substitution starting at buf[i], $(...)
+        or `...`. Parentheses nest in the first, outside quotes; a backslash
+        escapes the next byte in both.
+    Returns:
+        the index past its closing ) or `, 0 if it is not closed */
+size_t substitutionEnd(const char *buf, size_t i) {
+    if (buf[i] == '`') {
+        for (i++; buf[i] != '`'; i++) {
+            if (buf[i] == '\0') {
+                return 0;
+            }
+            i += buf[i] == '\\' && buf[i + 1] != '\0';
+        }
+        return i + 1;
+    }
+    int depth = 0;
+    for (i++;; i++) {
+        char c = buf[i];
+        if (c == '\0') {
+            return 0;
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')' && --depth == 0) {
+            return i + 1;
+        } else if (c == '\\' && buf[i + 1] != '\0') {
+            i++;
+        } else if (c == '\'' || c == '"' || c == '`') {
+            // Skips to the closing quote, a backslash escaping one in
+            // double quotes and backquotes
+            for (i++; buf[i] != c; i++) {
+                if (buf[i] == '\0') {
+                    return 0;
+                }
+                i += c != '\'' && buf[i] == '\\' && buf[i + 1] != '\0';
+            }
+        }
+    }
+}
+
+/*
+ * - Description:
+ *      Splits a line into tokens in a single pass, classifying each byte
+ * through charClass. Words run until an unquoted blank or operator; text in
+ * single quotes is literal, in double quotes a backslash only escapes $ ` "
+ * and \, and elsewhere a backslash escapes any character. A command
+ * substitution is part of the word, whatever it holds. The buffer is not
+ * modified.
+ * - Arguments:
+ *      buf: NUL terminated line
+ *      tokens: filled with the tokens found, at most strlen(buf) of them
+ * - Returns:
+ *      the number of tokens, or -1 if a quote (or substitution) was left
+ * unterminated
+ */
+int lex(const char *buf, token_t tokens[]) {
+    int n = 0;
+    size_t i = 0;
+    while (1) {
+        unsigned char c = (unsigned char)buf[i];
+        int cls = charClass[c];
+        if (cls == C_END) {
+            return n;
+        }
+        if (cls == C_SPACE) {
+            i++;
+            continue;
+        }
+        token_t *token = &tokens[n++];
+        token->offset = i;
+        token->len = 1;
+        token->quoted = 0;
+        token->expand = 0;
+        if (cls == C_OP) {
+            if (c == '|') {
+                token->kind = buf[i + 1] == '|' ? TOK_OR : TOK_PIPE;
+            } else if (c == '<') {
+                token->kind = buf[i + 1] == '&' ? TOK_DUP_IN : TOK_IN;
+            } else if (c == '&') {
+                token->kind = buf[i + 1] == '&' ? TOK_AND : TOK_AMP;
+            } else if (c == ';') {
+                token->kind = TOK_SEMI;
+            } else if (buf[i + 1] == '>') {
+                token->kind = TOK_APPEND;
+                token->len = 2;
+            } else {
+                token->kind = buf[i + 1] == '&' ? TOK_DUP_OUT : TOK_OUT;
+            }
+            if (token->kind == TOK_OR || token->kind == TOK_AND ||
+                token->kind == TOK_DUP_IN || token->kind == TOK_DUP_OUT) {
+                token->len = 2;
+            }
+            i += token->len;
+            continue;
+        }
+        token->kind = TOK_WORD;
+        while ((cls = charClass[(unsigned char)buf[i]]) != C_END &&
+               cls != C_SPACE && cls != C_OP) {
+            if (cls == C_ESCAPE) {
+                token->quoted = 1;
+                i += buf[i + 1] != '\0' ? 2 : 1;
+            } else if (buf[i] == '\'') {
+                token->quoted = 1;
+                const char *close = strchr(buf + i + 1, '\'');
+                if (close == NULL) {
+                    return -1;
+                }
+                i = (size_t)(close - buf) + 1;
+            } else if (cls == C_QUOTE) {
+                token->quoted = 1;
+                i++;
+                while (buf[i] != '"') {
+                    if (buf[i] == '\0') {
+                        return -1;
+                    }
+                    token->expand |= buf[i] == '$' || buf[i] == '`';
+                    if ((buf[i] == '$' && buf[i + 1] == '(') ||
+                        buf[i] == '`') {
+                        if ((i = substitutionEnd(buf, i)) == 0) {
+                            return -1;
+                        }
+                        continue;
+                    }
+                    i += buf[i] == '\\' && buf[i + 1] != '\0' ? 2 : 1;
+                }
+                i++;
+            } else if ((buf[i] == '$' && buf[i + 1] == '(') || buf[i] == '`') {
+                token->expand = 1;
+                if ((i = substitutionEnd(buf, i)) == 0) {
+                    return -1;
+                }
+            } else {
+                token->expand |= strchr("$*?[", buf[i]) != NULL;
+                i++;
+            }
+        }
+        token->len = i - token->offset;
+    }
+}
+
+/*
+ * - Description:
+ *      Removes the quotes and backslashes from a quoted word in place; the
+ * result is never longer than the word, so no copy is needed
+ * - Arguments:
+ *      word: start of the word in the buffer
+ *      len: length of the word as lexed
+ * - Returns:
+ *      the length of the unquoted word
+ */
+size_t unquote(char *word, size_t len) {
+    size_t out = 0;
+    size_t i = 0;
+    while (i < len) {
+        char c = word[i];
+        if (c == '\\' && i + 1 < len) {
+            word[out++] = word[i + 1];
+            i += 2;
+        } else if (c == '\'') {
+            for (i++; word[i] != '\''; i++) {
+                word[out++] = word[i];
+            }
+            i++;
+        } else if (c == '"') {
+            for (i++; word[i] != '"'; i++) {
+                if (word[i] == '\\' && strchr("$`\"\\", word[i + 1]) != NULL) {
+                    i++;
+                }
+                word[out++] = word[i];
+            }
+            i++;
+        } else {
+            word[out++] = word[i++];
+        }
+    }
+    return out;
+}
+
+/*  Description:
+        Returns the length of the variable name at the start of s: letters,
+        digits and underscores not starting with a digit, 0 if there is
+        none */
+size_t varNameLen(const char *s) {
+    if (!isalpha((unsigned char)s[0]) && s[0] != '_') {
+        return 0;
+    }
+    size_t len = 1;
+    while (isalnum((unsigned char)s[len]) || s[len] == '_') {
+        len++;
+    }
+    return len;
+}
+
+/*  Description:
+        Returns whether a token kind is a redirection operator */
+int isRedirect(token_kind_t kind) {
+    return kind == TOK_IN || kind == TOK_OUT || kind == TOK_APPEND ||
+           kind == TOK_DUP_IN || kind == TOK_DUP_OUT;
+}
+
+/*  Description:
+        Returns whether a word of the stage starting at token t has a $ or
+        a wildcard to expand, in which case parse keeps all of the stage's
+        words as lexed for expandPipeline */
+int stageExpands(const token_t tokens[], int t, int ntokens) {
+    for (; t < ntokens &&
+           (tokens[t].kind == TOK_WORD || isRedirect(tokens[t].kind));
+         t++) {
+        if (tokens[t].expand) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Reserved words of the compound commands, recognized at the start of a
+ * command; a NAME() word starts the definition of a function */
+typedef enum {
+    KW_NONE,
+    KW_IF,
+    KW_THEN,
+    KW_ELIF,
+    KW_ELSE,
+    KW_FI,
+    KW_WHILE,
+    KW_FOR,
+    KW_DO,
+    KW_DONE,
+    KW_LBRACE,
+    KW_RBRACE,
+    KW_FUNCTION,
+} keyword_t;
+
+/* Text of each reserved word, for keywordOf and error messages */
+static const char *keywordText[] = {"",   "if", "then", "elif", "else",
+                                    "fi", "while", "for", "do", "done",
+                                    "{",  "}",  "()"};
+
+/*  Description:
+        Returns the reserved word a word is, KW_NONE if it is none */
+keyword_t keywordOf(const char *word) {
+    // Most words are told apart by their first byte
+    if (word[0] != '\0' && strchr("itefwd{}", word[0]) != NULL) {
+        for (int k = KW_IF; k < KW_FUNCTION; k++) {
+            if (!strcmp(word, keywordText[k])) {
+                return (keyword_t)k;
+            }
+        }
+    }
+    size_t len = varNameLen(word);
+    return len > 0 && !strcmp(word + len, "()") ? KW_FUNCTION : KW_NONE;
+}
 
 /*
  * - Description:
- *      Fills the token and argv arrays by parsing the buffer character array
+ *      Fills the argv, cmds and pipelines arrays by parsing the buffer
+ * character array into a list of pipelines separated by ; & && or ||, each
+ * split into stages at its | tokens. Words are unquoted and NUL terminated
+ * inside the buffer itself, so argv points into it.
  * - Arguments:
  *      buffer: a char array representing user input
- *      argv: the argument array eventually used for execv() filled with buffer
- * tokens
- *      input: a redirected input if found output: a redirected output file if
- * found
- *      append: boolean representing if >> was the specified output redirect
- *      background: boolean representing if & was last character in input line
+ *      argv: storage for the tokens of every stage, each stage's argument
+ * list being NULL terminated (strlen(buffer) + 1 entries)
+ *      cmds: storage for the stages of every pipeline, whose argv points
+ * into argv and whose input/output/append/coproc describe its redirects;
+ * leading NAME=value words go to its assigns, and a stage with a $ or a
+ * wildcard to expand keeps its words as lexed, quotes and all
+ *      redirects: storage for the output redirects after the first of each
+ * stage, which its tees point to (strlen(buffer) + 1 entries)
+ *      pipelines: filled with the pipelines of the list, whose cmds point
+ * into cmds
+ *      npipelines: set to the number of pipelines found
+ * - Returns:
+ *      0 on success, -1 if a syntax error was reported
  */
-void parse(char buffer[], char *argv[], char **input, char **output,
-           int *append, int *background) {
+int parse(char buffer[], char *argv[], command_t cmds[],
+          redirect_t redirects[], pipeline_t pipelines[], int *npipelines) {
     /*  Setup */
+    token_t *tokens = (token_t *)malloc(sizeof(token_t) * (strlen(buffer) + 1));
+    if (tokens == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    int ntokens = lex(buffer, tokens);
+    if (ntokens == -1) {
+        fprintf(stderr, "syntax error: unterminated quote\n");
+        free(tokens);
+        return -1;
+    }
     int ctr = 0;
-    char *buf = buffer;
-    char *token;
-    /*  Booleans indicating to tokenizer if next term should be file redirect */
-    int lookInput = 0;
-    int lookOutput = 0;
-    /*  Checks for tokens in buffer and saves to argv
-        unless token is a redirect symbol/redirect file
-        and checks for syntax errors */
-    while ((token = strtok(buf, " \t\n")) != NULL) {
-        /*  Checks if previous token was an input or output redirect symbol
-            and reacts appropriately */
-        if (lookInput) {
-            if (!strcmp(token, "<") || !strcmp(token, ">") ||
-                !strcmp(token, ">>")) {
-                fprintf(stderr,
-                        "syntax error: input file is a redirection symbol\n");
-                return;
+    int ncmds = 0;
+    int nredirects = 0;
+    int np = 0;
+    pipeline_t *pl = NULL;
+    command_t *cmd = NULL;
+    int connector = TOK_SEMI;
+    int status = 0;
+    /*  Saves word tokens to argv unless they name a redirect file, and
+        checks for syntax errors */
+    for (int t = 0; t < ntokens && status == 0; t++) {
+        token_t *token = &tokens[t];
+        token_kind_t kind = token->kind;
+        /*  A word or redirect starts a new pipeline after a separator */
+        int redirect = isRedirect(kind);
+        if (pl == NULL && (kind == TOK_WORD || redirect)) {
+            pl = &pipelines[np++];
+            pl->cmds = &cmds[ncmds];
+            pl->ncmds = 1;
+            pl->background = 0;
+            pl->connector = connector;
+            cmd = &cmds[ncmds++];
+            cmd->argv = &argv[ctr];
+            cmd->input = NULL;
+            cmd->output = NULL;
+            cmd->append = 0;
+            cmd->tees = NULL;
+            cmd->ntees = 0;
+            cmd->coproc = 0;
+            cmd->assigns = &argv[ctr];
+            cmd->nassigns = 0;
+            cmd->expand = stageExpands(tokens, t, ntokens);
+        }
+        if (kind == TOK_WORD) {
+            char *word = buffer + token->offset;
+            // NAME=value words before the command are assignments, kept in
+            // argv ahead of it
+            if (cmd->argv == &argv[ctr] && varNameLen(word) > 0 &&
+                word[varNameLen(word)] == '=') {
+                cmd->nassigns++;
+                cmd->argv++;
             }
-            if (*input != NULL) {
+            size_t len = token->quoted && !cmd->expand
+                             ? unquote(word, token->len)
+                             : token->len;
+            // Any following operator was already classified, so its first
+            // byte may be overwritten
+            word[len] = '\0';
+            argv[ctr++] = word;
+        } else if (redirect) {
+            /*  The next token must be the file (or coprocess) to redirect
+                to */
+            int input = kind == TOK_IN || kind == TOK_DUP_IN;
+            if (t + 1 == ntokens) {
+                fprintf(stderr, input ? "syntax error: no input file\n"
+                                      : "syntax error: no output file\n");
+                status = -1;
+            } else if (tokens[t + 1].kind != TOK_WORD) {
+                fprintf(stderr,
+                        input
+                            ? "syntax error: input file is a redirection "
+                              "symbol\n"
+                            : "syntax error: output file is a redirection "
+                              "symbol\n");
+                status = -1;
+            } else if (input && cmd->input != NULL) {
                 fprintf(stderr, "syntax error: multiple input files\n");
-                return;
-            }
-            *input = token;
-            lookInput = 0;
-            *background = 0;
-        } else if (lookOutput) {
-            if (!strcmp(token, "<") || !strcmp(token, ">") ||
-                !strcmp(token, ">>")) {
+                status = -1;
+            } else if (!input && cmd->output != NULL &&
+                       (kind == TOK_DUP_OUT || (cmd->coproc & COPROC_OUT))) {
                 fprintf(stderr,
-                        "syntax error: output file is a redirection symbol\n");
-                return;
-            }
-            if (*output != NULL) {
-                fprintf(stderr, "syntax error: multiple output files\n");
-                return;
-            }
-            *output = token;
-            lookOutput = 0;
-            *background = 0;
-        } else {
-            *background = 0;
-            if (!strcmp(token, "<")) {
-                lookInput = 1;
-            } else if (!strcmp(token, ">")) {
-                lookOutput = 1;
-            } else if (!strcmp(token, ">>")) {
-                lookOutput = 1;
-                *append = 1;
+                        "syntax error: coprocess output with other output\n");
+                status = -1;
             } else {
-                /*  This condition represents if we have found a command token
-                    which is not a file redirect symbol/file so we save in argv
-                    unless it is the & sign which we will ignore but set our
-                    background boolean to be true
-                 */
-                if (!strcmp(token, "&")) {
-                    *background = 1;
+                token_t *file = &tokens[++t];
+                char *name = buffer + file->offset;
+                size_t len = file->quoted && !cmd->expand
+                                 ? unquote(name, file->len)
+                                 : file->len;
+                name[len] = '\0';
+                if (input) {
+                    cmd->input = name;
+                    cmd->coproc |= kind == TOK_DUP_IN ? COPROC_IN : 0;
+                } else if (cmd->output == NULL) {
+                    cmd->output = name;
+                    cmd->append = kind == TOK_APPEND;
+                    cmd->coproc |= kind == TOK_DUP_OUT ? COPROC_OUT : 0;
                 } else {
-                    *background = 0;
-                    argv[ctr] = token;
-                    ctr++;
+                    // The stage's further output files follow each other
+                    // in redirects
+                    if (cmd->ntees == 0) {
+                        cmd->tees = &redirects[nredirects];
+                    }
+                    redirects[nredirects++] =
+                        (redirect_t){name, kind == TOK_APPEND};
+                    cmd->ntees++;
                 }
             }
+        } else if (pl == NULL) {
+            /*  An operator with no command before it */
+            fprintf(stderr, "syntax error: missing command before %s\n",
+                    tokenText[kind]);
+            status = -1;
+        } else if (cmd->argv == &argv[ctr] &&
+                   (cmd->nassigns == 0 || kind == TOK_PIPE || pl->ncmds > 1)) {
+            /*  The stage before this operator has redirects (or, in a
+                pipeline, assignments) but no command */
+            if (cmd->input != NULL || cmd->output != NULL) {
+                fprintf(stderr, "redirects with no command\n");
+            } else {
+                fprintf(stderr, "syntax error: missing command in pipe\n");
+            }
+            status = -1;
+        } else if (kind == TOK_PIPE) {
+            /*  Ends the current stage and starts the next one right after
+                its NULL terminator */
+            argv[ctr++] = NULL;
+            cmd = &cmds[ncmds++];
+            cmd->argv = &argv[ctr];
+            cmd->input = NULL;
+            cmd->output = NULL;
+            cmd->append = 0;
+            cmd->tees = NULL;
+            cmd->ntees = 0;
+            cmd->coproc = 0;
+            cmd->assigns = &argv[ctr];
+            cmd->nassigns = 0;
+            cmd->expand = stageExpands(tokens, t + 1, ntokens);
+            pl->ncmds++;
+        } else {
+            /*  Ends the current pipeline; the & sign is not saved but sets
+                its background boolean */
+            argv[ctr++] = NULL;
+            pl->background = kind == TOK_AMP;
+            connector = kind == TOK_AND || kind == TOK_OR ? (int)kind
+                                                          : TOK_SEMI;
+            pl = NULL;
         }
-        buf = NULL;
     }
-    /* Handles unused argument compiler warning */
-    append = append;
+    free(tokens);
+    if (status == -1) {
+        return -1;
+    }
     /* Post-tokenizing error handling */
-    if (lookInput) {
-        fprintf(stderr, "syntax error: no input file\n");
-        return;
+    if (pl != NULL) {
+        if (cmd->argv == &argv[ctr] && (cmd->nassigns == 0 || pl->ncmds > 1)) {
+            if (cmd->input != NULL || cmd->output != NULL) {
+                fprintf(stderr, "redirects with no command\n");
+            } else {
+                fprintf(stderr, "syntax error: missing command in pipe\n");
+            }
+            return -1;
+        }
+        argv[ctr] = NULL;
+    } else if (connector != TOK_SEMI) {
+        fprintf(stderr, "syntax error: missing command after %s\n",
+                tokenText[connector]);
+        return -1;
     }
-    if (lookOutput) {
-        fprintf(stderr, "syntax error: no output file\n");
+    *npipelines = np;
+    return 0;
+}
+
+// Spans (from B to E) and instants (i) recorded by trace, named by
+// traceNames; the shell records parsing, job launches, waits and reaping,
+// and forked children their setup up to exec
+enum {
+    TRACE_PARSE,
+    TRACE_START,
+    TRACE_FORK,
+    TRACE_SPAWN,
+    TRACE_SETPGID,
+    TRACE_TCSETPGRP,
+    TRACE_REDIRECT,
+    TRACE_EXEC,
+    TRACE_WAIT,
+    TRACE_REAP,
+    TRACE_REAPED,
+    TRACE_FG,
+    TRACE_BG,
+    TRACE_SERVER
+};
+const char *const traceNames[] = {
+    "parse",    "start", "fork", "posix_spawn", "setpgid", "tcsetpgrp",
+    "redirect", "exec",  "wait", "reap",        "reaped",  "fg",
+    "bg",       "server"};
+
+/* A trace event; seq is its position in the ring plus one, written last so
+ * that a reader can tell a complete event from one being overwritten */
+typedef struct trace_event {
+    uint64_t seq;
+    uint64_t ns;    // CLOCK_MONOTONIC
+    int32_t pid;    // process that recorded it
+    int32_t arg;    // job ID or PID it is about, 0 if none
+    uint8_t phase;  // 'B', 'E' or 'i'
+    uint8_t name;
+} trace_event_t;
+
+/* Ring buffer of trace events, in memory shared with every child forked
+ * while it exists. A writer claims a position with a single atomic add and
+ * never waits; once the ring is full the oldest events are overwritten */
+typedef struct trace_ring {
+    uint64_t head;  // position of the next event
+    uint32_t mask;  // capacity - 1, the capacity being a power of 2
+    uint32_t enabled;
+    trace_event_t events[];
+} trace_ring_t;
+
+trace_ring_t *traceRing = NULL;
+// PID recorded with events, kept up to date by runChild in each child
+pid_t tracePid = 0;
+// Number of events the ring holds unless trace on is given another
+#define TRACE_EVENTS 65536
+
+/*  Description:
+        Records a trace event if tracing is on; otherwise costs a load and a
+        branch
+    Arguments:
+        phase: 'B' to begin a span, 'E' to end it, 'i' for an instant
+        name: what the event is, one of the TRACE_ constants
+        arg: the job ID or PID it is about, 0 if none */
+void traceEvent(char phase, int name, int arg) {
+    trace_ring_t *ring = traceRing;
+    if (ring == NULL || !__atomic_load_n(&ring->enabled, __ATOMIC_RELAXED)) {
         return;
     }
-    if (!ctr && (*input != NULL || *output != NULL)) {
-        fprintf(stderr, "redirects with no command\n");
-        return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_event_t *event = &ring->events[pos & ring->mask];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->ns = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+    event->pid = tracePid;
+    event->arg = arg;
+    event->phase = (uint8_t)phase;
+    event->name = (uint8_t)name;
+    __atomic_store_n(&event->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*  Description:
+        Copies an event out of the ring unless it is being written or was
+        overwritten meanwhile
+    Arguments:
+        pos: position of the event
+        copy: set to the event
+    Returns:
+        1 if copy holds the event, 0 if not */
+int traceCopy(uint64_t pos, trace_event_t *copy) {
+    trace_event_t *event = &traceRing->events[pos & traceRing->mask];
+    uint64_t seq = __atomic_load_n(&event->seq, __ATOMIC_ACQUIRE);
+    *copy = *event;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return seq == pos + 1 &&
+           __atomic_load_n(&event->seq, __ATOMIC_RELAXED) == seq;
+}
+
+/*  Description:
+        Writes the events held in the ring to a file, oldest first, either
+        as Chrome trace JSON (for chrome://tracing or Perfetto) with one
+        track per process, or in a compact binary form: the 8 bytes
+        SHTRACE1, the number of events as a uint32_t, then for each event
+        its trace_event_t as laid out in memory
+    Arguments:
+        file: the file to write
+        binary: whether to write the binary form
+    Returns:
+        0 on success, 1 on error */
+int traceDump(const char *file, int binary) {
+    FILE *out = fopen(file, binary ? "wb" : "w");
+    if (out == NULL) {
+        perror(file);
+        return 1;
+    }
+    uint64_t head = __atomic_load_n(&traceRing->head, __ATOMIC_ACQUIRE);
+    uint64_t capacity = (uint64_t)traceRing->mask + 1;
+    uint64_t first = head > capacity ? head - capacity : 0;
+    uint32_t count = 0;
+    if (binary) {
+        fwrite("SHTRACE1", 1, 8, out);
+        fwrite(&count, sizeof(count), 1, out);
+    } else {
+        fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    }
+    trace_event_t event;
+    for (uint64_t pos = first; pos < head; pos++) {
+        if (!traceCopy(pos, &event) || event.name > TRACE_SERVER) {
+            continue;
+        }
+        if (binary) {
+            fwrite(&event, sizeof(event), 1, out);
+        } else {
+            fprintf(out,
+                    "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d%s,\"args\":{\"arg\":%d}}",
+                    count > 0 ? ",\n" : "", traceNames[event.name],
+                    event.phase, event.ns / 1000.0, (int)event.pid,
+                    (int)event.pid, event.phase == 'i' ? ",\"s\":\"t\"" : "",
+                    (int)event.arg);
+        }
+        count++;
+    }
+    if (binary) {
+        // The count is only known once the events are written
+        fseek(out, 8, SEEK_SET);
+        fwrite(&count, sizeof(count), 1, out);
+    } else {
+        fprintf(out, "\n]}\n");
+    }
+    if (ferror(out) | (fclose(out) == EOF)) {
+        perror(file);
+        return 1;
+    }
+    return 0;
+}
+
+/*  Description:
+        Function for the trace command, which turns tracing on or off,
+        empties the ring, writes it out, or shows its state
+    Arguments:
+        tokens: array of strings representing trace command: on, optionally
+        followed by the number of events to hold (rounded up to a power of
+        2, 65536 by default), off, clear, or dump followed by a file,
+        optionally preceded by -b for the binary form
+    Returns:
+        0 on success, 1 on error */
+int traceCommand(char *tokens[]) {
+    if (tokens[1] == NULL) {
+        uint64_t head =
+            traceRing != NULL ? __atomic_load_n(&traceRing->head,
+                                                __ATOMIC_RELAXED)
+                              : 0;
+        uint64_t capacity = traceRing != NULL ? traceRing->mask + 1 : 0;
+        if (printf("%s, %llu events, %llu held\n",
+                   traceRing != NULL && traceRing->enabled ? "on" : "off",
+                   (unsigned long long)head,
+                   (unsigned long long)(head < capacity ? head : capacity)) <
+            0) {
+            fprintf(stderr, "Error: Could not print trace state.\n");
+            return 1;
+        }
+        return 0;
+    }
+    if (!strcmp(tokens[1], "on") &&
+        (tokens[2] == NULL || tokens[3] == NULL)) {
+        uint64_t capacity = TRACE_EVENTS;
+        if (tokens[2] != NULL) {
+            char *end;
+            long events = strtol(tokens[2], &end, 10);
+            if (end == tokens[2] || *end != '\0' || events < 1 ||
+                events > (1L << 24)) {
+                fprintf(stderr, "trace: %s: invalid size\n", tokens[2]);
+                return 1;
+            }
+            for (capacity = 1; capacity < (uint64_t)events; capacity *= 2) {
+            }
+        }
+        // The ring is shared so that forked children write to it too
+        if (traceRing != NULL && traceRing->mask + 1 != capacity) {
+            munmap(traceRing,
+                   sizeof(trace_ring_t) +
+                       (traceRing->mask + 1) * sizeof(trace_event_t));
+            traceRing = NULL;
+        }
+        if (traceRing == NULL) {
+            void *ring = mmap(NULL,
+                              sizeof(trace_ring_t) +
+                                  capacity * sizeof(trace_event_t),
+                              PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (ring == MAP_FAILED) {
+                perror("mmap");
+                return 1;
+            }
+            traceRing = (trace_ring_t *)ring;
+            traceRing->mask = (uint32_t)(capacity - 1);
+        }
+        tracePid = getpid();
+        __atomic_store_n(&traceRing->enabled, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (tokens[2] == NULL &&
+        (!strcmp(tokens[1], "off") || !strcmp(tokens[1], "clear"))) {
+        if (traceRing != NULL && !strcmp(tokens[1], "off")) {
+            __atomic_store_n(&traceRing->enabled, 0, __ATOMIC_RELAXED);
+        } else if (traceRing != NULL) {
+            __atomic_store_n(&traceRing->head, 0, __ATOMIC_RELAXED);
+            memset(traceRing->events, 0,
+                   (traceRing->mask + 1) * sizeof(trace_event_t));
+        }
+        return 0;
+    }
+    if (!strcmp(tokens[1], "dump") && tokens[2] != NULL) {
+        int binary = !strcmp(tokens[2], "-b");
+        char *file = tokens[2 + binary];
+        if (file == NULL || tokens[3 + binary] != NULL) {
+            fprintf(stderr, "trace: syntax error\n");
+            return 1;
+        }
+        if (traceRing == NULL) {
+            fprintf(stderr, "trace: nothing traced\n");
+            return 1;
+        }
+        return traceDump(file, binary);
     }
+    fprintf(stderr, "trace: syntax error\n");
+    return 1;
 }
 
 /*  Description:
         Function for changing directory while checking for errors
     Arguments:
-        tokens: array of strings representing cd command and path */
-void changeDir(char *tokens[]) {
+        tokens: array of strings representing cd command and path
+    Returns:
+        0 on success, 1 on error */
+int changeDir(char *tokens[]) {
     /* Checks for invalid number of arguments */
-    if (tokens[2] != NULL || tokens[1] == NULL) {
+    if (tokens[1] == NULL || tokens[2] != NULL) {
         fprintf(stderr, "cd: syntax error\n");
-        return;
+        return 1;
     }
     int status = chdir(tokens[1]);
     if (status < 0) {
@@ -124,18 +937,20 @@ void changeDir(char *tokens[]) {
         cleanup_job_list(jobList);
         exit(1);
     }
+    return 0;
 }
 
 /*  Description:
         Function for adding a hard link to a file while checking for errors
     Arguments:
         tokens: array of strings representing ln command and files to be linked
- */
-void addLink(char *tokens[]) {
+    Returns:
+        0 on success, 1 on error */
+int addLink(char *tokens[]) {
     /* Checks for invalid number of arguments */
-    if (tokens[3] != NULL || tokens[1] == NULL || tokens[2] == NULL) {
+    if (tokens[1] == NULL || tokens[2] == NULL || tokens[3] != NULL) {
         fprintf(stderr, "ln: syntax error\n");
-        return;
+        return 1;
     }
     int status = link(tokens[1], tokens[2]);
     if (status < 0) {
@@ -143,17 +958,20 @@ void addLink(char *tokens[]) {
         cleanup_job_list(jobList);
         exit(1);
     }
+    return 0;
 }
 
 /*  Description:
         Function for removing a link to a file while checking for errors
     Arguments:
-        tokens: array of strings representing rm command and file */
-void removeLink(char *tokens[]) {
+        tokens: array of strings representing rm command and file
+    Returns:
+        0 on success, 1 on error */
+int removeLink(char *tokens[]) {
     /* Checks for invalid number of arguments */
-    if (tokens[2] != NULL || tokens[1] == NULL) {
+    if (tokens[1] == NULL || tokens[2] != NULL) {
         fprintf(stderr, "rm: syntax error\n");
-        return;
+        return 1;
     }
     int status = unlink(tokens[1]);
     if (status < 0) {
@@ -161,17 +979,25 @@ void removeLink(char *tokens[]) {
         cleanup_job_list(jobList);
         exit(1);
     }
+    return 0;
 }
 
+void exitSubshell(int status);
+
 /*  Description:
         Function for exiting shell
     Arguments:
-        tokens: array of strings representing exit command */
-void exitHelper(char *tokens[]) {
+        tokens: array of strings representing exit command
+    Returns:
+        0 on success, 1 on error */
+int exitHelper(char *tokens[]) {
     /* Checks for invalid number of arguments */
     if (tokens[1] != NULL) {
         fprintf(stderr, "exit: syntax error\n");
-        return;
+        return 1;
+    }
+    if (subshell) {
+        exitSubshell(0);
     }
     cleanup_job_list(jobList);
     exit(0);
@@ -180,89 +1006,62 @@ void exitHelper(char *tokens[]) {
 /*  Description:
         Function for printing jobs list
     Arguments:
-        tokens: array of strings representing jobs command */
-void printJobs(char *tokens[]) {
+        tokens: array of strings representing jobs command and optionally -l
+        to add each job's running time and resource usage
+    Returns:
+        0 on success, 1 on error */
+int printJobs(char *tokens[]) {
     /* Checks for invalid number of arguments */
-    if (tokens[1] != NULL) {
+    int longFormat = tokens[1] != NULL && !strcmp(tokens[1], "-l");
+    if (tokens[1] != NULL && (!longFormat || tokens[2] != NULL)) {
         fprintf(stderr, "jobs: syntax error\n");
-        return;
+        return 1;
     }
-    jobs(jobList);
+    jobs(jobList, longFormat);
+    return 0;
 }
 
+int startServer();
+
 /*  Description:
-        Function for resuming a job in foreground
+        Function for printing or selecting how execute launches children
     Arguments:
-        tokens: array of strings representing fg command */
-void fg(char *tokens[]) {
+        tokens: array of strings representing spawn command and optionally
+        the backend to use, fork, posix_spawn or server (which starts the
+        fork server if it is not running)
+    Returns:
+        0 on success, 1 on error */
+int setSpawn(char *tokens[]) {
     /* Checks for invalid number of arguments */
-    if (tokens[2] != NULL || tokens[1] == NULL) {
-        fprintf(stderr, "fg: syntax error\n");
-        return;
-    }
-    // Checks that second argument starts with %
-    if (tokens[1][0] != '%') {
-        fprintf(stderr, "fg: job input does not begin with %%\n");
-        return;
-    }
-    // Converts job number to its process id
-    int jobNum = atoi(tokens[1] + 1);
-    pid_t jobPid = get_job_pid(jobList, jobNum);
-    if (jobPid == -1) {
-        fprintf(stderr, "job not found\n");
-        return;
-    }
-    // Sets terminal control to input job
-    if (tcsetpgrp(0, jobPid) == -1) {
-        perror("tcsetpgrp");
-        cleanup_job_list(jobList);
-        exit(1);
-    }
-    // Continues job
-    pid_t jobPgid;
-    if ((jobPgid = getpgid(jobPid)) == -1) {
-        perror("getpgid");
-        cleanup_job_list(jobList);
-        exit(1);
-    }
-    if (kill(-jobPgid, SIGCONT) == -1) {
-        perror("kill");
-        cleanup_job_list(jobList);
-        exit(1);
-    }
-    // Waits for job to change status and responds accordingly
-    int status;
-    int waitReturn = waitpid(jobPid, &status, WUNTRACED);
-    if (waitReturn == -1) {
-        perror("waitpid");
-        cleanup_job_list(jobList);
-        exit(1);
+    if (tokens[1] != NULL && tokens[2] != NULL) {
+        fprintf(stderr, "spawn: syntax error\n");
+        return 1;
     }
-    // Checks waitpid status update and prints out informative message if
-    // child process was terminated or suspended by a signal
-    if (WIFSIGNALED(status)) {
-        int signalNum = WTERMSIG(status);
-        if (printf("[%d] (%d) terminated by signal %d\n", jobNum, jobPid,
-                   signalNum) < 0) {
-            fprintf(
-                stderr,
-                "Error: Could not print signal terminated process message.\n");
-            return;
+    if (tokens[1] == NULL) {
+        if (printf("%s\n", spawnBackend == SPAWN_POSIX    ? "posix_spawn"
+                           : spawnBackend == SPAWN_SERVER ? "server"
+                                                          : "fork") < 0) {
+            fprintf(stderr, "Error: Could not print spawn backend.\n");
         }
-        remove_job_pid(jobList, jobPid);
-    } else if (WIFSTOPPED(status)) {
-        int signalNum = WSTOPSIG(status);
-        if (printf("[%d] (%d) suspended by signal %d\n", jobNum, jobPid,
-                   signalNum) < 0) {
-            fprintf(
-                stderr,
-                "Error: Could not print signal suspended process message.\n");
-            return;
+    } else if (!strcmp(tokens[1], "fork")) {
+        spawnBackend = SPAWN_FORK;
+    } else if (!strcmp(tokens[1], "posix_spawn")) {
+        spawnBackend = SPAWN_POSIX;
+    } else if (!strcmp(tokens[1], "server")) {
+        if (serverFd == -1 && startServer() == -1) {
+            return 1;
         }
+        spawnBackend = SPAWN_SERVER;
     } else {
-        // Removes job from jobList due to normal termination
-        remove_job_pid(jobList, jobPid);
+        fprintf(stderr, "spawn: unknown backend %s\n", tokens[1]);
+        return 1;
     }
+    return 0;
+}
+
+/*  Description:
+        Gives control of the terminal back to the shell's own process group */
+void reclaimTerminal() {
     // Gets PID of main REPL (calling process) and sets it
     // back as controlling process group
     pid_t pgroup;
@@ -271,7 +1070,7 @@ void fg(char *tokens[]) {
         cleanup_job_list(jobList);
         exit(1);
     }
-    if (tcsetpgrp(0, pgroup) == -1) {
+    if (terminal && tcsetpgrp(0, pgroup) == -1) {
         perror("tcsetpgrp");
         cleanup_job_list(jobList);
         exit(1);
@@ -279,365 +1078,7619 @@ void fg(char *tokens[]) {
 }
 
 /*  Description:
-        Function for resuming a job in the background
+        Waits for a job running in the foreground until every process in its
+        process group has terminated or it is suspended, printing a message
+        if it was terminated or suspended by a signal, then takes back
+        control of the terminal
+    Arguments:
+        jid: job ID of the foreground job
+    Returns:
+        the wait status of the job's last pipeline stage, or the stop status
+        if the job was suspended; its resource usage is left in
+        lastJobUsage */
+int waitForeground(int jid) {
+    traceEvent('B', TRACE_WAIT, jid);
+    pid_t pgid = get_job_pid(jobList, jid);
+    int status = 0;
+    struct rusage usage;
+    struct timespec started;
+    while (1) {
+        pid_t pid = wait4(-pgid, &status, WUNTRACED, &usage);
+        if (pid == -1) {
+            if (errno == ECHILD) {
+                // Nothing left to wait for in the job's process group
+                status = get_job_status(jobList, jid);
+                get_job_usage(jobList, jid, &lastJobUsage, &started);
+                remove_job_jid(jobList, jid);
+                break;
+            }
+            perror("wait4");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        // Checks waitpid status update and prints out informative message if
+        // job was terminated or suspended by a signal
+        if (WIFSTOPPED(status)) {
+            update_job_jid(jobList, jid, STOPPED);
+            get_job_usage(jobList, jid, &lastJobUsage, &started);
+            int signalNum = WSTOPSIG(status);
+            if (printf("[%d] (%d) suspended by signal %d\n", jid, pgid,
+                       signalNum) < 0) {
+                fprintf(stderr,
+                        "Error: Could not print signal suspended process "
+                        "message.\n");
+            }
+            break;
+        }
+        // Keeps waiting until the last process of the job has terminated
+        if (finish_job_process(jobList, pid, status, &usage) > 0) {
+            continue;
+        }
+        status = get_job_status(jobList, jid);
+        get_job_usage(jobList, jid, &lastJobUsage, &started);
+        if (WIFSIGNALED(status)) {
+            int signalNum = WTERMSIG(status);
+            if (printf("[%d] (%d) terminated by signal %d\n", jid, pgid,
+                       signalNum) < 0) {
+                fprintf(stderr,
+                        "Error: Could not print signal terminated process "
+                        "message.\n");
+            }
+        }
+        // Removes job from jobList since all of its processes terminated
+        remove_job_jid(jobList, jid);
+        break;
+    }
+    reclaimTerminal();
+    traceEvent('E', TRACE_WAIT, jid);
+    return status;
+}
+
+/*  Description:
+        Converts a wait status into an exit status: the exit code of a
+        process that exited, or 128 plus the number of the signal that
+        terminated or stopped it
+    Arguments:
+        status: status as returned by waitpid */
+int exitStatus(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 0;
+}
+
+int runQueued(int jid, int background);
+
+/*  Description:
+        Function for resuming a job in foreground
     Arguments:
-        tokens: array of strings representing bg command */
-void bg(char *tokens[]) {
+        tokens: array of strings representing fg command
+    Returns:
+        the job's exit status, 1 on error */
+int fg(char *tokens[]) {
     /* Checks for invalid number of arguments */
-    if (tokens[2] != NULL || tokens[1] == NULL) {
-        fprintf(stderr, "bg: syntax error\n");
-        return;
+    if (tokens[1] == NULL || tokens[2] != NULL) {
+        fprintf(stderr, "fg: syntax error\n");
+        return 1;
     }
     // Checks that second argument starts with %
     if (tokens[1][0] != '%') {
-        fprintf(stderr, "bg: job input does not begin with %%\n");
-        return;
+        fprintf(stderr, "fg: job input does not begin with %%\n");
+        return 1;
     }
-    // Converts job number to its process id
+    // Converts job number to its process group id, which is the pid of the
+    // job's first process
     int jobNum = atoi(tokens[1] + 1);
-    pid_t jobPid = get_job_pid(jobList, jobNum);
-    if (jobPid == -1) {
+    pid_t jobPgid = get_job_pid(jobList, jobNum);
+    if (jobPgid == -1) {
         fprintf(stderr, "job not found\n");
-        return;
+        return 1;
+    }
+    // A queued job is started right away
+    if (jobPgid == 0) {
+        return runQueued(jobNum, 0);
     }
-    // Continues job
-    pid_t jobPgid;
-    if ((jobPgid = getpgid(jobPid)) == -1) {
-        perror("getpgid");
+    // Sets terminal control to input job
+    traceEvent('B', TRACE_FG, jobNum);
+    if (terminal && tcsetpgrp(0, jobPgid) == -1) {
+        perror("tcsetpgrp");
         cleanup_job_list(jobList);
         exit(1);
     }
+    // Continues every process of the job
+    update_job_jid(jobList, jobNum, RUNNING);
     if (kill(-jobPgid, SIGCONT) == -1) {
         perror("kill");
         cleanup_job_list(jobList);
         exit(1);
     }
+    traceEvent('E', TRACE_FG, jobNum);
+    // Waits for job to change status and responds accordingly
+    return exitStatus(waitForeground(jobNum));
 }
 
-/*
- * - Description:
- *      Executes the program given in argv[0] with the subsequent parameters
- * given
- * - Arguments:
- *      argv: the tokenized argument array eventually used for execv()
- *      input: a redirected input if found
- *      output: a redirected output file if found
- *      append: boolean representing if >> was the specified output redirect
+/*  Description:
+        Function for resuming a job in the background
+    Arguments:
+        tokens: array of strings representing bg command
+    Returns:
+        0 on success, 1 on error */
+int bg(char *tokens[]) {
+    /* Checks for invalid number of arguments */
+    if (tokens[1] == NULL || tokens[2] != NULL) {
+        fprintf(stderr, "bg: syntax error\n");
+        return 1;
+    }
+    // Checks that second argument starts with %
+    if (tokens[1][0] != '%') {
+        fprintf(stderr, "bg: job input does not begin with %%\n");
+        return 1;
+    }
+    // Converts job number to its process group id
+    int jobNum = atoi(tokens[1] + 1);
+    pid_t jobPgid = get_job_pid(jobList, jobNum);
+    if (jobPgid == -1) {
+        fprintf(stderr, "job not found\n");
+        return 1;
+    }
+    // A queued job is started right away
+    if (jobPgid == 0) {
+        return runQueued(jobNum, 1);
+    }
+    // Continues every process of the job
+    traceEvent('B', TRACE_BG, jobNum);
+    if (kill(-jobPgid, SIGCONT) == -1) {
+        perror("kill");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    traceEvent('E', TRACE_BG, jobNum);
+    return 0;
+}
+
+/* A shell variable, stored as NAME=value so that an exported one is its own
+ * environment entry */
+typedef struct var {
+    char *entry;  // NAME=value, NULL for a free slot
+    size_t nameLen;
+    int envIndex;  // its slot in envp if exported, otherwise -1
+} var_t;
+
+// Open-addressed table of the shell's variables. envp, the environment
+// programs are started with, holds the entries of the exported ones and is
+// updated in place as they change, so launching never rebuilds it;
+// envVersion counts its changes for the fork server's copy.
+var_t *varTable = NULL;
+size_t varCapacity = 0;
+size_t varCount = 0;
+char **envp = NULL;
+int envCount = 0;
+int envCapacity = 0;
+unsigned long envVersion = 1;
+
+/*  Description:
+        Finds the slot of a variable, or the free slot it would go in
+    Arguments:
+        name: the name, not necessarily NUL terminated
+        len: length of the name */
+var_t *varSlot(const char *name, size_t len) {
+    size_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211UL;
+    }
+    size_t mask = varCapacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        var_t *var = &varTable[i];
+        if (var->entry == NULL ||
+            (var->nameLen == len && !memcmp(var->entry, name, len))) {
+            return var;
+        }
+    }
+}
+
+/*  Description:
+        Returns the value of a variable, or NULL if it is not set
+    Arguments:
+        name: the name, not necessarily NUL terminated
+        len: length of the name */
+const char *getVarN(const char *name, size_t len) {
+    if (varCount == 0) {
+        return NULL;
+    }
+    var_t *var = varSlot(name, len);
+    return var->entry == NULL ? NULL : var->entry + len + 1;
+}
+
+/* Description: returns the value of a variable, or NULL if it is not set */
+const char *getVar(const char *name) {
+    return getVarN(name, strlen(name));
+}
+
+/*  Description:
+        Adds an entry to envp, or puts it in place of the one at index
+    Arguments:
+        entry: the NAME=value entry
+        index: slot to replace, -1 to add the entry at the end
+    Returns:
+        the entry's slot */
+int setEnvEntry(char *entry, int index) {
+    envVersion++;
+    if (index != -1) {
+        envp[index] = entry;
+        return index;
+    }
+    if (envCount + 1 >= envCapacity) {
+        envCapacity = envCapacity == 0 ? 64 : envCapacity * 2;
+        envp = (char **)realloc(envp, envCapacity * sizeof(char *));
+        if (envp == NULL) {
+            perror("realloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    envp[envCount] = entry;
+    envp[++envCount] = NULL;
+    return envCount - 1;
+}
+
+/*  Description:
+        Sets a variable, which keeps being exported or not unless export is
+        set
+    Arguments:
+        name: the name, not necessarily NUL terminated
+        len: length of the name
+        value: the new value
+        export: boolean representing if the variable is to be exported */
+void setVar(const char *name, size_t len, const char *value, int export) {
+    if ((varCount + 1) * 2 > varCapacity) {
+        // Rehashes into a table twice the size, keeping it at most half full
+        var_t *old = varTable;
+        size_t oldCapacity = varCapacity;
+        varCapacity = varCapacity == 0 ? 64 : varCapacity * 2;
+        varTable = (var_t *)calloc(varCapacity, sizeof(var_t));
+        if (varTable == NULL) {
+            perror("calloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].entry != NULL) {
+                *varSlot(old[i].entry, old[i].nameLen) = old[i];
+            }
+        }
+        free(old);
+    }
+    var_t *var = varSlot(name, len);
+    size_t valueLen = strlen(value);
+    char *entry = (char *)malloc(len + valueLen + 2);
+    if (entry == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, valueLen + 1);
+    if (var->entry == NULL) {
+        var->nameLen = len;
+        var->envIndex = -1;
+        varCount++;
+    }
+    if (var->envIndex != -1 || export) {
+        var->envIndex = setEnvEntry(entry, var->envIndex);
+    }
+    free(var->entry);
+    var->entry = entry;
+}
+
+/*  Description:
+        Unsets a variable, taking it out of envp if it was exported
+    Arguments:
+        name: the name, not necessarily NUL terminated
+        len: length of the name */
+void unsetVar(const char *name, size_t len) {
+    if (varCount == 0 || varSlot(name, len)->entry == NULL) {
+        return;
+    }
+    var_t *var = varSlot(name, len);
+    if (var->envIndex != -1) {
+        // The last entry of envp takes the place of the one removed
+        char *last = envp[envCount - 1];
+        varSlot(last, (size_t)(strchr(last, '=') - last))->envIndex =
+            var->envIndex;
+        setEnvEntry(last, var->envIndex);
+        envp[--envCount] = NULL;
+    }
+    free(var->entry);
+    var->entry = NULL;
+    varCount--;
+    // Moves back the entries after the hole that would no longer be found
+    // past it (backward shift deletion)
+    size_t mask = varCapacity - 1;
+    size_t hole = (size_t)(var - varTable);
+    for (size_t i = (hole + 1) & mask; varTable[i].entry != NULL;
+         i = (i + 1) & mask) {
+        var_t moved = varTable[i];
+        varTable[i].entry = NULL;
+        *varSlot(moved.entry, moved.nameLen) = moved;
+    }
+}
+
+/*  Description:
+        Takes in the environment the shell was started with as exported
+        variables */
+void importEnvironment() {
+    envCapacity = 64;
+    envp = (char **)calloc(envCapacity, sizeof(char *));
+    if (envp == NULL) {
+        perror("calloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    for (char **env = environ; *env != NULL; env++) {
+        char *equals = strchr(*env, '=');
+        if (equals != NULL) {
+            setVar(*env, (size_t)(equals - *env), equals + 1, 1);
+        }
+    }
+}
+
+/*  Description:
+        Builds the environment of a command with assignments of its own:
+        envp with their entries in place of those of the same names
+    Arguments:
+        cmd: the command
+    Returns:
+        the newly allocated environment, whose entries are those of envp
+        and the command's assigns */
+char **commandEnv(const command_t *cmd) {
+    char **env = (char **)malloc((envCount + cmd->nassigns + 1) *
+                                 sizeof(char *));
+    if (env == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    memcpy(env, envp, (envCount + 1) * sizeof(char *));
+    int count = envCount;
+    for (int a = 0; a < cmd->nassigns; a++) {
+        char *assign = cmd->assigns[a];
+        size_t len = varNameLen(assign);
+        var_t *var = varCount > 0 ? varSlot(assign, len) : NULL;
+        int index = var != NULL && var->entry != NULL ? var->envIndex : -1;
+        // A name assigned twice keeps the last value
+        for (int k = envCount; index == -1 && k < count; k++) {
+            index = !strncmp(env[k], assign, len + 1) ? k : -1;
+        }
+        if (index == -1) {
+            index = count++;
+            env[count] = NULL;
+        }
+        env[index] = assign;
+    }
+    return env;
+}
+
+/*  Description:
+        Function for exporting variables to the programs the shell starts:
+        each argument is NAME=value, which also sets the variable, or the
+        NAME of one already set. Without arguments, prints the exported
+        variables as export commands the shell reads back.
+    Arguments:
+        tokens: array of strings representing export command
+    Returns:
+        0 on success, 1 if a name was invalid */
+int exportVars(char *tokens[]) {
+    if (tokens[1] == NULL) {
+        for (int i = 0; i < envCount; i++) {
+            const char *value = strchr(envp[i], '=') + 1;
+            int ret = printf("export %.*s='", (int)(value - envp[i] - 1),
+                             envp[i]);
+            // Single quotes are closed around an escaped one
+            for (; *value != '\0' && ret >= 0; value++) {
+                ret = *value == '\'' ? printf("'\\''") : putchar(*value);
+            }
+            if (ret < 0 || printf("'\n") < 0) {
+                fprintf(stderr, "Error: Could not print variable.\n");
+            }
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        size_t len = varNameLen(tokens[i]);
+        if (len == 0 || (tokens[i][len] != '\0' && tokens[i][len] != '=')) {
+            fprintf(stderr, "export: %s: not a valid identifier\n",
+                    tokens[i]);
+            status = 1;
+        } else if (tokens[i][len] == '=') {
+            setVar(tokens[i], len, tokens[i] + len + 1, 1);
+        } else if (getVarN(tokens[i], len) != NULL) {
+            setVar(tokens[i], len, getVarN(tokens[i], len), 1);
+        }
+    }
+    return status;
+}
+
+/*  Description:
+        Function for unsetting variables, which leave the environment too
+    Arguments:
+        tokens: array of strings representing unset command and the names
+    Returns:
+        0 on success, 1 if a name was invalid */
+int unsetVars(char *tokens[]) {
+    int status = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        size_t len = varNameLen(tokens[i]);
+        if (len == 0 || tokens[i][len] != '\0') {
+            fprintf(stderr, "unset: %s: not a valid identifier\n", tokens[i]);
+            status = 1;
+        } else {
+            unsetVar(tokens[i], len);
+        }
+    }
+    return status;
+}
+
+/*  Description:
+        Sets the assignments before a built-in for as long as it runs,
+        exported so that the commands it starts see them
+    Arguments:
+        cmd: the command running the built-in
+    Returns:
+        the values they replaced, each after a 'x' if the variable was
+        exported and a '-' if not, NULL where a variable was not set, to be
+        passed to restoreAssigns */
+char **applyAssigns(const command_t *cmd) {
+    char **saved = (char **)malloc(cmd->nassigns * sizeof(char *));
+    if (saved == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    for (int a = 0; a < cmd->nassigns; a++) {
+        const char *assign = cmd->assigns[a];
+        size_t len = varNameLen(assign);
+        const char *old = getVarN(assign, len);
+        saved[a] = NULL;
+        if (old != NULL) {
+            saved[a] = (char *)malloc(strlen(old) + 2);
+            if (saved[a] == NULL) {
+                perror("malloc");
+                cleanup_job_list(jobList);
+                exit(1);
+            }
+            saved[a][0] = varSlot(assign, len)->envIndex != -1 ? 'x' : '-';
+            strcpy(saved[a] + 1, old);
+        }
+        setVar(assign, len, assign + len + 1, 1);
+    }
+    return saved;
+}
+
+/*  Description:
+        Puts back the variables set by applyAssigns once the built-in is done
+    Arguments:
+        cmd: the command running the built-in
+        saved: what applyAssigns returned, freed */
+void restoreAssigns(const command_t *cmd, char **saved) {
+    // In reverse, so that a name assigned twice gets its first old value
+    for (int a = cmd->nassigns - 1; a >= 0; a--) {
+        const char *assign = cmd->assigns[a];
+        size_t len = varNameLen(assign);
+        unsetVar(assign, len);
+        if (saved[a] != NULL) {
+            setVar(assign, len, saved[a] + 1, saved[a][0] == 'x');
+            free(saved[a]);
+        }
+    }
+    free(saved);
+}
+
+/* A growing buffer of NUL terminated words */
+typedef struct word_buf {
+    char *data;
+    size_t len;
+    size_t size;
+} word_buf_t;
+
+/*  Description:
+        Makes room for n more bytes in a word buffer */
+void reserveBytes(word_buf_t *buf, size_t n) {
+    if (buf->len + n > buf->size) {
+        while (buf->len + n > buf->size) {
+            buf->size = buf->size == 0 ? 256 : buf->size * 2;
+        }
+        buf->data = (char *)realloc(buf->data, buf->size);
+        if (buf->data == NULL) {
+            perror("realloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+}
+
+/*  Description:
+        Appends n bytes to a word buffer */
+void appendBytes(word_buf_t *buf, const char *bytes, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    reserveBytes(buf, n);
+    memcpy(buf->data + buf->len, bytes, n);
+    buf->len += n;
+}
+
+/* Kinds of path components of a glob pattern */
+enum { GLOB_LITERAL, GLOB_STAR, GLOB_PATTERN, GLOB_DIRS };
+
+/* A path component of a glob pattern, compiled once for every entry of the
+ * directories it is matched against */
+typedef struct glob_part {
+    int kind;  // GLOB_LITERAL: no wildcard, GLOB_STAR: a single * and no
+               // other wildcard, GLOB_PATTERN: any other, GLOB_DIRS: **
+    const char *rest;  // the component from its first wildcard, escaped
+    const char *prefix;  // unescaped text before the first wildcard (the
+    size_t prefixLen;    // whole component if it has none)
+    const char *suffix;  // unescaped text after the last wildcard
+    size_t suffixLen;
+    size_t minLen;  // fewest bytes of a name it matches
+    int dot;  // starts with a literal ., so that it matches hidden names
+} glob_part_t;
+
+/* A directory entry as returned by getdents64 */
+typedef struct dirent_record {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+} dirent_record_t;
+
+/* State of the expansion of a glob pattern */
+typedef struct glob_state {
+    const glob_part_t *parts;
+    int nparts;
+    word_buf_t path;     // the directory reached, empty or ending with /
+    word_buf_t matches;  // arena of the paths found, each NUL terminated
+    size_t nmatches;
+} glob_state_t;
+
+// Buffer directories are read into, GLOB_BATCH bytes, allocated once
+char *globBatch = NULL;
+
+/*  Description:
+        Copies text removing the backslashes escaping its bytes; dst may be
+        src
+    Returns:
+        the length of the copy */
+size_t unescapeGlob(char *dst, const char *src, size_t len) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        i += src[i] == '\\' && i + 1 < len;
+        dst[out++] = src[i];
+    }
+    return out;
+}
+
+/*  Description:
+        Returns the end of the bracket expression starting at p (past its ]),
+        or NULL if the [ is not closed and so an ordinary byte. A ] right
+        after the [ or [! is one of the bytes rather than the end. */
+const char *bracketEnd(const char *p) {
+    const char *q = p + 1;
+    q += *q == '!' || *q == '^';
+    q += *q == ']';
+    for (; *q != ']'; q++) {
+        if (*q == '\0') {
+            return NULL;
+        }
+        q += *q == '\\' && q[1] != '\0';
+    }
+    return q + 1;
+}
+
+/*  Description:
+        Matches a byte against the pattern element at p: a ?, a bracket
+        expression of bytes and ranges (negated by a leading ! or ^), an
+        escaped byte or an ordinary one
+    Returns:
+        the pattern past the element if the byte matches, NULL if not */
+const char *matchElement(const char *p, unsigned char c) {
+    const char *end;
+    if (*p == '?') {
+        return p + 1;
+    }
+    if (*p == '[' && (end = bracketEnd(p)) != NULL) {
+        const char *q = p + 1;
+        int negate = *q == '!' || *q == '^';
+        int found = 0;
+        for (q += negate; q < end - 1; q++) {
+            unsigned char lo = (unsigned char)(*q == '\\' ? *++q : *q);
+            unsigned char hi = lo;
+            if (q[1] == '-' && q + 2 < end - 1) {
+                q += 2;
+                hi = (unsigned char)(*q == '\\' ? *++q : *q);
+            }
+            found |= lo <= c && c <= hi;
+        }
+        return found != negate ? end : NULL;
+    }
+    p += *p == '\\' && p[1] != '\0';
+    return (unsigned char)*p == c ? p + 1 : NULL;
+}
+
+/*  Description:
+        Matches a name against a pattern, a * standing for any bytes; on a
+        mismatch, only the last * needs to take one more byte, so the match
+        is linear in most cases and never recursive */
+int matchPattern(const char *p, const char *s) {
+    const char *starP = NULL;
+    const char *starS = NULL;
+    while (*s != '\0') {
+        const char *next;
+        if (*p == '*') {
+            starP = ++p;
+            starS = s;
+        } else if ((next = matchElement(p, (unsigned char)*s)) != NULL) {
+            p = next;
+            s++;
+        } else if (starP != NULL) {
+            p = starP;
+            s = ++starS;
+        } else {
+            return 0;
+        }
+    }
+    while (*p == '*') {
+        p++;
+    }
+    return *p == '\0';
+}
+
+/*  Description:
+        Compiles a glob pattern into its path components: the slashes of
+        the pattern become NULs, and the unescaped literal ends of each
+        component are written to text. A trailing ** is followed by a *, so
+        that it matches every path under the directory.
+    Arguments:
+        pattern: the pattern, escaped, modified
+        parts: filled with the components, room for one per slash plus 2
+        text: room for twice strlen(pattern) + 2 bytes
+    Returns:
+        the number of components, 0 if none has a wildcard */
+int compileGlob(char *pattern, glob_part_t parts[], char *text) {
+    int nparts = 0;
+    int wildcards = 0;
+    char *component = pattern;
+    while (component != NULL) {
+        char *slash = strchr(component, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        glob_part_t *part = &parts[nparts++];
+        const char *first = NULL;  // first wildcard
+        const char *after = NULL;  // past the last one
+        int stars = 0;
+        int others = 0;
+        part->minLen = 0;
+        for (const char *q = component; *q != '\0';) {
+            const char *end = q + 1;
+            if (*q == '*') {
+                stars++;
+            } else if (*q == '?' ||
+                       (*q == '[' && (end = bracketEnd(q)) != NULL)) {
+                others++;
+                part->minLen++;
+            } else {
+                part->minLen++;
+                q += *q == '\\' && q[1] != '\0' ? 2 : 1;
+                continue;
+            }
+            first = first == NULL ? q : first;
+            after = end;
+            q = end;
+        }
+        if (!strcmp(component, "**")) {
+            part->kind = GLOB_DIRS;
+        } else if (first == NULL) {
+            part->kind = GLOB_LITERAL;
+            first = after = component + strlen(component);
+        } else {
+            part->kind = stars == 1 && others == 0 ? GLOB_STAR : GLOB_PATTERN;
+        }
+        wildcards |= part->kind != GLOB_LITERAL;
+        part->rest = first;
+        part->prefix = text;
+        part->prefixLen = unescapeGlob(text, component,
+                                       (size_t)(first - component));
+        text += part->prefixLen;
+        part->suffix = text;
+        part->suffixLen = unescapeGlob(text, after, strlen(after));
+        text += part->suffixLen;
+        part->dot = part->prefixLen > 0 && part->prefix[0] == '.';
+        component = slash != NULL ? slash + 1 : NULL;
+    }
+    if (parts[nparts - 1].kind == GLOB_DIRS) {
+        parts[nparts++] = (glob_part_t){GLOB_STAR, "*", "", 0, "", 0, 0, 0};
+    }
+    return wildcards ? nparts : 0;
+}
+
+/*  Description:
+        Returns whether a name matches a compiled component, checking its
+        length and literal ends before the pattern */
+int globMatch(const glob_part_t *part, const char *name) {
+    size_t len = strlen(name);
+    if (len < part->minLen ||
+        memcmp(name, part->prefix, part->prefixLen) != 0 ||
+        memcmp(name + len - part->suffixLen, part->suffix,
+               part->suffixLen) != 0) {
+        return 0;
+    }
+    return part->kind == GLOB_STAR ||
+           matchPattern(part->rest, name + part->prefixLen);
+}
+
+/*  Description:
+        Adds the path reached followed by a name to the matches of a glob */
+void addMatch(glob_state_t *g, const char *name, size_t len) {
+    appendBytes(&g->matches, g->path.data, g->path.len);
+    appendBytes(&g->matches, name, len);
+    appendBytes(&g->matches, "", 1);
+    g->nmatches++;
+}
+
+/*  Description:
+        Matches the components of a glob from level on in the directory
+        reached. Its entries are read in large getdents64 batches, and their
+        type comes from d_type, so that only names whose type the file system
+        does not report (or symbolic links that may lead to directories) are
+        stat'ed. The subdirectories to go into are gathered and visited
+        after the directory is closed. ** goes into every directory but
+        hidden ones and symbolic links.
+    Arguments:
+        g: the glob, whose path is the directory reached
+        level: the component to match */
+void globLevel(glob_state_t *g, int level) {
+    const glob_part_t *part = &g->parts[level];
+    int last = level == g->nparts - 1;
+    size_t pathLen = g->path.len;
+    if (part->kind == GLOB_LITERAL) {
+        appendBytes(&g->path, part->prefix, part->prefixLen);
+        if (!last) {
+            appendBytes(&g->path, "/", 1);
+            globLevel(g, level + 1);
+        } else {
+            // Only the existence of the last component needs checking
+            struct stat st;
+            appendBytes(&g->path, "", 1);
+            g->path.len = pathLen;
+            if (fstatat(AT_FDCWD, g->path.data, &st, AT_SYMLINK_NOFOLLOW) ==
+                0) {
+                addMatch(g, part->prefix, part->prefixLen);
+            }
+        }
+        g->path.len = pathLen;
+        return;
+    }
+    if (part->kind == GLOB_DIRS) {
+        // ** also stands for no directory at all
+        globLevel(g, level + 1);
+    }
+    appendBytes(&g->path, "", 1);
+    int fd = open(pathLen == 0 ? "." : g->path.data,
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    g->path.len = pathLen;
+    if (fd == -1) {
+        return;
+    }
+    word_buf_t dirs = {NULL, 0, 0};
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, globBatch, GLOB_BATCH)) > 0) {
+        const dirent_record_t *entry;
+        for (long off = 0; off < n; off += entry->reclen) {
+            entry = (const dirent_record_t *)(globBatch + off);
+            const char *name = entry->name;
+            if (name[0] == '.' &&
+                (!part->dot || name[1] == '\0' ||
+                 (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (part->kind != GLOB_DIRS && !globMatch(part, name)) {
+                continue;
+            }
+            if (last) {
+                addMatch(g, name, strlen(name));
+                continue;
+            }
+            int dir = entry->type == DT_DIR;
+            if (entry->type == DT_UNKNOWN ||
+                (entry->type == DT_LNK && part->kind != GLOB_DIRS)) {
+                struct stat st;
+                dir = fstatat(fd, name, &st,
+                              entry->type == DT_UNKNOWN &&
+                                      part->kind == GLOB_DIRS
+                                  ? AT_SYMLINK_NOFOLLOW
+                                  : 0) == 0 &&
+                      S_ISDIR(st.st_mode);
+            }
+            if (dir) {
+                appendBytes(&dirs, name, strlen(name) + 1);
+            }
+        }
+    }
+    close(fd);
+    for (size_t off = 0; off < dirs.len; off += strlen(dirs.data + off) + 1) {
+        appendBytes(&g->path, dirs.data + off, strlen(dirs.data + off));
+        appendBytes(&g->path, "/", 1);
+        globLevel(g, part->kind == GLOB_DIRS ? level : level + 1);
+        g->path.len = pathLen;
+    }
+    free(dirs.data);
+}
+
+/* A path found by a glob, with the 8 bytes after the prefix all of them
+ * share as a number, which orders most paths without reaching the arena */
+typedef struct glob_match {
+    uint64_t key;
+    const char *path;
+} glob_match_t;
+
+/*  Description:
+        Orders two paths found by a glob for qsort, by their bytes */
+int compareMatches(const void *a, const void *b) {
+    const glob_match_t *x = (const glob_match_t *)a;
+    const glob_match_t *y = (const glob_match_t *)b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+/*  Description:
+        Expands a glob pattern: * matches any bytes, ? any byte, [...] any
+        byte of the set, ** any number of directories, and a backslash
+        escapes a byte. Hidden names only match a component starting with a
+        literal dot.
+    Arguments:
+        pattern: the pattern
+        buf: the matching paths are appended to it, each NUL terminated, in
+        byte order
+    Returns:
+        the number of paths appended, 0 if there are none or the pattern
+        has no wildcard */
+int globWord(const char *pattern, word_buf_t *buf) {
+    size_t len = strlen(pattern);
+    int nparts = 2;
+    for (const char *s = pattern; *s != '\0'; s++) {
+        nparts += *s == '/';
+    }
+    // The components, a copy of the pattern and their literal ends share
+    // one allocation
+    glob_part_t *parts = (glob_part_t *)malloc(
+        nparts * sizeof(glob_part_t) + 3 * (len + 1));
+    if (parts == NULL || (globBatch == NULL &&
+                          (globBatch = (char *)malloc(GLOB_BATCH)) == NULL)) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    char *copy = (char *)(parts + nparts);
+    memcpy(copy, pattern, len + 1);
+    glob_state_t g = {parts, 0, {NULL, 0, 0}, {NULL, 0, 0}, 0};
+    g.nparts = compileGlob(copy, parts, copy + len + 1);
+    if (g.nparts > 0) {
+        globLevel(&g, 0);
+    }
+    // Sorts keys pointing into the arena rather than the paths themselves
+    glob_match_t *sorted =
+        (glob_match_t *)malloc((g.nmatches + 1) * sizeof(glob_match_t));
+    if (sorted == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    const char *match = g.matches.data;
+    size_t shared = g.nmatches > 0 ? strlen(match) : 0;
+    for (size_t i = 0; i < g.nmatches; i++) {
+        size_t k = 0;
+        while (k < shared && match[k] == g.matches.data[k]) {
+            k++;
+        }
+        shared = k;
+        sorted[i].path = match;
+        match += strlen(match) + 1;
+    }
+    for (size_t i = 0; i < g.nmatches; i++) {
+        // Big-endian, a NUL ending the path early ordering it first
+        const char *rest = sorted[i].path + shared;
+        sorted[i].key = 0;
+        for (int k = 0; k < 8; k++) {
+            sorted[i].key = sorted[i].key << 8 | (unsigned char)*rest;
+            rest += *rest != '\0';
+        }
+    }
+    qsort(sorted, g.nmatches, sizeof(glob_match_t), compareMatches);
+    for (size_t i = 0; i < g.nmatches; i++) {
+        appendBytes(buf, sorted[i].path, strlen(sorted[i].path) + 1);
+    }
+    free(sorted);
+    free(g.path.data);
+    free(g.matches.data);
+    free(parts);
+    return (int)g.nmatches;
+}
+
+/* A word being expanded by expandWord: where it starts in the buffer and,
+ * if it is globbed, whether it has wildcards */
+typedef struct word_state {
+    word_buf_t *buf;
+    size_t start;
+    int glob;      // boolean representing if the word is globbed
+    int pattern;   // an unquoted wildcard was added
+} word_state_t;
+
+/*  Description:
+        Adds bytes to a word being expanded. In a word that is globbed,
+        quoted wildcards and every backslash are escaped, so that they only
+        match themselves, and an unquoted wildcard makes it a pattern.
+    Arguments:
+        w: the word
+        bytes: the bytes
+        n: their number
+        quoted: boolean representing if they were quoted */
+void addWordBytes(word_state_t *w, const char *bytes, size_t n, int quoted) {
+    if (!w->glob) {
+        appendBytes(w->buf, bytes, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (bytes[i] == '\\' ||
+            (quoted && strchr("*?[", bytes[i]) != NULL)) {
+            appendBytes(w->buf, "\\", 1);
+        } else if (strchr("*?[", bytes[i]) != NULL) {
+            w->pattern = 1;
+        }
+        appendBytes(w->buf, bytes + i, 1);
+    }
+}
+
+/*  Description:
+        Ends a word being expanded, replacing a pattern with the paths it
+        matches; a word left as is loses the escapes added for globbing
+    Returns:
+        the number of words it became */
+int endWord(word_state_t *w) {
+    appendBytes(w->buf, "", 1);
+    int count = 0;
+    if (w->pattern) {
+        char *pattern = strdup(w->buf->data + w->start);
+        w->buf->len = w->start;
+        count = globWord(pattern, w->buf);
+        if (count == 0) {
+            appendBytes(w->buf, pattern, strlen(pattern) + 1);
+        }
+        free(pattern);
+    }
+    if (count == 0 && w->glob) {
+        char *text = w->buf->data + w->start;
+        size_t len = unescapeGlob(text, text, strlen(text));
+        text[len] = '\0';
+        w->buf->len = w->start + len + 1;
+    }
+    w->start = w->buf->len;
+    w->pattern = 0;
+    return count > 0 ? count : 1;
+}
+
+int substitute(const char *text, size_t len, word_buf_t *out);
+// Command substitutions run so far, which tells whether a line of
+// assignments ran one
+long substitutions = 0;
+// Arguments of the running function, for $1, $# and $@
+char **positional = NULL;
+int npositional = 0;
+
+/*  Description:
+        Expands a word as lexed: removes its quotes and backslashes, and
+        outside single quotes replaces $NAME and ${NAME} with the value of
+        the variable (nothing if it is not set), $? with the last exit status,
+        $$ with the shell's PID, $1 to $9, $# and $@ (or $*) with the
+        arguments of the running function, their number and all of them,
+        and $(command) and `command` with the output of the command. When
+        splitting, a value outside double quotes is split into words at
+        blanks, and a word made only of such values disappears if they are
+        empty; the words are then globbed, those with unquoted wildcards
+        (even from a value) becoming the paths they match, if any.
+    Arguments:
+        word: the word
+        split: boolean representing if values are split into words and
+        globbed
+        buf: the resulting words are appended to it, each NUL terminated
+    Returns:
+        the number of words appended (1 unless splitting), or -1 if a ${
+        was not followed by a name and } or a substituted command had a
+        syntax error */
+int expandWord(const char *word, int split, word_buf_t *buf) {
+    word_state_t w = {buf, buf->len, split, 0};
+    int count = 0;
+    int started = !split;  // whether the current word exists, even if empty
+    char quote = '\0';     // the quote the text is inside of
+    size_t i = 0;
+    while (word[i] != '\0') {
+        char c = word[i];
+        if ((c == '$' || c == '`') && quote != '\'') {
+            char number[24];
+            word_buf_t output = {NULL, 0, 0};
+            const char *value = NULL;
+            size_t len = varNameLen(word + i + 1);
+            if (c == '`' || word[i + 1] == '(') {
+                // The lexer made sure that it is closed
+                len = substitutionEnd(word, i) - i - 1;
+                if (substitute(word + i, len + 1, &output) == -1) {
+                    return -1;
+                }
+                value = output.data;
+            } else if (word[i + 1] == '?' || word[i + 1] == '$' ||
+                       word[i + 1] == '#') {
+                snprintf(number, sizeof(number), "%d",
+                         word[i + 1] == '?'   ? lastStatus
+                         : word[i + 1] == '$' ? (int)getpid()
+                                              : npositional);
+                value = number;
+                len = 1;
+            } else if (word[i + 1] >= '1' && word[i + 1] <= '9') {
+                int n = word[i + 1] - '0';
+                value = n <= npositional ? positional[n - 1] : "";
+                len = 1;
+            } else if (word[i + 1] == '@' || word[i + 1] == '*') {
+                for (int a = 0; a < npositional; a++) {
+                    appendBytes(&output, " ", a > 0);
+                    appendBytes(&output, positional[a],
+                                strlen(positional[a]));
+                }
+                appendBytes(&output, "", 1);
+                value = output.data;
+                len = 1;
+            } else if (word[i + 1] == '{') {
+                len = varNameLen(word + i + 2);
+                if (len == 0 || word[i + 2 + len] != '}') {
+                    fprintf(stderr, "%s: bad substitution\n", word);
+                    return -1;
+                }
+                value = getVarN(word + i + 2, len);
+                len += 2;
+            } else if (len > 0) {
+                value = getVarN(word + i + 1, len);
+            } else {
+                // A $ not starting an expansion is kept
+                addWordBytes(&w, "$", 1, 1);
+                started = 1;
+                i++;
+                continue;
+            }
+            i += 1 + len;
+            value = value != NULL ? value : "";
+            for (; *value != '\0' && split && quote != '"'; value++) {
+                if (*value != ' ' && *value != '\t' && *value != '\n') {
+                    addWordBytes(&w, value, 1, 0);
+                    started = 1;
+                } else if (started) {
+                    count += endWord(&w);
+                    started = 0;
+                }
+            }
+            // What is left of a value split above is nothing
+            addWordBytes(&w, value, strlen(value), 1);
+            free(output.data);
+        } else if ((c == '\'' || c == '"') && (quote == '\0' || quote == c)) {
+            quote = quote == '\0' ? c : '\0';
+            started = 1;
+            i++;
+        } else if (c == '\\' && quote != '\'' && word[i + 1] != '\0' &&
+                   (quote == '\0' || strchr("$`\"\\", word[i + 1]) != NULL)) {
+            addWordBytes(&w, word + i + 1, 1, 1);
+            started = 1;
+            i += 2;
+        } else {
+            addWordBytes(&w, &c, 1, quote != '\0');
+            started = 1;
+            i++;
+        }
+    }
+    if (started) {
+        count += endWord(&w);
+    }
+    return count;
+}
+
+/* A pipeline whose words were expanded, held in storage of its own */
+typedef struct expanded {
+    pipeline_t pl;
+    word_buf_t words;  // the expanded words
+    command_t *cmds;   // the stages, followed by their argv and tees arrays
+} expanded_t;
+
+/*  Description:
+        Returns whether a stage of a pipeline has words to expand */
+int needsExpansion(const pipeline_t *pl) {
+    for (int i = 0; i < pl->ncmds; i++) {
+        if (pl->cmds[i].expand) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*  Description:
+        Expands the words of the stages of a pipeline parse kept as lexed,
+        into a copy of the pipeline, since the parsed line is cached and
+        runs again with other values. Command words are split, assignments
+        and redirect files are not.
+    Arguments:
+        pl: the pipeline
+        out: filled with the copy, to be freed with freeExpanded
+    Returns:
+        0 on success, -1 if a word could not be expanded */
+int expandPipeline(const pipeline_t *pl, expanded_t *out) {
+    // Expands the fields of each stage in order (assignments, command
+    // words, input, output and further outputs), remembering how many
+    // words each command word became
+    size_t nfields = 0;
+    for (int i = 0; i < pl->ncmds; i++) {
+        for (char **arg = pl->cmds[i].argv; *arg != NULL; arg++) {
+            nfields++;
+        }
+    }
+    int *counts = (int *)malloc((nfields + 1) * sizeof(int));
+    word_buf_t words = {NULL, 0, 0};
+    size_t field = 0;
+    size_t nargs = 0;
+    size_t ntees = 0;
+    int failed = 0;
+    for (int i = 0; i < pl->ncmds && !failed; i++) {
+        const command_t *cmd = &pl->cmds[i];
+        for (int a = 0; a < cmd->nassigns && cmd->expand && !failed; a++) {
+            failed = expandWord(cmd->assigns[a], 0, &words) == -1;
+        }
+        for (char **arg = cmd->argv; *arg != NULL && !failed; arg++) {
+            counts[field] = cmd->expand ? expandWord(*arg, 1, &words) : 1;
+            failed = counts[field] == -1;
+            nargs += counts[field++];
+        }
+        if (cmd->expand && !failed) {
+            failed = (cmd->input != NULL &&
+                      expandWord(cmd->input, 0, &words) == -1) ||
+                     (cmd->output != NULL &&
+                      expandWord(cmd->output, 0, &words) == -1);
+        }
+        for (int t = 0; t < cmd->ntees && cmd->expand && !failed; t++) {
+            failed = expandWord(cmd->tees[t].file, 0, &words) == -1;
+        }
+        nargs += cmd->nassigns + 1;
+        ntees += cmd->ntees;
+    }
+    if (failed) {
+        free(counts);
+        free(words.data);
+        return -1;
+    }
+    // Builds the copy, taking the expanded words in the same order
+    command_t *cmds = (command_t *)malloc(pl->ncmds * sizeof(command_t) +
+                                          nargs * sizeof(char *) +
+                                          ntees * sizeof(redirect_t));
+    if (cmds == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    char **args = (char **)(cmds + pl->ncmds);
+    redirect_t *tees = (redirect_t *)(args + nargs);
+    char *word = words.data;
+    field = 0;
+    for (int i = 0; i < pl->ncmds; i++) {
+        const command_t *cmd = &pl->cmds[i];
+        command_t *copy = &cmds[i];
+        *copy = *cmd;
+        copy->expand = 0;
+        copy->assigns = args;
+        for (int a = 0; a < cmd->nassigns; a++) {
+            *args++ = cmd->expand ? word : cmd->assigns[a];
+            word += cmd->expand ? strlen(word) + 1 : 0;
+        }
+        copy->argv = args;
+        for (char **arg = cmd->argv; *arg != NULL; arg++) {
+            if (!cmd->expand) {
+                *args++ = *arg;
+            }
+            for (int k = cmd->expand ? counts[field] : 0; k > 0; k--) {
+                *args++ = word;
+                word += strlen(word) + 1;
+            }
+            field++;
+        }
+        *args++ = NULL;
+        if (!cmd->expand) {
+            continue;
+        }
+        if (cmd->input != NULL) {
+            copy->input = word;
+            word += strlen(word) + 1;
+        }
+        if (cmd->output != NULL) {
+            copy->output = word;
+            word += strlen(word) + 1;
+        }
+        copy->tees = tees;
+        for (int t = 0; t < cmd->ntees; t++, tees++) {
+            tees->file = word;
+            tees->append = cmd->tees[t].append;
+            word += strlen(word) + 1;
+        }
+    }
+    free(counts);
+    out->pl = *pl;
+    out->pl.cmds = cmds;
+    out->words = words;
+    out->cmds = cmds;
+    return 0;
+}
+
+/* Description: frees a pipeline copied by expandPipeline */
+void freeExpanded(expanded_t *expanded) {
+    free(expanded->cmds);
+    free(expanded->words.data);
+}
+
+/* Description: FNV-1a hash of a command name */
+size_t hashName(const char *name) {
+    size_t hash = 14695981039346656037UL;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 1099511628211UL;
+    }
+    return hash;
+}
+
+/*  Description:
+        Forgets every remembered command and the PATH directories they were
+        looked up in */
+void flushHashTable() {
+    for (size_t i = 0; i < hashCapacity; i++) {
+        if (hashTable[i].name != NULL) {
+            free(hashTable[i].name);
+            free(hashTable[i].path);
+            hashTable[i].name = NULL;
+        }
+    }
+    hashCount = 0;
+    for (int i = 0; i < numPathDirs; i++) {
+        free(pathDirs[i].name);
+    }
+    free(pathDirs);
+    pathDirs = NULL;
+    numPathDirs = 0;
+    free(hashedPath);
+    hashedPath = NULL;
+    if (pathWatchFd != -1) {
+        close(pathWatchFd);
+        pathWatchFd = -1;
+    }
+}
+
+/*  Description:
+        Splits a PATH value into pathDirs, recording each directory's mtime
+        and watching it for entries being added, removed or renamed
+    Arguments:
+        path: the value of PATH */
+void loadPathDirs(const char *path) {
+    hashedPath = strdup(path);
+    pathWatchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int count = 1;
+    for (const char *c = path; *c != '\0'; c++) {
+        count += *c == ':';
+    }
+    pathDirs = (path_dir_t *)calloc((size_t)count, sizeof(path_dir_t));
+    if (hashedPath == NULL || pathDirs == NULL) {
+        perror("calloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    const char *start = path;
+    for (int i = 0; i < count; i++) {
+        const char *end = strchr(start, ':');
+        size_t len = end == NULL ? strlen(start) : (size_t)(end - start);
+        // An empty entry stands for the current directory
+        pathDirs[i].name = len == 0 ? strdup(".") : strndup(start, len);
+        if (pathDirs[i].name == NULL) {
+            perror("malloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        struct stat st;
+        if (stat(pathDirs[i].name, &st) == 0) {
+            pathDirs[i].mtime = st.st_mtim;
+        }
+        if (pathWatchFd != -1 &&
+            inotify_add_watch(pathWatchFd, pathDirs[i].name,
+                              IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                  IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF |
+                                  IN_MOVE_SELF | IN_ONLYDIR) == -1 &&
+            errno != ENOENT && errno != ENOTDIR && errno != EACCES) {
+            close(pathWatchFd);
+            pathWatchFd = -1;
+        }
+        start = end == NULL ? start + len : end + 1;
+    }
+    numPathDirs = count;
+}
+
+/*  Description:
+        Flushes the table if it no longer describes the current PATH: the
+        variable changed, or a watched directory reported a change */
+void checkHashTable() {
+    const char *path = getVar("PATH");
+    if (path == NULL) {
+        path = "";
+    }
+    if (hashedPath != NULL && strcmp(hashedPath, path) == 0) {
+        if (pathWatchFd == -1) {
+            return;
+        }
+        char events[4096];
+        ssize_t count = read(pathWatchFd, events, sizeof(events));
+        if (count == -1 && errno == EAGAIN) {
+            return;
+        }
+    }
+    flushHashTable();
+    loadPathDirs(path);
+}
+
+/*  Description:
+        Looks for an executable regular file named name in each directory of
+        the PATH, in order
+    Arguments:
+        name: command name without any /
+        dir: set to the index in pathDirs of the directory it was found in
+    Returns:
+        newly allocated full path of the command, or NULL if not found */
+char *searchPath(const char *name, int *dir) {
+    size_t nameLen = strlen(name);
+    for (int i = 0; i < numPathDirs; i++) {
+        size_t dirLen = strlen(pathDirs[i].name);
+        char *candidate = (char *)malloc(dirLen + nameLen + 2);
+        if (candidate == NULL) {
+            perror("malloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        memcpy(candidate, pathDirs[i].name, dirLen);
+        candidate[dirLen] = '/';
+        memcpy(candidate + dirLen + 1, name, nameLen + 1);
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(candidate, X_OK) == 0) {
+            *dir = i;
+            return candidate;
+        }
+        free(candidate);
+    }
+    return NULL;
+}
+
+/*  Description:
+        Adds a command to the hash table, growing it to stay at most half
+        full
+    Arguments:
+        name: the command name
+        path: its full path, owned by the table from now on
+        dir: index in pathDirs of the directory it was found in
+    Returns:
+        the new entry */
+hash_entry_t *insertHashEntry(const char *name, char *path, int dir) {
+    if ((hashCount + 1) * 2 > hashCapacity) {
+        size_t oldCapacity = hashCapacity;
+        hash_entry_t *old = hashTable;
+        hashCapacity = oldCapacity == 0 ? 64 : oldCapacity * 2;
+        hashTable = (hash_entry_t *)calloc(hashCapacity, sizeof(hash_entry_t));
+        if (hashTable == NULL) {
+            perror("calloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].name != NULL) {
+                size_t slot = hashName(old[i].name) & (hashCapacity - 1);
+                while (hashTable[slot].name != NULL) {
+                    slot = (slot + 1) & (hashCapacity - 1);
+                }
+                hashTable[slot] = old[i];
+            }
+        }
+        free(old);
+    }
+    size_t slot = hashName(name) & (hashCapacity - 1);
+    while (hashTable[slot].name != NULL) {
+        slot = (slot + 1) & (hashCapacity - 1);
+    }
+    hashTable[slot].name = strdup(name);
+    if (hashTable[slot].name == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    hashTable[slot].path = path;
+    hashTable[slot].dir = dir;
+    hashTable[slot].hits = 0;
+    hashCount++;
+    return &hashTable[slot];
+}
+
+/*  Description:
+        Finds the program to run for a command name. Names containing a /
+        are used as they are, others are looked up in the hash table and
+        only searched for in the PATH directories on a miss
+    Arguments:
+        name: argv[0] of the command
+    Returns:
+        path of the program, or NULL if it could not be found; the string
+        belongs to the table and is only valid until the next lookup */
+char *findCommand(char *name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    checkHashTable();
+    if (hashCapacity > 0) {
+        size_t slot = hashName(name) & (hashCapacity - 1);
+        while (hashTable[slot].name != NULL) {
+            hash_entry_t *entry = &hashTable[slot];
+            if (!strcmp(entry->name, name)) {
+                // Without inotify the entry's directory must be unchanged
+                struct stat st;
+                path_dir_t *dir = &pathDirs[entry->dir];
+                if (pathWatchFd == -1 &&
+                    (stat(dir->name, &st) == -1 ||
+                     st.st_mtim.tv_sec != dir->mtime.tv_sec ||
+                     st.st_mtim.tv_nsec != dir->mtime.tv_nsec)) {
+                    flushHashTable();
+                    loadPathDirs(getVar("PATH") ? getVar("PATH") : "");
+                    break;
+                }
+                hashHits++;
+                entry->hits++;
+                return entry->path;
+            }
+            slot = (slot + 1) & (hashCapacity - 1);
+        }
+    }
+    hashMisses++;
+    int dir;
+    char *path = searchPath(name, &dir);
+    if (path == NULL) {
+        return NULL;
+    }
+    return insertHashEntry(name, path, dir)->path;
+}
+
+/*  Description:
+        Function for the hash command: lists remembered commands with their
+        hit counts and the table's overall hits and misses, forgets them all
+        with -r, or looks up and remembers the given commands
+    Arguments:
+        tokens: array of strings representing hash command
+    Returns:
+        0 on success, 1 on error */
+int hashCommand(char *tokens[]) {
+    if (tokens[1] != NULL && !strcmp(tokens[1], "-r")) {
+        if (tokens[2] != NULL) {
+            fprintf(stderr, "hash: syntax error\n");
+            return 1;
+        }
+        flushHashTable();
+        hashHits = 0;
+        hashMisses = 0;
+        return 0;
+    }
+    if (tokens[1] != NULL) {
+        int status = 0;
+        for (int i = 1; tokens[i] != NULL; i++) {
+            if (findCommand(tokens[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", tokens[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+    checkHashTable();
+    if (printf("hits\tcommand\n") < 0) {
+        fprintf(stderr, "Error: Could not print hash table.\n");
+        return 1;
+    }
+    for (size_t i = 0; i < hashCapacity; i++) {
+        if (hashTable[i].name != NULL) {
+            printf("%4d\t%s\n", hashTable[i].hits, hashTable[i].path);
+        }
+    }
+    printf("%ld hits, %ld misses\n", hashHits, hashMisses);
+    return 0;
+}
+
+/*  Description:
+        Checks whether a launch policy asks for anything
+    Arguments:
+        policy: the policy to check
+    Returns:
+        1 if it sets a nice level, an affinity, a limit or a cgroup, 0 if
+        not */
+int hasPolicy(const launch_policy_t *policy) {
+    return policy->nice != 0 || policy->pinned || policy->nlimits > 0 ||
+           policy->cgroup[0] != '\0';
+}
+
+/*  Description:
+        Records the policy of launchPolicy as that of a job, for jobs to
+        show
+    Arguments:
+        jid: job ID of the job */
+void recordPolicy(int jid) {
+    if (!hasPolicy(&launchPolicy)) {
+        return;
+    }
+    char text[sizeof(launchPolicy.text) + 32];
+    int len = 0;
+    if (launchPolicy.nice != 0) {
+        len = snprintf(text, sizeof(text), "nice=%d%s", launchPolicy.nice,
+                       launchPolicy.text[0] != '\0' ? " " : "");
+    }
+    snprintf(text + len, sizeof(text) - len, "%s", launchPolicy.text);
+    set_job_policy(jobList, jid, text);
+}
+
+/*  Description:
+        Applies a launch policy to the calling child before it executes its
+        program. Its program is not run at all if the affinity, a limit or
+        the cgroup cannot be applied; the nice level is only a hint.
+    Arguments:
+        policy: the policy to apply */
+void applyPolicy(const launch_policy_t *policy) {
+    errno = 0;
+    if (policy->nice != 0 && nice(policy->nice) == -1 && errno != 0) {
+        perror("nice");
+    }
+    if (policy->pinned &&
+        sched_setaffinity(0, sizeof(cpu_set_t), &policy->cpus) == -1) {
+        perror("sched_setaffinity");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    for (int i = 0; i < policy->nlimits; i++) {
+        if (setrlimit(policy->limits[i].resource, &policy->limits[i].limit) ==
+            -1) {
+            perror("setrlimit");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    // Moves itself into the cgroup, 0 standing for the writing process
+    if (policy->cgroup[0] != '\0') {
+        char procs[PATH_MAX + 16];
+        snprintf(procs, sizeof(procs), "%s/cgroup.procs", policy->cgroup);
+        int fd = open(procs, O_WRONLY | O_CLOEXEC);
+        if (fd == -1 || write(fd, "0\n", 2) != 2) {
+            perror(procs);
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        close(fd);
+    }
+}
+
+/*
+ * - Description:
+ *      Runs in a freshly forked child to make it part of its job: joins the
+ * job's process group, takes the terminal if it starts a foreground job, and
+ * goes back to the signal handling the shell was started with
+ * - Arguments:
+ *      pgid: process group to join, 0 to start a new one
+ *      background: boolean representing if & was last character in input line
+ */
+void enterJob(pid_t pgid, int background) {
+    // Trace events from here on are the child's
+    tracePid = getpid();
+    // Joins the job's process group (the first stage's PID)
+    traceEvent('B', TRACE_SETPGID, pgid);
+    if (setpgid(0, pgid) == -1) {
+        perror("setpgid");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    traceEvent('E', TRACE_SETPGID, pgid);
+    // Gets child PGID and sets it as controlling process group if its
+    // the first stage of a foreground job
+    if (terminal && !background && pgid == 0) {
+        traceEvent('B', TRACE_TCSETPGRP, 0);
+        pid_t pgroup;
+        if ((pgroup = getpgid(0)) == -1) {
+            perror("getpgid");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        if (tcsetpgrp(0, pgroup) == -1) {
+            perror("tcsetpgrp");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        traceEvent('E', TRACE_TCSETPGRP, pgroup);
+    }
+    // Reinstates default signal handling behavior and the signal mask the
+    // shell was started with
+    if (sigprocmask(SIG_SETMASK, &shellMask, NULL) == -1) {
+        perror("sigprocmask");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (signal(SIGTSTP, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (signal(SIGQUIT, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (signal(SIGTTOU, SIG_DFL) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+}
+
+int isBuiltin(const char *name);
+int runStageBuiltin(char *argv[]);
+
+/*
+ * - Description:
+ *      Runs in a freshly forked child: joins the job's process group, wires
+ * up the pipe ends and redirects, and executes the program given in
+ * cmd->argv[0], or runs it as a built-in if it has no path. Never returns.
+ * - Arguments:
+ *      cmd: the pipeline stage to run
+ *      pgid: process group to join, 0 to start a new one
+ *      inFd: read end of the pipe from the previous stage, or -1
+ *      outFd: write end of the pipe to the next stage, or -1
  *      background: boolean representing if & was last character in input line
  */
-void execute(char *argv[], char *input, char *output, int append,
-             int background) {
-    // Saves a copy of full filepath of command
-    char *filepath = argv[0];
-    /* Creates child process */
-    pid_t childPID;
-    if ((childPID = fork()) == 0) {
-        // Sets child PID as its PGID
-        if (setpgid(0, 0) == -1) {
-            perror("setpgid");
+void runChild(command_t *cmd, pid_t pgid, int inFd, int outFd,
+              int background) {
+    char **argv = cmd->argv;
+    // Saves a copy of full filepath of command
+    char *filepath = cmd->path;
+    enterJob(pgid, background);
+    // Confines the process as asked with the queue and limit prefixes
+    applyPolicy(&launchPolicy);
+    /* Converts path in argv[0] to just the last branch of path and saves in
+     * argv[0] */
+    char *path = strrchr(argv[0], '/');
+    if (path != NULL) {
+        argv[0] = (path + 1);
+    }
+    /* Connects the pipes to the neighbouring stages; the originals are
+     * O_CLOEXEC so only the dup'd descriptors survive execve */
+    traceEvent('B', TRACE_REDIRECT, 0);
+    if (inFd != -1 && dup2(inFd, 0) == -1) {
+        perror("dup2");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (outFd != -1 && dup2(outFd, 1) == -1) {
+        perror("dup2");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    /* Redirects file descriptor 0 to input */
+    if (cmd->input != NULL) {
+        if (close(0) == -1 && errno != EBADF) {
+            perror("close");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        if (open(cmd->input, O_RDONLY) == -1) {
+            perror("open");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    /* Redirects file descriptor 1 to output */
+    if (cmd->output != NULL) {
+        if (close(1) == -1 && errno != EBADF) {
+            perror("close");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        /* Checks which of >> or > was specified and responds accordingly */
+        int flags = cmd->append ? O_WRONLY | O_CREAT | O_APPEND
+                                : O_WRONLY | O_CREAT | O_TRUNC;
+        if (open(cmd->output, flags, 0666) == -1) {
+            perror("open");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    traceEvent('E', TRACE_REDIRECT, 0);
+    if (filepath == NULL) {
+        exit(runStageBuiltin(argv));
+    }
+    /*  Executes program in new process image with filepath being the full
+        file path, and argv[0] now containing only the file binary name */
+    traceEvent('i', TRACE_EXEC, 0);
+    execve(filepath, argv, launchEnv);
+    /* We won't get here unless execve failed, meaning an error occurred */
+    perror("execve");
+    cleanup_job_list(jobList);
+    exit(1);
+}
+
+/*
+ * - Description:
+ *      Starts one pipeline stage with posix_spawn, describing everything
+ * runChild does after fork (process group, default signal handlers and mask,
+ * pipe ends and redirects) as spawn attributes and file actions
+ * - Arguments:
+ *      cmd: the pipeline stage to run
+ *      pgid: process group to join, 0 to start a new one
+ *      inFd: read end of the pipe from the previous stage, or -1
+ *      outFd: write end of the pipe to the next stage, or -1
+ *      background: boolean representing if & was last character in input line
+ * - Returns:
+ *      the PID of the child, or -1 if it could not be started
+ */
+pid_t spawnChild(command_t *cmd, pid_t pgid, int inFd, int outFd,
+                 int background) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    if (posix_spawnattr_init(&attr) != 0 ||
+        posix_spawn_file_actions_init(&actions) != 0) {
+        perror("posix_spawn");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    // Joins the job's process group with default signal handling behavior
+    // and the signal mask the shell was started with
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                        POSIX_SPAWN_SETSIGDEF |
+                                        POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &shellMask);
+    // Connects the pipes, then the redirects which take precedence
+    if (inFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, inFd, 0);
+    }
+    if (outFd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, outFd, 1);
+    }
+    if (cmd->input != NULL) {
+        posix_spawn_file_actions_addopen(&actions, 0, cmd->input, O_RDONLY, 0);
+    }
+    if (cmd->output != NULL) {
+        int flags = cmd->append ? O_WRONLY | O_CREAT | O_APPEND
+                                : O_WRONLY | O_CREAT | O_TRUNC;
+        posix_spawn_file_actions_addopen(&actions, 1, cmd->output, flags,
+                                         0666);
+    }
+    // Passes only the last branch of the path as argv[0]
+    char *name = cmd->argv[0];
+    char *path = strrchr(name, '/');
+    if (path != NULL) {
+        cmd->argv[0] = path + 1;
+    }
+    pid_t childPID;
+    int err = posix_spawn(&childPID, cmd->path, &actions, &attr, cmd->argv,
+                          launchEnv);
+    cmd->argv[0] = name;
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(err));
+        return -1;
+    }
+    // The child cannot take the terminal itself, so the shell hands it over
+    // for the first stage of a foreground job
+    if (terminal && !background && pgid == 0 &&
+        tcsetpgrp(0, childPID) == -1) {
+        perror("tcsetpgrp");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    return childPID;
+}
+
+/*  Description:
+        Moves bytes held in a pipe to a file with splice, so that they never
+        leave the kernel, or through a buffer where the file does not take
+        splice (a terminal, for one). Once writing to the file has failed
+        the bytes are only taken out of the pipe.
+    Arguments:
+        pipeFd: read end of the pipe
+        fd: the file, -1 if writing to it failed before
+        copy: set to 1 once the file turned out not to take splice
+        len: the number of bytes to move, all of which are in the pipe
+        buf: buffer of at least len bytes for the copies
+    Returns:
+        0 on success, -1 if writing to the file failed */
+int relayBytes(int pipeFd, int fd, int *copy, size_t len, char *buf) {
+    int failed = fd == -1;
+    while (len > 0) {
+        ssize_t n = -1;
+        if (!failed && !*copy) {
+            n = splice(pipeFd, NULL, fd, NULL, len, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            *copy = n == -1 && errno == EINVAL;
+            failed = n == -1 && !*copy;
+        }
+        if (n == -1) {
+            n = read(pipeFd, buf, len);
+            if (n <= 0) {
+                return -1;
+            }
+            for (ssize_t done = 0; !failed && done < n;) {
+                ssize_t count = write(fd, buf + done, n - done);
+                failed = count == -1 && errno != EINTR;
+                done += count > 0 ? count : 0;
+            }
+        }
+        len -= n;
+    }
+    return failed ? -1 : 0;
+}
+
+/*  Description:
+        Runs in the relay process of a stage with several output files,
+        copying everything the stage writes into each of them: tee
+        duplicates what is in the stage's pipe into a spare pipe once per
+        file but the last, which is spliced to that file, and the last gets
+        the bytes themselves. Files that cannot be written to are dropped,
+        as tee does. Never returns.
+    Arguments:
+        inFd: read end of the stage's pipe
+        fds: the output files
+        nfds: the number of files, at least 2 */
+void runRelay(int inFd, int fds[], int nfds) {
+    int spare[2];
+    if (pipe(spare) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    // Both pipes get the same size so that each tee takes the same bytes
+    fcntl(inFd, F_SETPIPE_SZ, RELAY_CHUNK);
+    fcntl(spare[0], F_SETPIPE_SZ, RELAY_CHUNK);
+    int inSize = fcntl(inFd, F_GETPIPE_SZ);
+    int spareSize = fcntl(spare[0], F_GETPIPE_SZ);
+    size_t chunk = (size_t)(inSize < spareSize ? inSize : spareSize);
+    char *buf = (char *)malloc(chunk);
+    int *copy = (int *)calloc(nfds, sizeof(int));
+    int status = 0;
+    while (buf != NULL && copy != NULL) {
+        // Waits for the stage to write, a 0 meaning it is done
+        ssize_t n = tee(inFd, spare[1], chunk, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            status = n == 0 ? status : 1;
+            break;
+        }
+        for (int k = 0; k < nfds; k++) {
+            if (k > 0 && k < nfds - 1 && tee(inFd, spare[1], n, 0) != n) {
+                perror("tee");
+                exit(1);
+            }
+            int from = k < nfds - 1 ? spare[0] : inFd;
+            if (relayBytes(from, fds[k], &copy[k], n, buf) == -1 &&
+                fds[k] != -1) {
+                perror("write");
+                fds[k] = -1;
+                status = 1;
+            }
+        }
+    }
+    exit(buf != NULL && copy != NULL ? status : 1);
+}
+
+/*  Description:
+        Opens every output file of a stage and forks a relay process into
+        the stage's job, which copies what the stage writes to a pipe into
+        all of them
+    Arguments:
+        cmd: the stage, with output and tees set
+        pgid: process group to join, 0 to start a new one
+        background: boolean representing if & was last character in input line
+        writeFd: set to the write end of the pipe, for the stage to write to
+    Returns:
+        the PID of the relay, or -1 if a file could not be opened */
+pid_t startRelay(command_t *cmd, pid_t pgid, int background, int *writeFd) {
+    int nfds = cmd->ntees + 1;
+    int *fds = (int *)malloc((nfds + 1) * sizeof(int));
+    if (fds == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    for (int k = 0; k < nfds; k++) {
+        char *file = k == 0 ? cmd->output : cmd->tees[k - 1].file;
+        int append = k == 0 ? cmd->append : cmd->tees[k - 1].append;
+        fds[k] = open(file,
+                      O_WRONLY | O_CREAT | O_CLOEXEC |
+                          (append ? O_APPEND : O_TRUNC),
+                      0666);
+        if (fds[k] == -1) {
+            perror(file);
+            while (k-- > 0) {
+                close(fds[k]);
+            }
+            free(fds);
+            return -1;
+        }
+    }
+    int relayFds[2];
+    if (pipe2(relayFds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (pid == 0) {
+        enterJob(pgid, background);
+        // Keeps only the pipe and the files open, so that it holds no pipe
+        // end of other stages that would keep them from seeing EOF
+        fds[nfds] = relayFds[0];
+        int next = 3;
+        for (int low = 3; low != INT_MAX; next = low + 1) {
+            low = INT_MAX;
+            for (int k = 0; k <= nfds; k++) {
+                low = fds[k] >= next && fds[k] < low ? fds[k] : low;
+            }
+            if (low > next) {
+                syscall(SYS_close_range, (unsigned)next,
+                        low == INT_MAX ? ~0U : (unsigned)low - 1, 0);
+            }
+        }
+        runRelay(relayFds[0], fds, nfds);
+    }
+    if (setpgid(pid, pgid == 0 ? pid : pgid) == -1) {
+        perror("setpgid");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    for (int k = 0; k < nfds; k++) {
+        close(fds[k]);
+    }
+    free(fds);
+    close(relayFds[0]);
+    *writeFd = relayFds[1];
+    return pid;
+}
+
+/* A launch request sent to the fork server, followed in the same message by
+ * the program's path, its arguments and the redirects that are set, as NUL
+ * terminated strings, with the child's stdin, stdout and stderr attached
+ * as SCM_RIGHTS */
+typedef struct server_request {
+    pid_t pgid;
+    int background;
+    int terminal;
+    int argc;
+    int hasInput;
+    int hasOutput;
+    int append;
+    int envc;  // environment strings at the end, -1 to keep the last ones
+    sigset_t mask;  // signal mask the shell was started with
+    launch_policy_t policy;
+} server_request_t;
+
+/*  Description:
+        Starts the fork server: the shell's own program executed afresh with
+        FORK_SERVER_ARG, so that it holds none of the shell's memory, and
+        connected to the shell by a SOCK_SEQPACKET socket
+    Returns:
+        0 on success, -1 on error */
+int startServer() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], 3);
+    char *argv[] = {"sh-fork-server", FORK_SERVER_ARG, NULL};
+    pid_t pid;
+    int err = posix_spawn(&pid, "/proc/self/exe", &actions, NULL, argv,
+                          environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+    if (err != 0) {
+        fprintf(stderr, "fork server: %s\n", strerror(err));
+        close(sv[0]);
+        return -1;
+    }
+    serverFd = sv[0];
+    serverEnvVersion = 0;
+    return 0;
+}
+
+void ignoreSignals();
+
+/*  Description:
+        Main loop of the fork server. For each request it clones a child
+        with CLONE_PARENT, which makes the child the shell's rather than its
+        own, so the shell waits for it and controls it like any other; the
+        child installs the descriptors it was sent and carries on as
+        runChild. Returns once the shell closes its end of the socket.
+    Arguments:
+        fd: socket to the shell
+    Returns:
+        the exit status of the fork server */
+int runServer(int fd) {
+    ignoreSignals();
+    // The environment last sent, which children are started with
+    char *envStrings = NULL;
+    launchEnv = environ;
+    char *buf = (char *)malloc(SERVER_REQUEST_MAX);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    while (1) {
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(3 * sizeof(int))];
+        } control;
+        struct iovec iov = {buf, SERVER_REQUEST_MAX};
+        struct msghdr msg = {NULL, 0, &iov, 1, &control, sizeof(control), 0};
+        ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            free(buf);
+            return len == 0 ? 0 : 1;
+        }
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        int fds[3];
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+            cmsg->cmsg_len != CMSG_LEN(sizeof(fds)) ||
+            (size_t)len < sizeof(server_request_t)) {
+            fprintf(stderr, "fork server: malformed request\n");
+            free(buf);
+            return 1;
+        }
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        server_request_t *req = (server_request_t *)buf;
+        if (req->envc >= 0) {
+            // Keeps the environment, the last of the strings
+            char *str = buf + sizeof(server_request_t);
+            for (int i = 0; i < 1 + req->argc + req->hasInput + req->hasOutput;
+                 i++) {
+                str += strlen(str) + 1;
+            }
+            if (launchEnv != environ) {
+                free(launchEnv);
+                free(envStrings);
+            }
+            envStrings = (char *)malloc((size_t)(buf + len - str));
+            launchEnv = (char **)malloc((req->envc + 1) * sizeof(char *));
+            if (envStrings == NULL || launchEnv == NULL) {
+                perror("malloc");
+                free(buf);
+                return 1;
+            }
+            memcpy(envStrings, str, (size_t)(buf + len - str));
+            str = envStrings;
+            for (int i = 0; i < req->envc; i++) {
+                launchEnv[i] = str;
+                str += strlen(str) + 1;
+            }
+            launchEnv[req->envc] = NULL;
+        }
+        pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL,
+                                   NULL, 0);
+        if (pid == 0) {
+            // Rebuilds the command from the strings after the request
+            char **argv = (char **)malloc((req->argc + 1) * sizeof(char *));
+            if (argv == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            char *str = buf + sizeof(server_request_t);
+            command_t cmd = {.argv = argv, .path = str, .append = req->append};
+            str += strlen(str) + 1;
+            for (int i = 0; i < req->argc; i++) {
+                argv[i] = str;
+                str += strlen(str) + 1;
+            }
+            argv[req->argc] = NULL;
+            if (req->hasInput) {
+                cmd.input = str;
+                str += strlen(str) + 1;
+            }
+            if (req->hasOutput) {
+                cmd.output = str;
+            }
+            for (int i = 0; i < 3; i++) {
+                if (dup2(fds[i], i) == -1) {
+                    perror("dup2");
+                    exit(1);
+                }
+            }
+            terminal = req->terminal;
+            shellMask = req->mask;
+            launchPolicy = req->policy;
+            runChild(&cmd, req->pgid, -1, -1, req->background);
+        }
+        int reply = pid == -1 ? -errno : (int)pid;
+        for (int i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        if (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1) {
+            free(buf);
+            return 1;
+        }
+    }
+}
+
+/*  Description:
+        Has the fork server start one pipeline stage, passing it what
+        runChild needs along with the descriptors the stage reads from and
+        writes to
+    Arguments:
+        cmd: the pipeline stage to run
+        pgid: process group to join, 0 to start a new one
+        inFd: read end of the pipe from the previous stage, or -1
+        outFd: write end of the pipe to the next stage, or -1
+        background: boolean representing if & was last character in input line
+    Returns:
+        the PID of the child, -1 if it could not be started, or -2 if the
+        request could not be made (the command being too long, memory
+        short or the server gone, in which case the shell goes back to
+        forking) */
+pid_t serverSpawn(command_t *cmd, pid_t pgid, int inFd, int outFd,
+                  int background) {
+    server_request_t req;
+    memset(&req, 0, sizeof(req));
+    req.pgid = pgid;
+    req.background = background;
+    req.terminal = terminal;
+    req.hasInput = cmd->input != NULL;
+    req.hasOutput = cmd->output != NULL;
+    req.append = cmd->append;
+    req.mask = shellMask;
+    req.policy = launchPolicy;
+    size_t len = strlen(cmd->path) + 1;
+    for (char **arg = cmd->argv; *arg != NULL; arg++, req.argc++) {
+        len += strlen(*arg) + 1;
+    }
+    len += req.hasInput ? strlen(cmd->input) + 1 : 0;
+    len += req.hasOutput ? strlen(cmd->output) + 1 : 0;
+    // The server keeps the environment last sent, so it is only sent when
+    // it changed or the command has one of its own
+    req.envc = -1;
+    if (launchEnv != envp || serverEnvVersion != envVersion) {
+        for (req.envc = 0; launchEnv[req.envc] != NULL; req.envc++) {
+            len += strlen(launchEnv[req.envc]) + 1;
+        }
+    }
+    if (sizeof(req) + len > SERVER_REQUEST_MAX) {
+        return -2;
+    }
+    char *strings = (char *)malloc(len);
+    if (strings == NULL) {
+        perror("malloc");
+        return -2;
+    }
+    char *str = stpcpy(strings, cmd->path) + 1;
+    for (char **arg = cmd->argv; *arg != NULL; arg++) {
+        str = stpcpy(str, *arg) + 1;
+    }
+    if (req.hasInput) {
+        str = stpcpy(str, cmd->input) + 1;
+    }
+    if (req.hasOutput) {
+        str = stpcpy(str, cmd->output) + 1;
+    }
+    for (int i = 0; i < req.envc; i++) {
+        str = stpcpy(str, launchEnv[i]) + 1;
+    }
+    int fds[3] = {inFd != -1 ? inFd : 0, outFd != -1 ? outFd : 1, 2};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov[2] = {{&req, sizeof(req)}, {strings, len}};
+    struct msghdr msg = {NULL, 0, iov, 2, &control, sizeof(control), 0};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    traceEvent('B', TRACE_SERVER, 0);
+    ssize_t sent = sendmsg(serverFd, &msg, MSG_NOSIGNAL);
+    free(strings);
+    int reply = 0;
+    ssize_t got = 0;
+    if (sent != -1) {
+        while ((got = recv(serverFd, &reply, sizeof(reply), 0)) == -1 &&
+               errno == EINTR) {
+        }
+    }
+    traceEvent('E', TRACE_SERVER, reply);
+    if (sent == -1 || got != sizeof(reply)) {
+        // The server is gone or unusable, so children are forked again
+        fprintf(stderr, "fork server: %s, forking instead\n",
+                sent == -1 || got == -1 ? strerror(errno) : "exited");
+        close(serverFd);
+        serverFd = -1;
+        spawnBackend = SPAWN_FORK;
+        return -2;
+    }
+    if (req.envc != -1) {
+        serverEnvVersion = launchEnv == envp ? envVersion : 0;
+    }
+    if (reply < 0) {
+        fprintf(stderr, "%s: %s\n", cmd->argv[0], strerror(-reply));
+        return -1;
+    }
+    return (pid_t)reply;
+}
+
+/* A background job waiting to be admitted, holding its own copy of the
+ * pipeline since the parsed line it came from may be freed meanwhile */
+typedef struct queued_job {
+    int jid;
+    int priority;
+    launch_policy_t policy;
+    long seq;  // order it was queued in, breaking ties in priority
+    int ncmds;
+    command_t *cmds;  // followed in the same allocation by the argv arrays
+                      // and the strings
+} queued_job_t;
+
+// Binary heap of queued jobs, highest priority first and in the order they
+// were queued within a priority
+queued_job_t **jobQueue = NULL;
+size_t queueCount = 0;
+size_t queueCapacity = 0;
+long queueSeq = 0;
+// Last time a job was admitted, since the load average is only updated
+// every few seconds and lags behind the jobs just started
+struct timespec lastAdmit = {0, 0};
+
+/*  Description:
+        Orders two queued jobs in jobQueue
+    Returns:
+        whether a is to be started before b */
+int queueBefore(const queued_job_t *a, const queued_job_t *b) {
+    return a->priority > b->priority ||
+           (a->priority == b->priority && a->seq < b->seq);
+}
+
+/*  Description:
+        Restores the heap order of jobQueue around one entry that changed
+    Arguments:
+        i: index of the entry */
+void queueSift(size_t i) {
+    queued_job_t *entry = jobQueue[i];
+    // Moves it up past the entries it comes before
+    while (i > 0 && queueBefore(entry, jobQueue[(i - 1) / 2])) {
+        jobQueue[i] = jobQueue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    // Moves it down past the entries that come before it
+    while (2 * i + 1 < queueCount) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < queueCount &&
+            queueBefore(jobQueue[child + 1], jobQueue[child])) {
+            child++;
+        }
+        if (!queueBefore(jobQueue[child], entry)) {
+            break;
+        }
+        jobQueue[i] = jobQueue[child];
+        i = child;
+    }
+    jobQueue[i] = entry;
+}
+
+/*  Description:
+        Takes an entry out of jobQueue
+    Arguments:
+        i: index of the entry
+    Returns:
+        the entry, to be freed by the caller */
+queued_job_t *queueRemove(size_t i) {
+    queued_job_t *entry = jobQueue[i];
+    jobQueue[i] = jobQueue[--queueCount];
+    if (i < queueCount) {
+        queueSift(i);
+    }
+    return entry;
+}
+
+/*  Description:
+        Builds the command string a job is listed with in jobs, from each
+        pipeline stage's program
+    Arguments:
+        cmds: the pipeline stages
+        ncmds: the number of stages
+    Returns:
+        the string, to be freed by the caller */
+char *jobCommand(command_t cmds[], int ncmds) {
+    size_t cmdlen = 1;
+    for (int i = 0; i < ncmds; i++) {
+        cmdlen += strlen(cmds[i].argv[0]) + 3;
+    }
+    char *command = (char *)malloc(cmdlen);
+    command[0] = '\0';
+    for (int i = 0; i < ncmds; i++) {
+        if (i > 0) {
+            strcat(command, " | ");
+        }
+        strcat(command, cmds[i].argv[0]);
+    }
+    return command;
+}
+
+/*  Description:
+        Queues a background pipeline instead of starting it, as the QUEUED
+        job job in jobList, with the priority of launchPriority and the
+        policy of launchPolicy
+    Arguments:
+        cmds: the pipeline stages
+        ncmds: the number of stages */
+void queueJob(command_t cmds[], int ncmds) {
+    // Copies the pipeline into one allocation: the stages, their further
+    // output redirects, their assigns and argv arrays and then the strings
+    size_t size = sizeof(queued_job_t) + ncmds * sizeof(command_t);
+    int ntees = 0;
+    for (int i = 0; i < ncmds; i++) {
+        for (int a = 0; a < cmds[i].nassigns; a++) {
+            size += sizeof(char *) + strlen(cmds[i].assigns[a]) + 1;
+        }
+        for (char **arg = cmds[i].argv; *arg != NULL; arg++) {
+            size += sizeof(char *) + strlen(*arg) + 1;
+        }
+        size += sizeof(char *);
+        size += cmds[i].input != NULL ? strlen(cmds[i].input) + 1 : 0;
+        size += cmds[i].output != NULL ? strlen(cmds[i].output) + 1 : 0;
+        for (int t = 0; t < cmds[i].ntees; t++) {
+            size += sizeof(redirect_t) + strlen(cmds[i].tees[t].file) + 1;
+        }
+        ntees += cmds[i].ntees;
+    }
+    queued_job_t *entry = (queued_job_t *)malloc(size);
+    if (entry == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    entry->jid = job;
+    entry->priority = launchPriority;
+    entry->policy = launchPolicy;
+    entry->seq = queueSeq++;
+    entry->ncmds = ncmds;
+    entry->cmds = (command_t *)(entry + 1);
+    redirect_t *tees = (redirect_t *)(entry->cmds + ncmds);
+    char **argv = (char **)(tees + ntees);
+    size_t nargs = 0;
+    for (int i = 0; i < ncmds; i++) {
+        while (cmds[i].argv[nargs] != NULL) {
+            nargs++;
+        }
+        argv += cmds[i].nassigns + nargs + 1;
+        nargs = 0;
+    }
+    char *strings = (char *)argv;
+    argv = (char **)(tees + ntees);
+    for (int i = 0; i < ncmds; i++) {
+        command_t *copy = &entry->cmds[i];
+        *copy = cmds[i];
+        copy->assigns = argv;
+        for (int a = 0; a < cmds[i].nassigns; a++) {
+            *argv++ = strcpy(strings, cmds[i].assigns[a]);
+            strings += strlen(cmds[i].assigns[a]) + 1;
+        }
+        copy->argv = argv;
+        for (char **arg = cmds[i].argv; *arg != NULL; arg++) {
+            *argv++ = strcpy(strings, *arg);
+            strings += strlen(*arg) + 1;
+        }
+        *argv++ = NULL;
+        if (cmds[i].input != NULL) {
+            copy->input = strcpy(strings, cmds[i].input);
+            strings += strlen(cmds[i].input) + 1;
+        }
+        if (cmds[i].output != NULL) {
+            copy->output = strcpy(strings, cmds[i].output);
+            strings += strlen(cmds[i].output) + 1;
+        }
+        copy->tees = tees;
+        for (int t = 0; t < cmds[i].ntees; t++, tees++) {
+            tees->file = strcpy(strings, cmds[i].tees[t].file);
+            tees->append = cmds[i].tees[t].append;
+            strings += strlen(cmds[i].tees[t].file) + 1;
+        }
+    }
+    if (queueCount == queueCapacity) {
+        queueCapacity = queueCapacity == 0 ? 16 : queueCapacity * 2;
+        jobQueue = (queued_job_t **)realloc(
+            jobQueue, queueCapacity * sizeof(queued_job_t *));
+        if (jobQueue == NULL) {
+            perror("realloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    jobQueue[queueCount++] = entry;
+    queueSift(queueCount - 1);
+    char *command = jobCommand(cmds, ncmds);
+    add_job(jobList, job, 0, QUEUED, command);
+    recordPolicy(job);
+    free(command);
+    if (printf("[%d] queued\n", job) < 0) {
+        fprintf(stderr, "Error: Could not print job id.\n");
+    }
+    job++;
+}
+
+/*  Description:
+        Checks whether another background job may be started: fewer than
+        jobLimit jobs are running and the load average is below loadLimit.
+        While the load limit applies, jobs are admitted at most once a
+        second, as the load average lags behind the jobs just started.
+    Returns:
+        1 if it may, 0 if it has to be queued */
+int admissionOpen() {
+    if (jobLimit > 0 && get_job_count(jobList, RUNNING) >= jobLimit) {
+        return 0;
+    }
+    if (loadLimit > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double load;
+        if (now.tv_sec - lastAdmit.tv_sec < 1 ||
+            (getloadavg(&load, 1) == 1 && load >= loadLimit)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Most coprocesses the shell holds at once, and the longest name of one
+#define COPROC_MAX 16
+#define COPROC_NAME_MAX 32
+
+/* A coprocess started by coproc NAME: a background job whose stdin and
+ * stdout are pipes held by the shell, so that later commands send it input
+ * with >&NAME and read its replies with <&NAME instead of starting a
+ * program of their own. A slot whose name is empty is free. */
+typedef struct coproc {
+    char name[COPROC_NAME_MAX];
+    int jid;
+    int inFd;   // write end of its stdin, -1 once closed
+    int outFd;  // read end of its stdout
+} coproc_t;
+
+coproc_t coprocs[COPROC_MAX];
+
+/*  Description:
+        Finds a coprocess by name, returning its slot or NULL */
+coproc_t *findCoproc(const char *name) {
+    for (int i = 0; i < COPROC_MAX; i++) {
+        if (coprocs[i].name[0] != '\0' && !strcmp(coprocs[i].name, name)) {
+            return &coprocs[i];
+        }
+    }
+    return NULL;
+}
+
+/*  Description:
+        Closes the shell's ends of a coprocess's pipes and frees its slot;
+        the job itself keeps running
+    Arguments:
+        cp: the coprocess */
+void closeCoproc(coproc_t *cp) {
+    if (cp->inFd != -1) {
+        close(cp->inFd);
+    }
+    close(cp->outFd);
+    cp->name[0] = '\0';
+}
+
+/*  Description:
+        Copies the shell's end of a coprocess's pipe for a redirection
+    Arguments:
+        name: the coprocess
+        output: 1 for the end writing to its stdin, 0 for the end reading
+        its stdout
+    Returns:
+        the copy, which the caller closes, or -1 after printing an error */
+int dupCoproc(const char *name, int output) {
+    coproc_t *cp = findCoproc(name);
+    int fd = cp == NULL ? -1 : output ? cp->inFd : cp->outFd;
+    if (fd == -1) {
+        fprintf(stderr, "%s: %s\n", name,
+                cp == NULL ? "no such coprocess" : "coprocess input closed");
+        return -1;
+    }
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+    if (copy == -1) {
+        perror("fcntl");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    return copy;
+}
+
+/*  Description:
+        Replaces a stage's redirections to coprocesses with copies of the
+        shell's ends of their pipes
+    Arguments:
+        stage: the stage, whose coproc flags are cleared
+        inFd: set to the copy to read from if its input is a coprocess
+        outFd: set to the copy to write to if its output is one
+    Returns:
+        0 on success, -1 if a coprocess is gone */
+int redirectCoprocs(command_t *stage, int *inFd, int *outFd) {
+    int in = *inFd;
+    int out = *outFd;
+    if ((stage->coproc & COPROC_IN) &&
+        (in = dupCoproc(stage->input, 0)) == -1) {
+        return -1;
+    }
+    if ((stage->coproc & COPROC_OUT) &&
+        (out = dupCoproc(stage->output, 1)) == -1) {
+        if (stage->coproc & COPROC_IN) {
+            close(in);
+        }
+        return -1;
+    }
+    if (stage->coproc & COPROC_IN) {
+        stage->input = NULL;
+    }
+    if (stage->coproc & COPROC_OUT) {
+        stage->output = NULL;
+    }
+    stage->coproc = 0;
+    *inFd = in;
+    *outFd = out;
+    return 0;
+}
+
+/*  Description:
+        Adds a process just started to a job, the first one creating the
+        job and naming its process group
+    Arguments:
+        jid: job ID of the job
+        pid: PID of the process
+        pgid: process group of the job, set to pid if it is still 0
+        command: the job's command line */
+void addJobProcess(int jid, pid_t pid, pid_t *pgid, char *command) {
+    if (*pgid == 0) {
+        *pgid = pid;
+        add_job(jobList, jid, pid, RUNNING, command);
+        recordPolicy(jid);
+    } else {
+        add_job_process(jobList, jid, pid);
+    }
+}
+
+/*
+ * - Description:
+ *      Starts a pipeline of one or more commands, each in its own child
+ * process, all placed in one process group and added to jobList as a single
+ * job
+ * - Arguments:
+ *      cmds: the pipeline stages, in order
+ *      ncmds: the number of stages
+ *      jid: job ID to add the job under
+ *      background: boolean representing if the pipeline ended with &
+ *      firstIn: where the first stage reads unless it redirects its input,
+ * -1 for the shell's stdin; left open
+ *      outFd: where the last stage writes unless it redirects its output,
+ * -1 for the shell's stdout; left open
+ * - Returns:
+ *      the process group ID of the job, or 0 if no stage could be started
+ */
+pid_t startJob(command_t cmds[], int ncmds, int jid, int background,
+               int firstIn, int outFd) {
+    traceEvent('B', TRACE_START, jid);
+    char *command = jobCommand(cmds, ncmds);
+    // Writes out anything the shell buffered so that it appears before the
+    // job's output and is not flushed a second time by a failing child
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    /* Creates one child process per stage, each reading from the pipe
+     * written by the stage before it */
+    pid_t pgid = 0;
+    int inFd = firstIn;
+    for (int i = 0; i < ncmds; i++) {
+        int pipeFds[2] = {-1, -1};
+        if (i < ncmds - 1 && pipe2(pipeFds, O_CLOEXEC) == -1) {
+            perror("pipe2");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        int stageIn = inFd;
+        int stageOut = i < ncmds - 1 ? pipeFds[1] : outFd;
+        pid_t childPID;
+        cmds[i].path = findCommand(cmds[i].argv[0]);
+        // A built-in that is no program (export, jobs, ...) runs in a
+        // forked copy of the shell, its path left NULL for runChild
+        int builtin = cmds[i].path == NULL && isBuiltin(cmds[i].argv[0]);
+        // A stage with several output files writes to a pipe instead, which
+        // a relay process started ahead of it in the job copies to each
+        // file (so the stage stays the job's last process if it was)
+        command_t stage = cmds[i];
+        int relayFd = -1;
+        if ((stage.path != NULL || builtin) && stage.ntees > 0) {
+            pid_t relayPID = startRelay(&stage, pgid, background, &relayFd);
+            if (relayPID != -1) {
+                addJobProcess(jid, relayPID, &pgid, command);
+                stage.output = NULL;
+                stage.ntees = 0;
+                stageOut = relayFd;
+            }
+        }
+        // A stage with assignments of its own gets an environment of its own
+        launchEnv = stage.nassigns > 0 ? commandEnv(&stage) : envp;
+        if (stage.path == NULL && !builtin) {
+            fprintf(stderr, "%s: command not found\n", cmds[i].argv[0]);
+            childPID = -1;
+        } else if (stage.ntees > 0 ||
+                   redirectCoprocs(&stage, &stageIn, &stageOut) == -1) {
+            // One of its files could not be opened, or a coprocess is gone
+            childPID = -1;
+        } else if (spawnBackend == SPAWN_POSIX && !builtin &&
+                   !hasPolicy(&launchPolicy)) {
+            traceEvent('B', TRACE_SPAWN, jid);
+            childPID =
+                spawnChild(&stage, pgid, stageIn, stageOut, background);
+            traceEvent('E', TRACE_SPAWN, childPID);
+        } else {
+            // The fork server clones the child for us while it runs
+            childPID = spawnBackend == SPAWN_SERVER && !builtin
+                           ? serverSpawn(&stage, pgid, stageIn, stageOut,
+                                         background)
+                           : -2;
+            if (childPID == -2) {
+                traceEvent('B', TRACE_FORK, jid);
+                childPID = fork();
+                if (childPID == -1) {
+                    perror("fork");
+                    cleanup_job_list(jobList);
+                    exit(1);
+                }
+                if (childPID == 0) {
+                    runChild(&stage, pgid, stageIn, stageOut, background);
+                }
+                traceEvent('E', TRACE_FORK, childPID);
+            }
+            // Also sets the child's process group from the parent so that
+            // it is in place before we signal or wait on the group; EACCES
+            // means the child already did so and called execve
+            if (childPID != -1 &&
+                setpgid(childPID, pgid == 0 ? childPID : pgid) == -1 &&
+                errno != EACCES) {
+                perror("setpgid");
+                cleanup_job_list(jobList);
+                exit(1);
+            }
+        }
+        if (launchEnv != envp) {
+            free(launchEnv);
+        }
+        // A stage that could not be started is left out of the job while
+        // the rest of the pipeline still runs
+        if (childPID != -1) {
+            addJobProcess(jid, childPID, &pgid, command);
+        }
+        // The parent keeps only the read end the next stage needs, closing
+        // the relay's pipe and copies of coprocess pipes along with the rest
+        if (inFd != -1 && inFd != firstIn) {
+            close(inFd);
+        }
+        if (stageIn != inFd) {
+            close(stageIn);
+        }
+        if (stageOut != -1 && stageOut != outFd && stageOut != pipeFds[1]) {
+            close(stageOut);
+        }
+        if (pipeFds[1] != -1) {
+            close(pipeFds[1]);
+        }
+        inFd = pipeFds[0];
+    }
+    free(command);
+    traceEvent('E', TRACE_START, jid);
+    return pgid;
+}
+
+int replaceFd(int fd, int newFd, int *saved);
+void restoreFd(int fd, int saved);
+
+// Buffer gathering the output of the command substitution (or the stages
+// before parallel) running, the memory file the shell's stdout is moved to
+// meanwhile, which built-ins write to without a pipe that would fill up,
+// and the stdout it replaced
+word_buf_t *captureBuf = NULL;
+int captureFd = -1;
+int captureSaved = -1;
+
+/*  Description:
+        Reads a descriptor to its end into a word buffer, making room for
+        CAPTURE_CHUNK bytes before each read
+    Arguments:
+        buf: the buffer
+        fd: the descriptor
+    Returns:
+        0 at the end, 1 if reading would block */
+int readInto(word_buf_t *buf, int fd) {
+    while (1) {
+        reserveBytes(buf, CAPTURE_CHUNK);
+        ssize_t count = read(fd, buf->data + buf->len, buf->size - buf->len);
+        if (count > 0) {
+            buf->len += (size_t)count;
+        } else if (count == -1 && errno == EINTR) {
+            continue;
+        } else {
+            return count == -1 && errno == EAGAIN;
+        }
+    }
+}
+
+/*  Description:
+        Moves what the shell and its built-ins wrote to the memory file of a
+        command substitution into its buffer, emptying the file */
+void collectCapture() {
+    if (fflush(stdout) < 0) {
+        clearerr(stdout);
+    }
+    lseek(captureFd, 0, SEEK_SET);
+    readInto(captureBuf, captureFd);
+    if (ftruncate(captureFd, 0) == -1) {
+        perror("ftruncate");
+    }
+    lseek(captureFd, 0, SEEK_SET);
+}
+
+/*  Description:
+        Reads the output of a job started by a command substitution from
+        its pipe until every process writing it is done with it, or one of
+        them stops (its output is then left unread)
+    Arguments:
+        fd: read end of the pipe, nonblocking; closed
+        pgid: the job's process group, 0 if it could not be started */
+void drainCapture(int fd, pid_t pgid) {
+    collectCapture();
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (readInto(captureBuf, fd) == 1) {
+        int ready = poll(&pfd, 1, CAPTURE_POLL_MS);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        siginfo_t info;
+        info.si_pid = 0;
+        if (ready == 0 &&
+            waitid(P_PGID, (id_t)pgid, &info,
+                   WSTOPPED | WNOHANG | WNOWAIT) == 0 &&
+            info.si_pid != 0) {
+            break;
+        }
+    }
+    close(fd);
+}
+
+/*  Description:
+        Waits for a foreground job started by a command substitution with
+        the shell's stdout put back meanwhile, so that a notice about the
+        job is not taken as its output
+    Arguments:
+        jid: job ID of the job
+    Returns:
+        as waitForeground */
+int waitCaptured(int jid) {
+    int saved = -1;
+    if (fflush(stdout) < 0) {
+        clearerr(stdout);
+    }
+    if (captureSaved != -1) {
+        replaceFd(1, fcntl(captureSaved, F_DUPFD_CLOEXEC, 10), &saved);
+    }
+    int status = waitForeground(jid);
+    if (captureSaved != -1) {
+        if (fflush(stdout) < 0) {
+            clearerr(stdout);
+        }
+        restoreFd(1, saved);
+    }
+    return status;
+}
+
+/* The capture a nested one replaces, put back once it ends */
+typedef struct capture {
+    word_buf_t *buf;
+    int fd;
+    int saved;
+} capture_t;
+
+/*  Description:
+        Starts gathering what the shell and the foreground jobs it starts
+        write to stdout, moving stdout to a memory file
+    Arguments:
+        out: the buffer the output is appended to
+        outer: set to the capture running, if any, for endCapture */
+void beginCapture(word_buf_t *out, capture_t *outer) {
+    *outer = (capture_t){captureBuf, captureFd, captureSaved};
+    if (fflush(stdout) < 0) {
+        clearerr(stdout);
+    }
+    captureFd = memfd_create("capture", MFD_CLOEXEC);
+    if (captureFd == -1 ||
+        replaceFd(1, fcntl(captureFd, F_DUPFD_CLOEXEC, 10), &captureSaved) ==
+            -1) {
+        perror("memfd_create");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    captureBuf = out;
+}
+
+/*  Description:
+        Ends the capture started by beginCapture, collecting the rest of the
+        output and putting stdout back
+    Arguments:
+        outer: the capture it replaced */
+void endCapture(const capture_t *outer) {
+    collectCapture();
+    restoreFd(1, captureSaved);
+    close(captureFd);
+    captureBuf = outer->buf;
+    captureFd = outer->fd;
+    captureSaved = outer->saved;
+}
+
+/*
+ * - Description:
+ *      Executes a pipeline of one or more commands as a job, waiting for it
+ * unless it runs in the background
+ * - Arguments:
+ *      cmds: the pipeline stages, in order
+ *      ncmds: the number of stages
+ *      background: boolean representing if the pipeline ended with &
+ * - Returns:
+ *      the exit status of a foreground pipeline, 0 for a background one, or
+ * 127 if no stage could be started
+ */
+int execute(command_t cmds[], int ncmds, int background) {
+    // Background jobs wait their turn behind those already queued
+    if (background && (queueCount > 0 || !admissionOpen())) {
+        queueJob(cmds, ncmds);
+        return 0;
+    }
+    if (background) {
+        clock_gettime(CLOCK_MONOTONIC, &lastAdmit);
+    }
+    // A foreground job in a command substitution writes to a pipe, read
+    // as it goes so that the job never waits for room in it
+    int pipeFds[2] = {-1, -1};
+    if (captureBuf != NULL && !background &&
+        pipe2(pipeFds, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("pipe2");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    // The job's end of the pipe blocks
+    if (pipeFds[1] != -1) {
+        fcntl(pipeFds[1], F_SETFL, 0);
+    }
+    pid_t pgid = startJob(cmds, ncmds, job, background, -1, pipeFds[1]);
+    if (pipeFds[1] != -1) {
+        close(pipeFds[1]);
+        drainCapture(pipeFds[0], pgid);
+    }
+    if (pgid == 0) {
+        // No stage of the pipeline could be started
+        return 127;
+    }
+    // Body of parent process:
+    // Increments jobID counter if background job was forked and prints
+    // jobID and process group ID of background job
+    if (background) {
+        if (printf("[%d] (%d)\n", job, pgid) < 0) {
+            fprintf(stderr, "Error: Could not print job and process id.\n");
+        }
+        job++;
+    } else {
+        /*  Waits for the whole pipeline to finish running before continuing
+            unless supplied the background argument as 1, in which case it
+            doesn't wait; the jobID is only used up if the job was
+            terminated or suspended by a signal */
+        int status =
+            captureBuf != NULL ? waitCaptured(job) : waitForeground(job);
+        if (WIFSIGNALED(status) || WIFSTOPPED(status)) {
+            job++;
+        }
+        return exitStatus(status);
+    }
+    return 0;
+}
+
+// Whether the prompt is on screen waiting for input, so that a job notice
+// printed meanwhile has to start on a new line, and whether a notice has
+// covered it up since, so that it is drawn again
+int promptShown = 0;
+int promptCovered = 0;
+
+/*  Description:
+        Prepares for printing a job notice, moving past the prompt if the
+        notice is printed while the shell waits for input */
+void beginNotice() {
+    if (promptShown) {
+        if (printf("\n") < 0) {
+            fprintf(stderr, "Error: Could not print job notice.\n");
+        }
+        promptShown = 0;
+        promptCovered = 1;
+    }
+}
+
+/*  Description:
+        Reports a status change of one process belonging to a background job
+        and updates jobList accordingly, printing a message once the whole
+        job has terminated, or was suspended or resumed
+    Arguments:
+        pid: the process whose status changed
+        status: the status returned by wait4 for that process
+        usage: its resource usage, added to the job's
+    Returns:
+        the wait status of the job if this terminated it, otherwise -1 */
+int reportStatus(pid_t pid, int status, const struct rusage *usage) {
+    int jid = get_job_jid(jobList, pid);
+    if (jid == -1) {
+        return -1;
+    }
+    pid_t jobPid = get_job_pid(jobList, jid);
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        // Waits for the rest of the job's processes before reporting
+        if (finish_job_process(jobList, pid, status, usage) > 0) {
+            return -1;
+        }
+        status = get_job_status(jobList, jid);
+        if (WIFEXITED(status)) {
+            int signalNum = WEXITSTATUS(status);
+            beginNotice();
+            if (printf("[%d] (%d) terminated with exit status %d\n", jid,
+                       jobPid, signalNum) < 0) {
+                fprintf(stderr,
+                        "Error: Could not print signal terminated "
+                        "process message.\n");
+                cleanup_job_list(jobList);
+                exit(1);
+            }
+        } else {
+            int signalNum = WTERMSIG(status);
+            beginNotice();
+            if (printf("[%d] (%d) terminated by signal %d\n", jid, jobPid,
+                       signalNum) < 0) {
+                fprintf(stderr,
+                        "Error: Could not print signal terminated "
+                        "process message.\n");
+                cleanup_job_list(jobList);
+                exit(1);
+            }
+        }
+        remove_job_jid(jobList, jid);
+        return status;
+    } else if (WIFSTOPPED(status)) {
+        // Every process of the job is stopped, only the first is reported
+        if (get_job_state(jobList, jid) == STOPPED) {
+            return -1;
+        }
+        int signalNum = WSTOPSIG(status);
+        beginNotice();
+        if (printf("[%d] (%d) suspended by signal %d\n", jid, jobPid,
+                   signalNum) < 0) {
+            fprintf(stderr,
+                    "Error: Could not print signal suspended "
+                    "process message.\n");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        update_job_jid(jobList, jid, STOPPED);
+    } else if (WIFCONTINUED(status)) {
+        if (get_job_state(jobList, jid) == RUNNING) {
+            return -1;
+        }
+        beginNotice();
+        if (printf("[%d] (%d) resumed\n", jid, jobPid) < 0) {
+            fprintf(stderr,
+                    "Error: Could not print process resumed "
+                    "message.\n");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        update_job_jid(jobList, jid, RUNNING);
+    }
+    return -1;
+}
+
+/*  Description:
+        Starts a queued job right away, whether or not it would be admitted
+    Arguments:
+        jid: job ID of the queued job
+        background: 0 to run it in the foreground and wait for it
+    Returns:
+        its exit status in the foreground, 0 in the background, 127 if no
+        stage could be started, 1 if the job is not queued */
+int runQueued(int jid, int background) {
+    size_t i = 0;
+    while (i < queueCount && jobQueue[i]->jid != jid) {
+        i++;
+    }
+    if (i == queueCount) {
+        return 1;
+    }
+    queued_job_t *entry = queueRemove(i);
+    remove_job_jid(jobList, jid);
+    clock_gettime(CLOCK_MONOTONIC, &lastAdmit);
+    launch_policy_t policy = launchPolicy;
+    launchPolicy = entry->policy;
+    pid_t pgid = startJob(entry->cmds, entry->ncmds, jid, background, -1, -1);
+    launchPolicy = policy;
+    free(entry);
+    if (pgid == 0) {
+        return 127;
+    }
+    if (!background) {
+        return exitStatus(waitForeground(jid));
+    }
+    if (printf("[%d] (%d)\n", jid, pgid) < 0) {
+        fprintf(stderr, "Error: Could not print job and process id.\n");
+    }
+    return 0;
+}
+
+/*  Description:
+        Starts queued jobs, best first, for as long as admissionOpen allows */
+void admitJobs() {
+    while (queueCount > 0 && admissionOpen()) {
+        beginNotice();
+        runQueued(jobQueue[0]->jid, 1);
+    }
+}
+
+/*  Description:
+        Reaps every child whose status changed since the last call and
+        reports it. Pending SIGCHLDs are drained from sigchldFd first, and
+        when there were none no wait4 call is made at all; otherwise
+        wait4(-1) is called until it has nothing more to report, so the
+        cost depends on the number of state changes, not on the number of
+        jobs */
+void reapChildren() {
+    struct signalfd_siginfo info[32];
+    int pending = 0;
+    ssize_t count;
+    while ((count = read(sigchldFd, info, sizeof(info))) > 0) {
+        pending = 1;
+    }
+    if (count == -1 && errno != EAGAIN) {
+        perror("read");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (!pending) {
+        return;
+    }
+    traceEvent('B', TRACE_REAP, 0);
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                        &usage)) > 0) {
+        traceEvent('i', TRACE_REAPED, pid);
+        // Prints out informative message if the job terminated or updates
+        // its status accordingly
+        reportStatus(pid, status, &usage);
+    }
+    if (pid == -1 && errno != ECHILD) {
+        perror("wait4");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    traceEvent('E', TRACE_REAP, 0);
+    // Jobs that finished may have made room for queued ones
+    admitJobs();
+}
+
+/* Buffered reader handing out stdin one complete line at a time */
+typedef struct line_reader {
+    char *buf;
+    size_t size;     // capacity of buf
+    size_t start;    // offset of the first byte not yet handed out
+    size_t end;      // offset past the last byte read
+    size_t scanned;  // offset up to which no newline was found
+    int eof;
+} line_reader_t;
+
+/*  Description:
+        Returns the next complete line held in the buffer, without reading.
+        At end of input a final line without a newline counts as complete.
+    Arguments:
+        reader: the reader to take the line from
+        len: set to the length of the line, without its newline
+    Returns:
+        the NUL terminated line, valid until the next call to readLine or
+        fillReader, or NULL if no complete line has been read yet */
+char *readLine(line_reader_t *reader, size_t *len) {
+    char *newline = memchr(reader->buf + reader->scanned, '\n',
+                           reader->end - reader->scanned);
+    if (newline == NULL && !(reader->eof && reader->end > reader->start)) {
+        reader->scanned = reader->end;
+        return NULL;
+    }
+    char *line = reader->buf + reader->start;
+    if (newline == NULL) {
+        // Last line of input without a trailing newline
+        newline = reader->buf + reader->end;
+    }
+    *len = (size_t)(newline - line);
+    *newline = '\0';
+    reader->start = reader->scanned = (size_t)(newline - reader->buf) +
+                                      (newline < reader->buf + reader->end);
+    return line;
+}
+
+/*  Description:
+        Reads as much input as is available in one read() call, so it only
+        blocks if nothing is. The partial line left at the end of the buffer
+        is moved to the front first, and the buffer doubles when a single
+        line fills it, so lines of any length are returned whole.
+    Arguments:
+        reader: the reader to fill; its eof is set at end of input. Exits
+        the shell if read fails */
+void fillReader(line_reader_t *reader) {
+    // Makes room behind the partial line before reading more
+    if (reader->start > 0) {
+        memmove(reader->buf, reader->buf + reader->start,
+                reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->scanned -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end + 1 >= reader->size) {
+        reader->size *= 2;
+        reader->buf = (char *)realloc(reader->buf, reader->size);
+        if (reader->buf == NULL) {
+            perror("realloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    // Keeps one byte free for the NUL of a final unterminated line
+    ssize_t count =
+        read(0, reader->buf + reader->end, reader->size - reader->end - 1);
+    if (count == -1) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return;
+        }
+        perror("read");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (count == 0) {
+        reader->eof = 1;
+    }
+    reader->end += (size_t)count;
+}
+
+/* One distinct input line, parsed once and kept for when it runs again */
+typedef struct parsed_line {
+    struct parsed_line *next;  // next entry of the same hash bucket
+    size_t hash;
+    size_t len;
+    char *text;      // the line as read, the cache key
+    char **argv;     // tokens, pointing into a private copy of the line
+    command_t *cmds;
+    redirect_t *redirects;
+    pipeline_t *pipelines;
+    int npipelines;
+    int keywords;  // one of its commands starts with a reserved word
+} parsed_line_t;
+
+// Cache of parsed lines keyed by their text, flushed once it holds
+// MAX_PARSED_LINES entries so long-running shells stay bounded
+#define MAX_PARSED_LINES 4096
+parsed_line_t **lineCache = NULL;
+size_t lineCacheCapacity = 0;
+size_t lineCacheCount = 0;
+// Lines being run; those parsed while one runs (by a command substitution
+// or source) do not flush the cache from under it
+int linesRunning = 0;
+// Time spent parsing lines and running them, reported by -t
+struct timespec parseTime = {0, 0};
+struct timespec executeTime = {0, 0};
+long linesRun = 0;
+long linesParsed = 0;
+
+/*  Description:
+        Adds the time elapsed since start to total
+    Arguments:
+        total: running total to add to
+        start: CLOCK_MONOTONIC time at which the measured step started */
+void addElapsed(struct timespec *total, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    total->tv_sec += now.tv_sec - start->tv_sec;
+    total->tv_nsec += now.tv_nsec - start->tv_nsec;
+    if (total->tv_nsec < 0) {
+        total->tv_nsec += 1000000000L;
+        total->tv_sec--;
+    } else if (total->tv_nsec >= 1000000000L) {
+        total->tv_nsec -= 1000000000L;
+        total->tv_sec++;
+    }
+}
+
+/* Description: frees every cached line */
+void flushLineCache() {
+    for (size_t i = 0; i < lineCacheCapacity; i++) {
+        parsed_line_t *entry = lineCache[i];
+        while (entry != NULL) {
+            parsed_line_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        lineCache[i] = NULL;
+    }
+    lineCacheCount = 0;
+}
+
+/*  Description:
+        Parses a line into an entry of its own, a single allocation holding
+        the entry, its token, command and pipeline arrays, the text and the
+        copy of the line that parse tokenizes in place
+    Arguments:
+        text: the line, without its newline; it is not modified
+        len: length of the line
+    Returns:
+        the parsed line, to be freed, or NULL if it had a syntax error
+        (which parse reported) */
+parsed_line_t *parseText(const char *text, size_t len) {
+    // A line of len bytes holds at most len tokens, plus the NULL that ends
+    // the last stage
+    size_t slots = len + 1;
+    parsed_line_t *entry = (parsed_line_t *)malloc(
+        sizeof(parsed_line_t) +
+        slots * (sizeof(char *) + sizeof(command_t) + sizeof(redirect_t) +
+                 sizeof(pipeline_t)) +
+        2 * (len + 1));
+    if (entry == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    entry->argv = (char **)(entry + 1);
+    entry->cmds = (command_t *)(entry->argv + slots);
+    entry->redirects = (redirect_t *)(entry->cmds + slots);
+    entry->pipelines = (pipeline_t *)(entry->redirects + slots);
+    entry->text = (char *)(entry->pipelines + slots);
+    char *copy = entry->text + len + 1;
+    memcpy(entry->text, text, len);
+    entry->text[len] = '\0';
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    linesParsed++;
+    traceEvent('B', TRACE_PARSE, 0);
+    int parsed = parse(copy, entry->argv, entry->cmds, entry->redirects,
+                       entry->pipelines, &entry->npipelines);
+    traceEvent('E', TRACE_PARSE, 0);
+    if (parsed == -1) {
+        free(entry);
+        return NULL;
+    }
+    entry->keywords = 0;
+    for (int i = 0; i < entry->npipelines; i++) {
+        command_t *cmd = &entry->pipelines[i].cmds[0];
+        entry->keywords |= cmd->nassigns == 0 && cmd->argv[0] != NULL &&
+                           keywordOf(cmd->argv[0]) != KW_NONE;
+    }
+    entry->len = len;
+    return entry;
+}
+
+/*  Description:
+        Returns the parsed form of a line, parsing it only the first time
+        that text is seen
+    Arguments:
+        text: the line, without its newline; it is not modified
+        len: length of the line
+    Returns:
+        the parsed line, or NULL if it had a syntax error (which parse
+        reported) */
+parsed_line_t *parseLine(const char *text, size_t len) {
+    size_t hash = 14695981039346656037UL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 1099511628211UL;
+    }
+    if (lineCacheCapacity == 0) {
+        lineCacheCapacity = MAX_PARSED_LINES;
+        lineCache = (parsed_line_t **)calloc(lineCacheCapacity,
+                                             sizeof(parsed_line_t *));
+    }
+    size_t bucket = hash & (lineCacheCapacity - 1);
+    for (parsed_line_t *entry = lineCache[bucket]; entry != NULL;
+         entry = entry->next) {
+        if (entry->hash == hash && entry->len == len &&
+            memcmp(entry->text, text, len) == 0) {
+            return entry;
+        }
+    }
+    parsed_line_t *entry = parseText(text, len);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (lineCacheCount >= MAX_PARSED_LINES && linesRunning == 0) {
+        flushLineCache();
+    }
+    entry->hash = hash;
+    entry->next = lineCache[bucket];
+    lineCache[bucket] = entry;
+    lineCacheCount++;
+    return entry;
+}
+
+/*  Description:
+        Ignores the job control signals in the shell itself */
+void ignoreSignals() {
+    if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (signal(SIGTSTP, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (signal(SIGQUIT, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (signal(SIGTTOU, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+}
+
+void runScript(const char *file);
+
+/*  Description:
+        Function for running the lines of a script file in this shell
+    Arguments:
+        tokens: array of strings representing source command and file
+    Returns:
+        the status of the script's last command, 1 on error */
+int sourceFile(char *tokens[]) {
+    /* Checks for invalid number of arguments */
+    if (tokens[1] == NULL || tokens[2] != NULL) {
+        fprintf(stderr, "source: syntax error\n");
+        return 1;
+    }
+    runScript(tokens[1]);
+    return lastStatus;
+}
+
+/*  Description:
+        Function for printing its arguments separated by blanks
+    Arguments:
+        tokens: array of strings representing echo command, optionally -n to
+        leave out the trailing newline, and the words to print
+    Returns:
+        0 on success, 1 on error */
+int echoArgs(char *tokens[]) {
+    int i = 1;
+    int newline = 1;
+    if (tokens[1] != NULL && !strcmp(tokens[1], "-n")) {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; tokens[i] != NULL; i++) {
+        if (printf("%s%s", i > first ? " " : "", tokens[i]) < 0) {
+            fprintf(stderr, "Error: Could not print echo arguments.\n");
+            return 1;
+        }
+    }
+    if (newline && printf("\n") < 0) {
+        fprintf(stderr, "Error: Could not print echo arguments.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/*  Description:
+        Prints the backslash escape that starts at s, as understood by printf
+        formats and its %b conversion
+    Arguments:
+        s: the characters following the backslash
+        stop: set to 1 when the escape is \c, which ends all output
+    Returns:
+        a pointer past the escape, or NULL if it could not be printed */
+const char *printEscape(const char *s, int *stop) {
+    int c = *s++;
+    switch (c) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+        case 'c': *stop = 1; return s;
+        case '\0': c = '\\'; s--; break;
+        default:
+            // \NNN (and \0NNN) is a character given in octal
+            if (c >= '0' && c <= '7') {
+                int digits = c == '0' ? 3 : 2;
+                c -= '0';
+                for (; digits > 0 && *s >= '0' && *s <= '7'; digits--) {
+                    c = c * 8 + (*s++ - '0');
+                }
+            } else if (c != '\\' && c != '"' && c != '\'') {
+                // Unknown escapes are printed as they are
+                if (putchar('\\') == EOF) {
+                    return NULL;
+                }
+            }
+    }
+    return putchar(c) == EOF ? NULL : s;
+}
+
+/*  Description:
+        Converts an argument of a numeric printf conversion, where a leading
+        quote stands for the code of the character after it
+    Arguments:
+        arg: the argument
+        ok: cleared if arg is not a number
+    Returns:
+        the number */
+long long printfNumber(const char *arg, int *ok) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    long long n = strtoll(arg, &end, 0);
+    if (end == arg || *end != '\0' || errno != 0) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *ok = 0;
+    }
+    return n;
+}
+
+/*  Description:
+        Converts an argument of a floating point printf conversion
+    Arguments:
+        arg: the argument
+        ok: cleared if arg is not a number
+    Returns:
+        the number */
+double printfDouble(const char *arg, int *ok) {
+    char *end;
+    errno = 0;
+    double x = strtod(arg, &end);
+    if (end == arg || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        *ok = 0;
+    }
+    return x;
+}
+
+/*  Description:
+        Function for printing arguments according to a format, which is
+        reused until every argument has been consumed
+    Arguments:
+        tokens: array of strings representing printf command, the format and
+        its arguments
+    Returns:
+        0 on success, 1 on error */
+int printFormat(char *tokens[]) {
+    /* Checks for invalid number of arguments */
+    if (tokens[1] == NULL) {
+        fprintf(stderr, "printf: syntax error\n");
+        return 1;
+    }
+    char **args = &tokens[2];
+    int ok = 1;
+    int stop = 0;
+    do {
+        char **start = args;
+        for (const char *f = tokens[1]; *f != '\0' && !stop; f++) {
+            if (*f == '\\') {
+                f = printEscape(f + 1, &stop);
+                if (f == NULL) {
+                    fprintf(stderr, "Error: Could not print format.\n");
+                    return 1;
+                }
+                f--;
+                continue;
+            }
+            if (*f != '%' || f[1] == '%') {
+                f += *f == '%';
+                if (putchar(*f) == EOF) {
+                    fprintf(stderr, "Error: Could not print format.\n");
+                    return 1;
+                }
+                continue;
+            }
+            // Copies the flags, width and precision of the conversion, taking
+            // a * from the arguments, and leaves room for an ll modifier
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = *f++;
+            while (*f != '\0' && strchr("-+ #0123456789.*", *f) != NULL &&
+                   n < sizeof(spec) - 24) {
+                if (*f == '*') {
+                    n += sprintf(spec + n, "%d",
+                                 (int)printfNumber(*args ? *args++ : "0", &ok));
+                } else {
+                    spec[n++] = *f;
+                }
+                f++;
+            }
+            const char *arg = *args != NULL ? *args++ : NULL;
+            int printed;
+            switch (*f) {
+                case 'd':
+                case 'i':
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printed = printf(spec, arg ? printfNumber(arg, &ok) : 0LL);
+                    break;
+                case 'o':
+                case 'u':
+                case 'x':
+                case 'X':
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printed =
+                        printf(spec, (unsigned long long)(
+                                         arg ? printfNumber(arg, &ok) : 0));
+                    break;
+                case 'e':
+                case 'E':
+                case 'f':
+                case 'F':
+                case 'g':
+                case 'G':
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printed = printf(spec, arg ? printfDouble(arg, &ok) : 0.0);
+                    break;
+                case 'c':
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printed = printf(spec, arg ? arg[0] : '\0');
+                    break;
+                case 's':
+                    spec[n++] = *f;
+                    spec[n] = '\0';
+                    printed = printf(spec, arg ? arg : "");
+                    break;
+                case 'b':
+                    // The argument's own escapes are expanded
+                    printed = 0;
+                    for (const char *s = arg ? arg : ""; *s != '\0' && !stop;
+                         s++) {
+                        if (*s != '\\') {
+                            printed = putchar(*s) == EOF ? -1 : 0;
+                        } else if ((s = printEscape(s + 1, &stop)) == NULL) {
+                            printed = -1;
+                        } else {
+                            s--;
+                        }
+                        if (printed < 0) {
+                            break;
+                        }
+                    }
+                    break;
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid conversion\n", *f);
+                    return 1;
+            }
+            if (printed < 0) {
+                fprintf(stderr, "Error: Could not print format.\n");
+                return 1;
+            }
+        }
+        // A format without conversions is only printed once
+        if (args == start) {
+            break;
+        }
+    } while (*args != NULL && !stop);
+    return !ok;
+}
+
+/*  Description:
+        Function for doing nothing successfully
+    Arguments:
+        tokens: array of strings representing true command, ignored
+    Returns:
+        0 */
+int trueCommand(char *tokens[]) {
+    (void)tokens;
+    return 0;
+}
+
+/*  Description:
+        Function for doing nothing unsuccessfully
+    Arguments:
+        tokens: array of strings representing false command, ignored
+    Returns:
+        1 */
+int falseCommand(char *tokens[]) {
+    (void)tokens;
+    return 1;
+}
+
+int testArgs(char *args[], int n);
+
+/*  Description:
+        Tells how many arguments the primary at the start of a longer test
+        expression takes: a binary comparison, a unary operator and its
+        operand, or a lone string
+    Arguments:
+        args: the arguments left
+        n: their number, at least 1
+    Returns:
+        3, 2 or 1 */
+int primaryLength(char *args[], int n) {
+    static const char *binaryOps[] = {"=",   "==",  "!=",  "-eq", "-ne",
+                                      "-lt", "-le", "-gt", "-ge"};
+    for (size_t i = 0; n >= 3 && i < sizeof(binaryOps) / sizeof(char *);
+         i++) {
+        if (!strcmp(args[1], binaryOps[i])) {
+            return 3;
+        }
+    }
+    if (n >= 2 && args[0][0] == '-' && args[0][1] != '\0' &&
+        args[0][2] == '\0' && strchr("nzefdpSshLrwxt", args[0][1]) != NULL) {
+        return 2;
+    }
+    return 1;
+}
+
+/*  Description:
+        Evaluates a test expression longer than the forms POSIX gives rules
+        for: primaries, each possibly negated with !, joined by -a and -o,
+        -a binding tighter. Parentheses are not supported.
+    Arguments:
+        args: the arguments
+        n: the number of arguments
+    Returns:
+        0 if the expression is true, 1 if it is false, 2 on error */
+int testJoined(char *args[], int n) {
+    int any = 0;  // whether an -o alternative before this one was true
+    int all = 1;  // whether the primaries joined by -a so far were true
+    for (int i = 0;; i++) {
+        int negated = 0;
+        while (i < n && !strcmp(args[i], "!")) {
+            negated = !negated;
+            i++;
+        }
+        if (i == n) {
+            fprintf(stderr, "test: argument expected\n");
+            return 2;
+        }
+        int len = primaryLength(args + i, n - i);
+        int status = testArgs(args + i, len);
+        if (status == 2) {
+            return 2;
+        }
+        all &= (status == 0) != negated;
+        i += len;
+        if (i == n) {
+            break;
+        }
+        if (!strcmp(args[i], "-o")) {
+            any |= all;
+            all = 1;
+        } else if (strcmp(args[i], "-a")) {
+            fprintf(stderr, "test: %s: -a or -o expected\n", args[i]);
+            return 2;
+        }
+    }
+    return !(any | all);
+}
+
+/*  Description:
+        Evaluates a test expression of up to four arguments, following the
+        rules POSIX gives for each argument count, and longer ones joined
+        with -a and -o
+    Arguments:
+        args: the arguments
+        n: the number of arguments
+    Returns:
+        0 if the expression is true, 1 if it is false, 2 on error */
+int testArgs(char *args[], int n) {
+    struct stat st;
+    if (n == 0) {
+        return 1;
+    }
+    if (n == 1) {
+        return args[0][0] == '\0';
+    }
+    if (n == 2 && !strcmp(args[0], "!")) {
+        return !testArgs(args + 1, 1);
+    }
+    if (n == 2) {
+        const char *op = args[0];
+        const char *arg = args[1];
+        if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+            fprintf(stderr, "test: %s: unary operator expected\n", op);
+            return 2;
+        }
+        switch (op[1]) {
+            case 'n': return arg[0] == '\0';
+            case 'z': return arg[0] != '\0';
+            case 'e': return stat(arg, &st) == -1;
+            case 'f': return stat(arg, &st) == -1 || !S_ISREG(st.st_mode);
+            case 'd': return stat(arg, &st) == -1 || !S_ISDIR(st.st_mode);
+            case 'p': return stat(arg, &st) == -1 || !S_ISFIFO(st.st_mode);
+            case 'S': return stat(arg, &st) == -1 || !S_ISSOCK(st.st_mode);
+            case 's': return stat(arg, &st) == -1 || st.st_size == 0;
+            case 'h':
+            case 'L': return lstat(arg, &st) == -1 || !S_ISLNK(st.st_mode);
+            case 'r': return access(arg, R_OK) == -1;
+            case 'w': return access(arg, W_OK) == -1;
+            case 'x': return access(arg, X_OK) == -1;
+            case 't': return !isatty(atoi(arg));
+            default:
+                fprintf(stderr, "test: %s: unary operator expected\n", op);
+                return 2;
+        }
+    }
+    if (n == 3) {
+        const char *a = args[0];
+        const char *op = args[1];
+        const char *b = args[2];
+        if (!strcmp(op, "=") || !strcmp(op, "==")) {
+            return strcmp(a, b) != 0;
+        } else if (!strcmp(op, "!=")) {
+            return strcmp(a, b) == 0;
+        } else if (!strcmp(op, "-a")) {
+            return a[0] == '\0' || b[0] == '\0';
+        } else if (!strcmp(op, "-o")) {
+            return a[0] == '\0' && b[0] == '\0';
+        }
+        static const char *intOps[] = {"-eq", "-ne", "-lt",
+                                       "-le", "-gt", "-ge"};
+        for (int i = 0; i < 6; i++) {
+            if (strcmp(op, intOps[i])) {
+                continue;
+            }
+            char *endA;
+            char *endB;
+            long long x = strtoll(a, &endA, 10);
+            long long y = strtoll(b, &endB, 10);
+            if (endA == a || *endA != '\0' || endB == b || *endB != '\0') {
+                fprintf(stderr, "test: integer expression expected\n");
+                return 2;
+            }
+            int result[] = {x == y, x != y, x < y, x <= y, x > y, x >= y};
+            return !result[i];
+        }
+        if (!strcmp(a, "!")) {
+            return !testArgs(args + 1, 2);
+        }
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return 2;
+    }
+    if (n == 4 && !strcmp(args[0], "!")) {
+        int status = testArgs(args + 1, 3);
+        return status == 2 ? 2 : !status;
+    }
+    return testJoined(args, n);
+}
+
+/*  Description:
+        Function for evaluating a conditional expression, as test or [
+    Arguments:
+        tokens: array of strings representing test command and expression,
+        which must end with ] when called as [
+    Returns:
+        0 if the expression is true, 1 if it is false, 2 on error */
+int testExpression(char *tokens[]) {
+    int n = 0;
+    while (tokens[n + 1] != NULL) {
+        n++;
+    }
+    if (!strcmp(tokens[0], "[")) {
+        if (n == 0 || strcmp(tokens[n], "]")) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        n--;
+    }
+    return testArgs(&tokens[1], n);
+}
+
+/*  Description:
+        Function for printing the current working directory
+    Arguments:
+        tokens: array of strings representing pwd command
+    Returns:
+        0 on success, 1 on error */
+int printDir(char *tokens[]) {
+    /* Checks for invalid number of arguments */
+    if (tokens[1] != NULL) {
+        fprintf(stderr, "pwd: syntax error\n");
+        return 1;
+    }
+    char *dir = getcwd(NULL, 0);
+    if (dir == NULL) {
+        perror("getcwd");
+        return 1;
+    }
+    int status = 0;
+    if (printf("%s\n", dir) < 0) {
+        fprintf(stderr, "Error: Could not print working directory.\n");
+        status = 1;
+    }
+    free(dir);
+    return status;
+}
+
+/*  Description:
+        Copies everything that can be read from fd to stdout, letting the
+        kernel move the data with sendfile when fd allows it
+    Arguments:
+        fd: file descriptor to copy
+    Returns:
+        0 on success, -1 on error */
+int copyToStdout(int fd) {
+    ssize_t n;
+    while ((n = sendfile(1, fd, NULL, BUFSIZE)) > 0) {
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+        return -1;
+    }
+    // Not something sendfile can read from, such as a terminal or a pipe
+    char buf[BUFSIZE];
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = write(1, buf + done, n - done);
+            if (written == -1) {
+                return -1;
+            }
+            done += written;
+        }
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/*  Description:
+        Function for copying files, or stdin, to stdout
+    Arguments:
+        tokens: array of strings representing cat command and files
+    Returns:
+        0 on success, 1 if a file could not be copied, or RUN_EXTERNAL if cat
+        was given options or would read from the terminal */
+int catFiles(char *tokens[]) {
+    for (int i = 1; tokens[i] != NULL; i++) {
+        if (tokens[i][0] == '-' && tokens[i][1] != '\0') {
+            return RUN_EXTERNAL;
+        }
+    }
+    // Reading the terminal here could not be interrupted, since the shell
+    // ignores SIGINT
+    if (tokens[1] == NULL && isatty(0)) {
+        return RUN_EXTERNAL;
+    }
+    // Our own output has to come before the copied data
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 1; i == 1 || tokens[i] != NULL; i++) {
+        const char *file = tokens[i] != NULL ? tokens[i] : "-";
+        int fd = strcmp(file, "-") ? open(file, O_RDONLY | O_CLOEXEC) : 0;
+        if (fd == -1) {
+            fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (copyToStdout(fd) == -1) {
+            fprintf(stderr, "cat: %s: %s\n", file, strerror(errno));
+            status = 1;
+        }
+        if (fd != 0) {
+            close(fd);
+        }
+        if (tokens[i] == NULL) {
+            break;
+        }
+    }
+    return status;
+}
+
+/*  Description:
+        Lets a built-in that blocks be ended with Ctrl-C although the shell
+        ignores SIGINT: the signal is blocked and set back to its default
+        action, so that it stays pending until the built-in waits for it
+        with sigtimedwait or a signalfd
+    Arguments:
+        intMask: set to a signal set holding SIGINT
+        oldMask: set to the signal mask to put back with releaseInterrupt */
+void catchInterrupt(sigset_t *intMask, sigset_t *oldMask) {
+    sigemptyset(intMask);
+    sigaddset(intMask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, intMask, oldMask) == -1 ||
+        signal(SIGINT, SIG_DFL) == SIG_ERR) {
+        perror("sigprocmask");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+}
+
+/*  Description:
+        Goes back to ignoring SIGINT after catchInterrupt, which discards a
+        SIGINT that arrived since, unless SIGINT was already caught (by a
+        compound command running the built-in), which keeps it pending
+    Arguments:
+        oldMask: the signal mask saved by catchInterrupt */
+void releaseInterrupt(const sigset_t *oldMask) {
+    if ((!sigismember(oldMask, SIGINT) &&
+         signal(SIGINT, SIG_IGN) == SIG_ERR) ||
+        sigprocmask(SIG_SETMASK, oldMask, NULL) == -1) {
+        perror("sigprocmask");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+}
+
+/*  Description:
+        Function for waiting a number of seconds, given as decimal numbers
+        optionally followed by s, m, h or d, which are added up, or until
+        Ctrl-C is pressed
+    Arguments:
+        tokens: array of strings representing sleep command and durations
+    Returns:
+        0 on success, 1 on error, 130 if interrupted, or RUN_EXTERNAL under
+        job control, where only a process of its own can be suspended */
+int sleepFor(char *tokens[]) {
+    if (terminal) {
+        return RUN_EXTERNAL;
+    }
+    /* Checks for invalid number of arguments */
+    if (tokens[1] == NULL) {
+        fprintf(stderr, "sleep: syntax error\n");
+        return 1;
+    }
+    double seconds = 0;
+    for (int i = 1; tokens[i] != NULL; i++) {
+        char *end;
+        double n = strtod(tokens[i], &end);
+        const char *units = "smhd";
+        static const double scale[] = {1, 60, 3600, 86400};
+        const char *unit = *end != '\0' ? strchr(units, *end) : units;
+        if (end == tokens[i] || !(n >= 0) || unit == NULL ||
+            (*end != '\0' && end[1] != '\0')) {
+            fprintf(stderr, "sleep: invalid time interval %s\n", tokens[i]);
+            return 1;
+        }
+        seconds += n * scale[unit - units];
+    }
+    // Keeps sleep inf from overflowing the deadline
+    if (seconds > 1e12) {
+        seconds = 1e12;
+    }
+    sigset_t intMask;
+    sigset_t oldMask;
+    catchInterrupt(&intMask, &oldMask);
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)seconds;
+    deadline.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    int status = 0;
+    for (;;) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec left = {deadline.tv_sec - now.tv_sec,
+                                deadline.tv_nsec - now.tv_nsec};
+        if (left.tv_nsec < 0) {
+            left.tv_sec--;
+            left.tv_nsec += 1000000000;
+        }
+        if (left.tv_sec < 0) {
+            break;
+        }
+        int sig = sigtimedwait(&intMask, NULL, &left);
+        if (sig == SIGINT) {
+            status = 128 + SIGINT;
+            break;
+        } else if (sig == -1 && errno == EAGAIN) {
+            break;
+        } else if (sig == -1 && errno != EINTR) {
+            perror("sigtimedwait");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    releaseInterrupt(&oldMask);
+    return status;
+}
+
+/*  Description:
+        Opens a pidfd on each live process of a running job and adds it to
+        an epoll instance, growing the arrays the processes are kept in
+    Arguments:
+        epollFd: the epoll instance, each pidfd being added with its index
+        jid: job ID of the job
+        pids: the watched processes, grown as needed
+        pidFds: their pidfds, -1 once closed, grown as needed
+        nprocs: the number of watched processes
+        capacity: the size of pids and pidFds */
+void watchJob(int epollFd, int jid, pid_t **pids, int **pidFds,
+              size_t *nprocs, size_t *capacity) {
+    int count = get_job_pids(jobList, jid, NULL, 0);
+    if (*nprocs + count > *capacity) {
+        while (*nprocs + count > *capacity) {
+            *capacity *= 2;
+        }
+        *pids = (pid_t *)realloc(*pids, *capacity * sizeof(pid_t));
+        *pidFds = (int *)realloc(*pidFds, *capacity * sizeof(int));
+    }
+    get_job_pids(jobList, jid, *pids + *nprocs, count);
+    for (int k = 0; k < count; k++, (*nprocs)++) {
+        int fd = (int)syscall(SYS_pidfd_open, (*pids)[*nprocs], 0);
+        (*pidFds)[*nprocs] = fd;
+        struct epoll_event event = {.events = EPOLLIN,
+                                    .data = {.u32 = (uint32_t)*nprocs}};
+        if (fd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror(fd == -1 ? "pidfd_open" : "epoll_ctl");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+}
+
+/*  Description:
+        Reports a child reaped by wait, closing its pidfd if it is one of
+        the watched processes
+    Arguments:
+        pid: PID of the child
+        status: its wait status
+        usage: its resource usage
+        pids: the watched processes
+        pidFds: their pidfds, -1 once closed
+        nprocs: the number of watched processes
+    Returns:
+        the wait status of its job if the child is watched and was the last
+        of its job, -1 otherwise */
+int reportWaited(pid_t pid, int status, const struct rusage *usage,
+                 pid_t *pids, int *pidFds, size_t nprocs) {
+    traceEvent('i', TRACE_REAPED, pid);
+    size_t k = 0;
+    while (k < nprocs && pids[k] != pid) {
+        k++;
+    }
+    if (k < nprocs && pidFds[k] != -1) {
+        close(pidFds[k]);
+        pidFds[k] = -1;
+    }
+    int jobStatus = reportStatus(pid, status, usage);
+    return k < nprocs ? jobStatus : -1;
+}
+
+/*  Description:
+        Function for waiting until background jobs terminate, reporting each
+        one and removing it from jobList. Every live process of the jobs
+        waited for is watched through a pidfd by one epoll instance and only
+        reaped once its pidfd says it has exited, so a wakeup costs a single
+        epoll_wait however many jobs there are. Queued jobs are watched once
+        admitted; while there are any, SIGCHLD is watched too so that other
+        jobs finishing can make room for them. Stopped jobs are not waited
+        for, and Ctrl-C ends the wait.
+    Arguments:
+        tokens: array of strings representing wait command, optionally -n to
+        return as soon as one of the jobs terminates and -t followed by a
+        timeout in milliseconds, then the jobs to wait for as %jid or PID,
+        all of them if none are given
+    Returns:
+        the status of the last job to terminate, 0 if there was none, 124 on
+        timeout, 130 if interrupted, 127 if a job does not exist or -n is
+        given no job, 1 on error */
+int waitJobs(char *tokens[]) {
+    int any = 0;
+    int timeout = -1;
+    int i = 1;
+    for (; tokens[i] != NULL && tokens[i][0] == '-'; i++) {
+        if (!strcmp(tokens[i], "-n")) {
+            any = 1;
+        } else if (!strcmp(tokens[i], "-t") && tokens[i + 1] != NULL) {
+            char *end;
+            long ms = strtol(tokens[++i], &end, 10);
+            if (end == tokens[i] || *end != '\0' || ms < 0 || ms > INT_MAX) {
+                fprintf(stderr, "wait: %s: invalid timeout\n", tokens[i]);
+                return 1;
+            }
+            timeout = (int)ms;
+        } else {
+            fprintf(stderr, "wait: syntax error\n");
+            return 1;
+        }
+    }
+    // Collects the jobs to wait for, every job by default
+    int status = 0;
+    int njobs = 0;
+    int *jids;
+    if (tokens[i] == NULL) {
+        while (get_next_jid(jobList) != -1) {
+            njobs++;
+        }
+        // Unlike waiting for all jobs, waiting for the next one needs one
+        if (any && njobs == 0) {
+            fprintf(stderr, "wait: no jobs to wait for\n");
+            return 127;
+        }
+        jids = (int *)malloc((njobs + 1) * sizeof(int));
+        for (int j = 0; j < njobs; j++) {
+            jids[j] = get_next_jid(jobList);
+        }
+        get_next_jid(jobList);
+    } else {
+        int nargs = 0;
+        while (tokens[i + nargs] != NULL) {
+            nargs++;
+        }
+        jids = (int *)malloc(nargs * sizeof(int));
+        for (; tokens[i] != NULL; i++) {
+            int jid = tokens[i][0] == '%'
+                          ? (get_job_pid(jobList, atoi(tokens[i] + 1)) != -1
+                                 ? atoi(tokens[i] + 1)
+                                 : -1)
+                          : get_job_jid(jobList, atoi(tokens[i]));
+            if (jid == -1) {
+                fprintf(stderr, "wait: %s: no such job\n", tokens[i]);
+                status = 127;
+            } else {
+                jids[njobs++] = jid;
+            }
+        }
+    }
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1) {
+        perror("epoll_create1");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    // Ctrl-C arrives through a signalfd watched alongside the pidfds
+    sigset_t intMask;
+    sigset_t oldMask;
+    catchInterrupt(&intMask, &oldMask);
+    int intFd = signalfd(-1, &intMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data = {.u32 = UINT32_MAX}};
+    if (intFd == -1 || epoll_ctl(epollFd, EPOLL_CTL_ADD, intFd, &event) == -1) {
+        perror(intFd == -1 ? "signalfd" : "epoll_ctl");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    size_t capacity = 16;
+    size_t nprocs = 0;
+    pid_t *pids = (pid_t *)malloc(capacity * sizeof(pid_t));
+    int *pidFds = (int *)malloc(capacity * sizeof(int));
+    int remaining = 0;
+    int queued = 1;
+    int watchingChld = 0;
+    for (;;) {
+        // Opens a pidfd on each live process of the jobs that are running,
+        // leaving queued ones (marked by a jid still in jids) for later
+        if (queued > 0) {
+            queued = 0;
+            for (int j = 0; j < njobs; j++) {
+                if (jids[j] == -1) {
+                    continue;
+                }
+                process_state_t state = get_job_state(jobList, jids[j]);
+                if (state == QUEUED) {
+                    queued++;
+                    continue;
+                }
+                if (state == RUNNING) {
+                    watchJob(epollFd, jids[j], &pids, &pidFds, &nprocs,
+                             &capacity);
+                    remaining++;
+                }
+                jids[j] = -1;
+            }
+        }
+        if (queued > 0 && !watchingChld) {
+            event.data.u32 = UINT32_MAX - 1;
+            if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sigchldFd, &event) == -1) {
+                perror("epoll_ctl");
+                cleanup_job_list(jobList);
+                exit(1);
+            }
+            watchingChld = 1;
+        }
+        if (remaining == 0 && queued == 0) {
+            break;
+        }
+        int left = -1;
+        if (timeout >= 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long ms = (deadline.tv_sec - now.tv_sec) * 1000LL +
+                           (deadline.tv_nsec - now.tv_nsec) / 1000000;
+            left = ms > 0 ? (int)ms : 0;
+        }
+        // The load average is checked again every second while it keeps
+        // queued jobs waiting
+        int recheck =
+            queued > 0 && loadLimit > 0 && (left == -1 || left > 1000);
+        struct epoll_event events[64];
+        int n = epoll_wait(epollFd, events, 64, recheck ? 1000 : left);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        if (n == 0 && !recheck) {
+            status = 124;
+            break;
+        }
+        int done = 0;
+        int interrupted = 0;
+        for (int j = 0; j < n; j++) {
+            uint32_t k = events[j].data.u32;
+            int procStatus;
+            struct rusage usage;
+            pid_t pid;
+            if (k == UINT32_MAX) {
+                interrupted = 1;
+                continue;
+            } else if (k == UINT32_MAX - 1) {
+                // Reaps every child, as reapChildren does
+                struct signalfd_siginfo info[32];
+                while (read(sigchldFd, info, sizeof(info)) > 0) {
+                }
+                while ((pid = wait4(-1, &procStatus,
+                                    WNOHANG | WUNTRACED | WCONTINUED,
+                                    &usage)) > 0) {
+                    int jobStatus = reportWaited(pid, procStatus, &usage, pids,
+                                                 pidFds, nprocs);
+                    if (jobStatus != -1) {
+                        status = exitStatus(jobStatus);
+                        remaining--;
+                        done = 1;
+                    }
+                }
+                continue;
+            }
+            if (pidFds[k] == -1 ||
+                wait4(pids[k], &procStatus, WNOHANG, &usage) != pids[k]) {
+                continue;
+            }
+            int jobStatus =
+                reportWaited(pids[k], procStatus, &usage, pids, pidFds, nprocs);
+            if (jobStatus != -1) {
+                status = exitStatus(jobStatus);
+                remaining--;
+                done = 1;
+            }
+        }
+        if (interrupted) {
+            status = 128 + SIGINT;
+            break;
+        }
+        if (any && done) {
+            break;
+        }
+        if (queued > 0) {
+            admitJobs();
+        }
+    }
+    for (size_t k = 0; k < nprocs; k++) {
+        if (pidFds[k] != -1) {
+            close(pidFds[k]);
+        }
+    }
+    free(jids);
+    free(pids);
+    free(pidFds);
+    close(intFd);
+    close(epollFd);
+    releaseInterrupt(&oldMask);
+    return status;
+}
+
+/* A command run by parallel, from the input line it comes from until its
+ * output has been printed */
+typedef struct parallel_task {
+    char *line;
+    int slot;     // index of the worker running it, its jid being job + slot
+    int outFd;    // read end of the pipe its stdout goes to, -1 after EOF
+    int running;  // whether its job has processes left to reap
+    int done;     // whether it has finished and its output is complete
+    int status;   // exit status
+    char *output;
+    size_t len;
+    size_t cap;
+} parallel_task_t;
+
+/*  Description:
+        Starts one parallel task as a background job, its stdout going to a
+        pipe the shell collects it from. The line is either a whole command
+        (a single pipeline) or, given a command prefix, its argument: it
+        replaces each {} in the words of the prefix (a{}b becoming a1b for
+        the line 1) or, if there is none, is appended to it.
+    Arguments:
+        task: the task to start
+        prefix: words to run with the line as argument, NULL if the line is
+        a command
+        jid: job ID to run it under
+    Returns:
+        0 if it started, otherwise its exit status (127 if no stage could be
+        started, 2 if the line is not a single pipeline or has no command) */
+int startTask(parallel_task_t *task, char *prefix[], int jid) {
+    int pipeFds[2];
+    if (pipe2(pipeFds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    size_t len = strlen(task->line);
+    size_t nprefix = 0;
+    while (prefix != NULL && prefix[nprefix] != NULL) {
+        nprefix++;
+    }
+    // Scratch space for parse, or for the prefix and the line
+    char *buf = (char *)malloc(len + 1);
+    char **argv = (char **)malloc((len + nprefix + 2) * sizeof(char *));
+    command_t *cmds = (command_t *)malloc((len + 1) * sizeof(command_t));
+    redirect_t *redirects =
+        (redirect_t *)malloc((len + 1) * sizeof(redirect_t));
+    pipeline_t *pipelines =
+        (pipeline_t *)malloc((len + 1) * sizeof(pipeline_t));
+    if (buf == NULL || argv == NULL || cmds == NULL || redirects == NULL ||
+        pipelines == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    memcpy(buf, task->line, len + 1);
+    int npipelines = 0;
+    int status = 0;
+    char *words = NULL;  // the words of the prefix with the line put in
+    if (prefix != NULL) {
+        size_t size = 0;
+        for (size_t i = 0; i < nprefix; i++) {
+            size += strlen(prefix[i]) + 1;
+            for (const char *c = strstr(prefix[i], "{}"); c != NULL;
+                 c = strstr(c + 2, "{}")) {
+                size += len;
+            }
+        }
+        words = (char *)malloc(size);
+        if (words == NULL) {
+            perror("malloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        char *next = words;
+        int replaced = 0;
+        for (size_t i = 0; i < nprefix; i++) {
+            argv[i] = next;
+            for (const char *c = prefix[i]; *c != '\0'; c++) {
+                if (c[0] == '{' && c[1] == '}') {
+                    memcpy(next, buf, len);
+                    next += len;
+                    c++;
+                    replaced = 1;
+                } else {
+                    *next++ = *c;
+                }
+            }
+            *next++ = '\0';
+        }
+        argv[nprefix] = replaced ? NULL : buf;
+        argv[nprefix + 1] = NULL;
+        cmds[0] = (command_t){.argv = argv};
+        pipelines[0] = (pipeline_t){cmds, 1, 1, TOK_SEMI};
+        npipelines = 1;
+    } else if (parse(buf, argv, cmds, redirects, pipelines, &npipelines) ==
+               -1) {
+        status = 2;
+    } else if (npipelines != 1 || pipelines[0].background) {
+        fprintf(stderr, "parallel: %s: not a single pipeline\n", task->line);
+        status = 2;
+    }
+    // A line with $ runs with its words expanded
+    expanded_t expanded = {{NULL, 0, 0, TOK_SEMI}, {NULL, 0, 0}, NULL};
+    if (status == 0) {
+        expanded.pl = pipelines[0];
+        if (needsExpansion(&pipelines[0]) &&
+            expandPipeline(&pipelines[0], &expanded) == -1) {
+            status = 2;
+        }
+    }
+    for (int i = 0; status == 0 && i < expanded.pl.ncmds; i++) {
+        if (expanded.pl.cmds[i].argv[0] == NULL) {
+            fprintf(stderr, "parallel: %s: no command\n", task->line);
+            status = 2;
+        }
+    }
+    if (status == 0 && startJob(expanded.pl.cmds, expanded.pl.ncmds, jid, 1,
+                                -1, pipeFds[1]) == 0) {
+        status = 127;
+    }
+    freeExpanded(&expanded);
+    free(words);
+    free(buf);
+    free(argv);
+    free(cmds);
+    free(redirects);
+    free(pipelines);
+    close(pipeFds[1]);
+    if (status != 0) {
+        close(pipeFds[0]);
+        task->outFd = -1;
+        return status;
+    }
+    task->outFd = pipeFds[0];
+    task->running = 1;
+    return 0;
+}
+
+/*  Description:
+        Prints the output collected from a finished parallel task and frees
+        it
+    Arguments:
+        task: the task */
+void printTask(parallel_task_t *task) {
+    if (task->len > 0 &&
+        fwrite(task->output, 1, task->len, stdout) != task->len) {
+        fprintf(stderr, "Error: Could not print parallel output.\n");
+    }
+    free(task->output);
+    task->output = NULL;
+}
+
+/*  Description:
+        Function for running a list of commands with at most N of them at a
+        time. Every command is a background job started through startJob
+        with its stdout going to a pipe, and one poll loop collects their
+        output, reaps them off sigchldFd (passing children that are not
+        among them on to reportStatus) and starts the next command as soon
+        as one finishes. Each command's output is printed in one piece once
+        it finishes, or in input order with -k, and a summary of the exit
+        statuses goes to stderr. Ctrl-C interrupts the running commands and
+        starts no more.
+    Arguments:
+        tokens: array of strings representing parallel command, optionally
+        -j followed by the number of commands to run at a time (default 4),
+        -k to keep the output in input order and -a followed by a file to
+        read the lines from instead of stdin, then optionally a command that
+        takes each line as an argument; without one, each line is a command
+    Returns:
+        the number of commands that failed, at most 101, 130 if interrupted,
+        1 on error */
+int runParallel(char *tokens[]) {
+    int workers = 4;
+    int ordered = 0;
+    const char *file = NULL;
+    int i = 1;
+    for (; tokens[i] != NULL && tokens[i][0] == '-'; i++) {
+        if (!strcmp(tokens[i], "-j") && tokens[i + 1] != NULL &&
+            atoi(tokens[i + 1]) > 0) {
+            workers = atoi(tokens[++i]);
+        } else if (!strcmp(tokens[i], "-k")) {
+            ordered = 1;
+        } else if (!strcmp(tokens[i], "-a") && tokens[i + 1] != NULL) {
+            file = tokens[++i];
+        } else {
+            fprintf(stderr, "parallel: syntax error\n");
+            return 1;
+        }
+    }
+    char **prefix = tokens[i] != NULL ? &tokens[i] : NULL;
+    // Reads all of the input, then splits it into non-empty lines
+    int fd = file != NULL ? open(file, O_RDONLY | O_CLOEXEC) : 0;
+    if (fd == -1) {
+        fprintf(stderr, "parallel: %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+    size_t size = BUFSIZE;
+    size_t end = 0;
+    char *input = (char *)malloc(size);
+    if (input == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    ssize_t count;
+    while ((count = read(fd, input + end, size - end - 1)) != 0) {
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+        end += (size_t)count;
+        if (end + 1 == size) {
+            size *= 2;
+            input = (char *)realloc(input, size);
+            if (input == NULL) {
+                perror("realloc");
+                cleanup_job_list(jobList);
+                exit(1);
+            }
+        }
+    }
+    if (fd != 0) {
+        close(fd);
+    }
+    input[end] = '\0';
+    int ntasks = 0;
+    for (size_t k = 0; k < end; k++) {
+        ntasks += input[k] == '\n';
+    }
+    parallel_task_t *tasks =
+        (parallel_task_t *)calloc(ntasks + 1, sizeof(parallel_task_t));
+    if (tasks == NULL) {
+        perror("calloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    ntasks = 0;
+    for (char *line = input; *line != '\0';) {
+        char *newline = strchr(line, '\n');
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+        if (*line != '\0') {
+            tasks[ntasks++].line = line;
+        }
+        line = newline != NULL ? newline + 1 : line + strlen(line);
+    }
+    // The task run by each worker, -1 when it is free
+    int *slots = (int *)malloc(workers * sizeof(int));
+    struct pollfd *fds =
+        (struct pollfd *)malloc((workers + 2) * sizeof(struct pollfd));
+    if (slots == NULL || fds == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    for (int w = 0; w < workers; w++) {
+        slots[w] = -1;
+    }
+    sigset_t intMask;
+    sigset_t oldMask;
+    catchInterrupt(&intMask, &oldMask);
+    int intFd = signalfd(-1, &intMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (intFd == -1) {
+        perror("signalfd");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    int next = 0;       // next task to start
+    int printed = 0;    // next task to print, with -k
+    int finished = 0;
+    int active = 0;
+    int interrupted = 0;
+    while (finished < next || (next < ntasks && !interrupted)) {
+        // Fills the free workers
+        for (int w = 0; w < workers && next < ntasks && !interrupted; w++) {
+            if (slots[w] != -1) {
+                continue;
+            }
+            parallel_task_t *task = &tasks[next];
+            task->slot = w;
+            task->status = startTask(task, prefix, job + w);
+            if (task->running) {
+                slots[w] = next;
+                active++;
+            } else {
+                task->done = 1;
+                finished++;
+            }
+            next++;
+        }
+        // Prints the output of finished tasks
+        if (ordered) {
+            while (printed < next && tasks[printed].done) {
+                printTask(&tasks[printed++]);
+            }
+        }
+        if (fflush(stdout) < 0) {
+            perror("fflush");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        if (active == 0) {
+            continue;
+        }
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){sigchldFd, POLLIN, 0};
+        fds[nfds++] = (struct pollfd){intFd, POLLIN, 0};
+        for (int w = 0; w < workers; w++) {
+            if (slots[w] != -1 && tasks[slots[w]].outFd != -1) {
+                fds[nfds++] = (struct pollfd){tasks[slots[w]].outFd, POLLIN, 0};
+            }
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        if (fds[1].revents & POLLIN) {
+            // Passes Ctrl-C on to the running commands
+            struct signalfd_siginfo info;
+            if (read(intFd, &info, sizeof(info)) > 0) {
+                interrupted = 1;
+                for (int w = 0; w < workers; w++) {
+                    if (slots[w] != -1 && tasks[slots[w]].running) {
+                        kill(-get_job_pid(jobList, job + w), SIGINT);
+                    }
+                }
+            }
+        }
+        // Collects output
+        for (int f = 2; f < nfds; f++) {
+            if (fds[f].revents == 0) {
+                continue;
+            }
+            parallel_task_t *task = NULL;
+            for (int w = 0; w < workers && task == NULL; w++) {
+                if (slots[w] != -1 && tasks[slots[w]].outFd == fds[f].fd) {
+                    task = &tasks[slots[w]];
+                }
+            }
+            if (task->cap - task->len < BUFSIZE / 4) {
+                task->cap = task->cap == 0 ? BUFSIZE / 2 : task->cap * 2;
+                task->output = (char *)realloc(task->output, task->cap);
+                if (task->output == NULL) {
+                    perror("realloc");
+                    cleanup_job_list(jobList);
+                    exit(1);
+                }
+            }
+            count = read(task->outFd, task->output + task->len,
+                         task->cap - task->len);
+            if (count > 0) {
+                task->len += (size_t)count;
+            } else if (count == 0 || errno != EINTR) {
+                close(task->outFd);
+                task->outFd = -1;
+            }
+        }
+        // Reaps, in the same loop as reapChildren, any child that changed
+        // state
+        if (fds[0].revents & POLLIN) {
+            struct signalfd_siginfo info[32];
+            while (read(sigchldFd, info, sizeof(info)) > 0) {
+            }
+            int status;
+            pid_t pid;
+            struct rusage usage;
+            while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED,
+                                &usage)) > 0) {
+                int w = get_job_jid(jobList, pid) - job;
+                if (w < 0 || w >= workers || slots[w] == -1) {
+                    reportStatus(pid, status, &usage);
+                    continue;
+                }
+                if ((!WIFEXITED(status) && !WIFSIGNALED(status)) ||
+                    finish_job_process(jobList, pid, status, &usage) > 0) {
+                    continue;
+                }
+                tasks[slots[w]].status =
+                    exitStatus(get_job_status(jobList, job + w));
+                tasks[slots[w]].running = 0;
+                remove_job_jid(jobList, job + w);
+            }
+        }
+        // Frees the workers whose task has finished and printed all it will
+        for (int w = 0; w < workers; w++) {
+            parallel_task_t *task = slots[w] != -1 ? &tasks[slots[w]] : NULL;
+            if (task == NULL || task->running || task->outFd != -1) {
+                continue;
+            }
+            task->done = 1;
+            if (!ordered) {
+                printTask(task);
+            }
+            slots[w] = -1;
+            active--;
+            finished++;
+        }
+    }
+    while (ordered && printed < next) {
+        printTask(&tasks[printed++]);
+    }
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    // Summarizes the exit statuses, naming the commands that failed
+    int failed = 0;
+    for (int t = 0; t < next; t++) {
+        if (tasks[t].status != 0) {
+            fprintf(stderr, "parallel: %s: exit status %d\n", tasks[t].line,
+                    tasks[t].status);
+            failed++;
+        }
+    }
+    fprintf(stderr, "parallel: %d of %d commands succeeded, %d failed",
+            next - failed, ntasks, failed);
+    if (next < ntasks) {
+        fprintf(stderr, ", %d not started", ntasks - next);
+    }
+    fprintf(stderr, "\n");
+    close(intFd);
+    releaseInterrupt(&oldMask);
+    free(fds);
+    free(slots);
+    free(tasks);
+    free(input);
+    if (interrupted) {
+        return 128 + SIGINT;
+    }
+    return failed > 101 ? 101 : failed;
+}
+
+/*  Description:
+        Function for the coproc built-in: lists the coprocesses, or with -c
+        closes a coprocess's input so that it sees end of file, or with -r
+        reads one line of its output and prints it, waiting for it until
+        Ctrl-C is pressed. The line is read a byte at a time, up to what the
+        pipe holds, so that nothing after it is lost to a later <&NAME.
+        Starting a coprocess, coproc NAME command, is handled by
+        coprocPipeline.
+    Arguments:
+        tokens: array of strings representing coproc command
+    Returns:
+        0 on success, 1 on error or at the end of the coprocess's output,
+        130 if interrupted */
+int coprocCommand(char *tokens[]) {
+    if (tokens[1] == NULL) {
+        for (int i = 0; i < COPROC_MAX; i++) {
+            coproc_t *cp = &coprocs[i];
+            if (cp->name[0] != '\0' &&
+                printf("[%d] %s%s%s\n", cp->jid, cp->name,
+                       get_job_state(jobList, cp->jid) == _STATE_NONE
+                           ? " (done)"
+                           : "",
+                       cp->inFd == -1 ? " (input closed)" : "") < 0) {
+                fprintf(stderr, "Error: Could not print coprocess.\n");
+            }
+        }
+        return 0;
+    }
+    if ((strcmp(tokens[1], "-c") && strcmp(tokens[1], "-r")) ||
+        tokens[2] == NULL || tokens[3] != NULL) {
+        fprintf(stderr, "coproc: syntax error\n");
+        return 1;
+    }
+    coproc_t *cp = findCoproc(tokens[2]);
+    if (cp == NULL) {
+        fprintf(stderr, "coproc: %s: no such coprocess\n", tokens[2]);
+        return 1;
+    }
+    if (tokens[1][1] == 'c') {
+        if (cp->inFd != -1) {
+            close(cp->inFd);
+            cp->inFd = -1;
+        }
+        return 0;
+    }
+    sigset_t intMask;
+    sigset_t oldMask;
+    catchInterrupt(&intMask, &oldMask);
+    int intFd = signalfd(-1, &intMask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (intFd == -1) {
+        perror("signalfd");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    struct pollfd fds[2] = {{cp->outFd, POLLIN, 0}, {intFd, POLLIN, 0}};
+    int status = -1;
+    size_t len = 0;
+    while (status == -1) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        if (fds[1].revents & POLLIN) {
+            status = 128 + SIGINT;
+            break;
+        }
+        // Reads at least one byte (or the end of file) and at most what
+        // the pipe holds, none of which blocks
+        int avail = 0;
+        ioctl(cp->outFd, FIONREAD, &avail);
+        for (int k = 0; k < (avail > 0 ? avail : 1) && status == -1; k++) {
+            char c;
+            ssize_t n = read(cp->outFd, &c, 1);
+            if (n == -1 && errno == EINTR) {
+                break;
+            }
+            if (n <= 0) {
+                status = len > 0 ? 0 : 1;
+            } else {
+                len++;
+                if (putchar(c) == EOF) {
+                    fprintf(stderr,
+                            "Error: Could not print coprocess output.\n");
+                }
+                status = c == '\n' ? 0 : -1;
+            }
+        }
+    }
+    close(intFd);
+    releaseInterrupt(&oldMask);
+    return status;
+}
+
+#ifdef BENCH
+// Samples of the cheaper bench cases each time this many operations
+#define BENCH_BATCH 1000
+// Job IDs and PIDs of the stand-in jobs bench adds, beyond any real ones
+// (PIDs never exceed 2^22)
+#define BENCH_JID 1000000000
+#define BENCH_PID 0x40000000
+// Bytes each sample of the fanout case writes to both files
+#define BENCH_FANOUT (1L << 30)
+// Files in the directory the glob case expands patterns in
+#define BENCH_GLOB_FILES 500000
+// Iterations of the loops the loop case runs
+#define BENCH_LOOP 1000000
+// Lines of input the reader case splits per sample
+#define BENCH_READER_LINES 100000
+int benchmark(char *tokens[]);
+#endif
+
+int timePipeline(pipeline_t *pl);
+int queuePipeline(pipeline_t *pl);
+int limitPipeline(pipeline_t *pl);
+int coprocPipeline(pipeline_t *pl);
+
+/* A built-in command. Utilities also exist as programs, so they are run as
+ * such when they have to be a job of their own, in the background. A prefix
+ * word (time, queue, limit, coproc NAME) is given the whole pipeline it
+ * starts instead, and returns RUN_EXTERNAL when what follows it is not one
+ * to run; run is then called if there is one. */
+typedef struct builtin {
+    const char *name;
+    int (*run)(char *tokens[]);
+    int utility;
+    int (*prefix)(pipeline_t *pl);
+} builtin_t;
+
+/* Built-ins are found through a perfect hash of a name's length, first two
+ * and last characters, computed at compile time for the slots of the table
+ * below. To add one, give it a slot with BUILTIN_SLOT; if two names share a
+ * slot, the compiler warns about the initialized field being overwritten
+ * (-Woverride-init, part of -Wextra), and the multipliers need changing. */
+#define BUILTIN_SLOTS 128
+#define BUILTIN_SLOT(len, c0, c1, last)                                   \
+    (((len) + (unsigned char)(c0) * 22 + (unsigned char)(c1) * 5 +        \
+      (unsigned char)(last) * 13) & (BUILTIN_SLOTS - 1))
+static const builtin_t builtins[BUILTIN_SLOTS] = {
+    [BUILTIN_SLOT(2, 'c', 'd', 'd')] = {"cd", changeDir, 0, NULL},
+    [BUILTIN_SLOT(2, 'l', 'n', 'n')] = {"ln", addLink, 0, NULL},
+    [BUILTIN_SLOT(2, 'r', 'm', 'm')] = {"rm", removeLink, 0, NULL},
+    [BUILTIN_SLOT(4, 'e', 'x', 't')] = {"exit", exitHelper, 0, NULL},
+    [BUILTIN_SLOT(4, 'j', 'o', 's')] = {"jobs", printJobs, 0, NULL},
+    [BUILTIN_SLOT(2, 'f', 'g', 'g')] = {"fg", fg, 0, NULL},
+    [BUILTIN_SLOT(2, 'b', 'g', 'g')] = {"bg", bg, 0, NULL},
+    [BUILTIN_SLOT(5, 's', 'p', 'n')] = {"spawn", setSpawn, 0, NULL},
+    [BUILTIN_SLOT(4, 'h', 'a', 'h')] = {"hash", hashCommand, 0, NULL},
+    [BUILTIN_SLOT(6, 's', 'o', 'e')] = {"source", sourceFile, 0, NULL},
+    [BUILTIN_SLOT(4, 'w', 'a', 't')] = {"wait", waitJobs, 0, NULL},
+    [BUILTIN_SLOT(8, 'p', 'a', 'l')] = {"parallel", runParallel, 0, NULL},
+#ifdef BENCH
+    [BUILTIN_SLOT(5, 'b', 'e', 'h')] = {"bench", benchmark, 0, NULL},
+#endif
+    [BUILTIN_SLOT(4, 'e', 'c', 'o')] = {"echo", echoArgs, 1, NULL},
+    [BUILTIN_SLOT(6, 'p', 'r', 'f')] = {"printf", printFormat, 1, NULL},
+    [BUILTIN_SLOT(4, 't', 'r', 'e')] = {"true", trueCommand, 1, NULL},
+    [BUILTIN_SLOT(5, 'f', 'a', 'e')] = {"false", falseCommand, 1, NULL},
+    [BUILTIN_SLOT(4, 't', 'e', 't')] = {"test", testExpression, 1, NULL},
+    [BUILTIN_SLOT(1, '[', '\0', '[')] = {"[", testExpression, 1, NULL},
+    [BUILTIN_SLOT(3, 'p', 'w', 'd')] = {"pwd", printDir, 1, NULL},
+    [BUILTIN_SLOT(3, 'c', 'a', 't')] = {"cat", catFiles, 1, NULL},
+    [BUILTIN_SLOT(5, 's', 'l', 'p')] = {"sleep", sleepFor, 1, NULL},
+    [BUILTIN_SLOT(5, 't', 'r', 'e')] = {"trace", traceCommand, 0, NULL},
+    [BUILTIN_SLOT(6, 'c', 'o', 'c')] = {"coproc", coprocCommand, 0,
+                                        coprocPipeline},
+    [BUILTIN_SLOT(6, 'e', 'x', 't')] = {"export", exportVars, 0, NULL},
+    [BUILTIN_SLOT(5, 'u', 'n', 't')] = {"unset", unsetVars, 0, NULL},
+    [BUILTIN_SLOT(4, 't', 'i', 'e')] = {"time", NULL, 0, timePipeline},
+    [BUILTIN_SLOT(5, 'q', 'u', 'e')] = {"queue", NULL, 0, queuePipeline},
+    [BUILTIN_SLOT(5, 'l', 'i', 't')] = {"limit", NULL, 0, limitPipeline},
+};
+
+/*  Description:
+        Looks a command name up in the built-in table
+    Arguments:
+        name: argv[0] of the command
+    Returns:
+        the built-in, or NULL if name is not one */
+const builtin_t *findBuiltin(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0) {
+        return NULL;
+    }
+    const builtin_t *b =
+        &builtins[BUILTIN_SLOT(len, name[0], name[1], name[len - 1])];
+    return b->name != NULL && !strcmp(b->name, name) ? b : NULL;
+}
+
+/*  Description:
+        Tells whether a command name is a built-in that can run as a
+        pipeline stage in a copy of the shell (a prefix word cannot)
+    Arguments:
+        name: argv[0] of the command */
+int isBuiltin(const char *name) {
+    const builtin_t *b = findBuiltin(name);
+    return b != NULL && b->run != NULL;
+}
+
+/*  Description:
+        Runs a built-in as a pipeline stage, in the child forked for it
+    Arguments:
+        argv: the stage's words
+    Returns:
+        the built-in's status, 127 if it leaves the command to a program
+        that cannot be found */
+int runStageBuiltin(char *argv[]) {
+    int status = findBuiltin(argv[0])->run(argv);
+    if (status == RUN_EXTERNAL) {
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        status = 127;
+    }
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+        status = 1;
+    }
+    return status;
+}
+
+/*  Description:
+        Moves a descriptor onto one of the shell's, keeping a copy of the
+        original for restoreFd
+    Arguments:
+        fd: descriptor to replace
+        newFd: descriptor to move there, closed; -1 if opening it failed
+        saved: set to the copy of fd, -1 if fd was not open
+    Returns:
+        0 on success, -1 if newFd is -1 */
+int replaceFd(int fd, int newFd, int *saved) {
+    if (newFd == -1) {
+        return -1;
+    }
+    *saved = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+    if (*saved == -1 && errno != EBADF) {
+        perror("fcntl");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (dup2(newFd, fd) == -1) {
+        perror("dup2");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    close(newFd);
+    return 0;
+}
+
+/*  Description:
+        Points one of the shell's standard file descriptors at a file for
+        the length of a built-in, keeping a copy of the original
+    Arguments:
+        fd: descriptor to redirect
+        file: path of the file
+        flags: flags to open it with
+        saved: set to the copy of the original, -1 if fd was not open
+    Returns:
+        0 on success, -1 if the file could not be opened */
+int redirectBuiltin(int fd, const char *file, int flags, int *saved) {
+    int fileFd = open(file, flags | O_CLOEXEC, 0666);
+    if (fileFd == -1) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    return replaceFd(fd, fileFd, saved);
+}
+
+/*  Description:
+        Puts back a descriptor saved by replaceFd or redirectBuiltin
+    Arguments:
+        fd: descriptor that was redirected
+        saved: the copy of its original, -1 if it was not open */
+void restoreFd(int fd, int saved) {
+    if (saved == -1) {
+        close(fd);
+    } else {
+        if (dup2(saved, fd) == -1) {
+            perror("dup2");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        close(saved);
+    }
+}
+
+/*  Description:
+        Runs a built-in in the shell itself, with the command's redirections
+        applied to the shell's own stdin and stdout while it runs
+    Arguments:
+        b: the built-in
+        cmd: the command calling it
+    Returns:
+        the built-in's status, 1 if a redirection failed, or RUN_EXTERNAL */
+int runBuiltin(const builtin_t *b, command_t *cmd) {
+    int savedIn = -1;
+    int savedOut = -1;
+    if (cmd->ntees > 0) {
+        fprintf(stderr, "%s: cannot write to several files\n", cmd->argv[0]);
+        return 1;
+    }
+    // Output buffered so far belongs to the original stdout
+    if (cmd->output != NULL && fflush(stdout) < 0) {
+        perror("fflush");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if (cmd->input != NULL &&
+        ((cmd->coproc & COPROC_IN)
+             ? replaceFd(0, dupCoproc(cmd->input, 0), &savedIn)
+             : redirectBuiltin(0, cmd->input, O_RDONLY, &savedIn)) == -1) {
+        return 1;
+    }
+    if (cmd->output != NULL &&
+        ((cmd->coproc & COPROC_OUT)
+             ? replaceFd(1, dupCoproc(cmd->output, 1), &savedOut)
+             : redirectBuiltin(1, cmd->output,
+                               cmd->append ? O_WRONLY | O_CREAT | O_APPEND
+                                           : O_WRONLY | O_CREAT | O_TRUNC,
+                               &savedOut)) == -1) {
+        if (cmd->input != NULL) {
+            restoreFd(0, savedIn);
+        }
+        return 1;
+    }
+    // Writing to a coprocess that has exited fails with EPIPE rather than
+    // taking the shell down with SIGPIPE
+    if ((cmd->coproc & COPROC_OUT) && signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        perror("signal");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    int status = b->run(cmd->argv);
+    if (cmd->output != NULL) {
+        // A failed flush has lost output the built-in thought it printed
+        if (fflush(stdout) < 0) {
+            fprintf(stderr, "%s: %s\n", cmd->output, strerror(errno));
+            clearerr(stdout);
+            status = 1;
+        }
+        restoreFd(1, savedOut);
+        if (cmd->coproc & COPROC_OUT) {
+            signal(SIGPIPE, SIG_DFL);
+        }
+    }
+    if (cmd->input != NULL) {
+        restoreFd(0, savedIn);
+    }
+    return status;
+}
+
+int runPipeline(pipeline_t *pl);
+int findFunction(const char *name);
+int runFunction(char *tokens[]);
+// Number of shell functions defined, which are looked up in their own table
+// before built-ins
+int nfunctions = 0;
+
+/*  Description:
+        Prints one line of the report of time to stderr, with the duration
+        in minutes and seconds
+    Arguments:
+        name: label of the duration
+        sec: whole seconds
+        usec: microseconds */
+void printDuration(const char *name, long sec, long usec) {
+    if (usec < 0) {
+        sec--;
+        usec += 1000000;
+    }
+    if (fprintf(stderr, "%s\t%ldm%ld.%03lds\n", name, sec / 60, sec % 60,
+                usec / 1000) < 0) {
+        perror("fprintf");
+    }
+}
+
+/*  Description:
+        Runs a pipeline that was prefixed with time and reports its wall
+        clock time and resource usage on stderr. External commands are
+        measured through the rusage wait4 collected for their job; built-ins,
+        which run in the shell, through the shell's own.
+    Arguments:
+        pl: the pipeline, whose first word is time
+    Returns:
+        the pipeline's exit status, or RUN_EXTERNAL if time is alone */
+int timePipeline(pipeline_t *pl) {
+    char **argv = pl->cmds[0].argv;
+    if (argv[1] == NULL) {
+        return RUN_EXTERNAL;
+    }
+    pl->cmds[0].argv = argv + 1;
+    if (pl->background) {
+        // Nothing to time: a background job is only started
+        int status = runPipeline(pl);
+        pl->cmds[0].argv = argv;
+        return status;
+    }
+    struct rusage selfBefore;
+    struct rusage selfAfter;
+    struct timespec start;
+    struct timespec end;
+    memset(&lastJobUsage, 0, sizeof(lastJobUsage));
+    getrusage(RUSAGE_SELF, &selfBefore);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status = runPipeline(pl);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &selfAfter);
+    pl->cmds[0].argv = argv;
+    struct rusage *ru = &lastJobUsage;
+    struct timeval user;
+    struct timeval sys;
+    timersub(&selfAfter.ru_utime, &selfBefore.ru_utime, &user);
+    timeradd(&user, &ru->ru_utime, &user);
+    timersub(&selfAfter.ru_stime, &selfBefore.ru_stime, &sys);
+    timeradd(&sys, &ru->ru_stime, &sys);
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+    }
+    printDuration("\nreal", (long)(end.tv_sec - start.tv_sec),
+                  (end.tv_nsec - start.tv_nsec) / 1000);
+    printDuration("user", (long)user.tv_sec, (long)user.tv_usec);
+    printDuration("sys", (long)sys.tv_sec, (long)sys.tv_usec);
+    if (fprintf(stderr,
+                "maxrss\t%ldKB\ncsw\t%ld voluntary, %ld involuntary\n"
+                "faults\t%ld minor, %ld major\n",
+                ru->ru_maxrss,
+                ru->ru_nvcsw + selfAfter.ru_nvcsw - selfBefore.ru_nvcsw,
+                ru->ru_nivcsw + selfAfter.ru_nivcsw - selfBefore.ru_nivcsw,
+                ru->ru_minflt + selfAfter.ru_minflt - selfBefore.ru_minflt,
+                ru->ru_majflt + selfAfter.ru_majflt - selfBefore.ru_majflt) <
+        0) {
+        perror("fprintf");
+    }
+    return status;
+}
+
+/*  Description:
+        Sets the limits background jobs are admitted under and shows them,
+        or runs a pipeline with a priority in the queue and a nice level
+    Arguments:
+        pl: the pipeline, whose first word is queue, followed by options:
+        -j and the number of background jobs that may run at once, -l and
+        the load average above which they wait, 0 for no limit, and for a
+        command, -p and its priority (higher is started sooner) and -n and
+        the increment to its nice level
+    Returns:
+        the pipeline's exit status, or 0 on success and 1 on error when
+        there is no command */
+int queuePipeline(pipeline_t *pl) {
+    char **argv = pl->cmds[0].argv;
+    int limit = jobLimit;
+    double load = loadLimit;
+    int priority = 0;
+    int niceness = 0;
+    int i = 1;
+    // The limits only change once every option is known to be valid
+    for (; argv[i] != NULL && argv[i][0] == '-'; i += 2) {
+        char *end = NULL;
+        if (argv[i + 1] != NULL && !strcmp(argv[i], "-j")) {
+            limit = (int)strtol(argv[i + 1], &end, 10);
+        } else if (argv[i + 1] != NULL && !strcmp(argv[i], "-l")) {
+            load = strtod(argv[i + 1], &end);
+        } else if (argv[i + 1] != NULL && !strcmp(argv[i], "-p")) {
+            priority = (int)strtol(argv[i + 1], &end, 10);
+        } else if (argv[i + 1] != NULL && !strcmp(argv[i], "-n")) {
+            niceness = (int)strtol(argv[i + 1], &end, 10);
+        }
+        if (end == NULL || end == argv[i + 1] || *end != '\0' || limit < 0 ||
+            load < 0) {
+            fprintf(stderr, "queue: syntax error\n");
+            return 1;
+        }
+    }
+    jobLimit = limit;
+    loadLimit = load;
+    if (argv[i] == NULL) {
+        // Raised limits may let queued jobs start
+        admitJobs();
+        if (pl->ncmds > 1 ||
+            printf("limit %d, load %.2f, %d running, %d queued\n", jobLimit,
+                   loadLimit, get_job_count(jobList, RUNNING),
+                   (int)queueCount) < 0) {
+            fprintf(stderr, "Error: Could not print queue.\n");
+            return 1;
+        }
+        return 0;
+    }
+    pl->cmds[0].argv = argv + i;
+    int launchNice = launchPolicy.nice;
+    launchPriority = priority;
+    launchPolicy.nice = niceness;
+    int status = runPipeline(pl);
+    launchPriority = 0;
+    launchPolicy.nice = launchNice;
+    pl->cmds[0].argv = argv;
+    return status;
+}
+
+/* A resource limit limit -r can set, by the name it takes */
+typedef struct rlimit_name {
+    const char *name;
+    int resource;
+} rlimit_name_t;
+
+const rlimit_name_t rlimitNames[] = {
+    {"as", RLIMIT_AS},           {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},         {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},     {"memlock", RLIMIT_MEMLOCK},
+    {"nofile", RLIMIT_NOFILE},   {"nproc", RLIMIT_NPROC},
+    {"rss", RLIMIT_RSS},         {"stack", RLIMIT_STACK},
+};
+
+/*  Description:
+        Parses a list of CPUs such as 0-3,6 into a CPU set
+    Arguments:
+        list: the list, of CPU numbers and ranges separated by commas
+        cpus: set to the CPUs listed
+    Returns:
+        0 on success, -1 if the list is malformed or names a CPU past
+        CPU_SETSIZE */
+int parseCpus(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *p = list;
+    do {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        p = end + 1;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    } while (p[-1] == ',');
+    return 0;
+}
+
+/*  Description:
+        Parses an amount such as 64, 512K, 100M or unlimited
+    Arguments:
+        text: the amount, optionally followed by K, M or G for a multiple of
+        1024, or one of unlimited and max
+        value: set to the amount, RLIM_INFINITY for no limit
+    Returns:
+        0 on success, -1 if the amount is malformed */
+int parseAmount(const char *text, rlim_t *value) {
+    if (!strcmp(text, "unlimited") || !strcmp(text, "max")) {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long amount = strtoull(text, &end, 10);
+    int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+    if (end == text || text[0] == '-' || errno != 0 ||
+        end[shift != 0] != '\0' || amount > (RLIM_INFINITY - 1) >> shift) {
+        return -1;
+    }
+    *value = (rlim_t)amount << shift;
+    return 0;
+}
+
+/*  Description:
+        Writes a value to one of the control files of a cgroup
+    Arguments:
+        cgroup: the cgroup's directory
+        file: the control file, such as memory.max
+        value: the value
+    Returns:
+        0 on success, -1 on error, which is printed */
+int writeCgroup(const char *cgroup, const char *file, const char *value) {
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    ssize_t len = (ssize_t)strlen(value);
+    if (fd == -1 || write(fd, value, len) != len) {
+        fprintf(stderr, "limit: %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*  Description:
+        Runs a pipeline with its processes confined: bound to some CPUs,
+        under resource limits, or in a cgroup v2, whose CPU and memory
+        limits are set right away. Each child applies the policy itself
+        before executing its program, and jobs shows it.
+    Arguments:
+        pl: the pipeline, whose first word is limit, followed by options:
+        -c and the CPUs to run on (such as 0-3,6), -r and a resource limit
+        as name=soft[:hard] (name being one of as, core, cpu, data, fsize,
+        memlock, nofile, nproc, rss and stack, soft also serving as hard if
+        there is none), -g and the cgroup to join (relative to
+        /sys/fs/cgroup unless absolute, created if needed), and for that
+        cgroup -m and its memory.max and -q and its cpu.max as quota[/period]
+        in microseconds
+    Returns:
+        the pipeline's exit status, or 1 on error */
+int limitPipeline(pipeline_t *pl) {
+    char **argv = pl->cmds[0].argv;
+    launch_policy_t policy = launchPolicy;
+    const char *memoryMax = NULL;
+    const char *cpuMax = NULL;
+    int ok = 1;
+    int i = 1;
+    for (; ok && argv[i] != NULL && argv[i][0] == '-'; i += 2) {
+        char *arg = argv[i + 1];
+        ok = arg != NULL && argv[i][1] != '\0' && argv[i][2] == '\0';
+        if (!ok) {
+            break;
+        }
+        switch (argv[i][1]) {
+            case 'c':
+                ok = parseCpus(arg, &policy.cpus) == 0;
+                policy.pinned = 1;
+                break;
+            case 'r': {
+                char *value = strchr(arg, '=');
+                size_t n = sizeof(rlimitNames) / sizeof(rlimitNames[0]);
+                size_t k = 0;
+                while (value != NULL && k < n &&
+                       (strncmp(arg, rlimitNames[k].name, value - arg) ||
+                        rlimitNames[k].name[value - arg] != '\0')) {
+                    k++;
+                }
+                ok = value != NULL && k < n;
+                if (!ok) {
+                    break;
+                }
+                // Soft and hard values are parsed from a copy split at :
+                char amount[64];
+                snprintf(amount, sizeof(amount), "%s", value + 1);
+                char *hard = strchr(amount, ':');
+                if (hard != NULL) {
+                    *hard++ = '\0';
+                }
+                struct rlimit limit;
+                ok = parseAmount(amount, &limit.rlim_cur) == 0 &&
+                     parseAmount(hard != NULL ? hard : amount,
+                                 &limit.rlim_max) == 0 &&
+                     limit.rlim_cur <= limit.rlim_max;
+                // A resource given again replaces its earlier limit
+                int l = 0;
+                while (l < policy.nlimits &&
+                       policy.limits[l].resource != rlimitNames[k].resource) {
+                    l++;
+                }
+                ok = ok && l < 16;
+                if (ok) {
+                    policy.limits[l].resource = rlimitNames[k].resource;
+                    policy.limits[l].limit = limit;
+                    policy.nlimits += l == policy.nlimits;
+                }
+                break;
+            }
+            case 'g':
+                snprintf(policy.cgroup, sizeof(policy.cgroup), "%s%s",
+                         arg[0] == '/' ? "" : "/sys/fs/cgroup/", arg);
+                break;
+            case 'm':
+                memoryMax = arg;
+                break;
+            case 'q':
+                cpuMax = arg;
+                break;
+            default:
+                ok = 0;
+        }
+        if (ok) {
+            // Shown by jobs as name=value, -r being given in that form
+            size_t len = strlen(policy.text);
+            snprintf(policy.text + len, sizeof(policy.text) - len, "%s%s%s",
+                     len > 0 ? " " : "",
+                     argv[i][1] == 'c'   ? "cpus="
+                     : argv[i][1] == 'r' ? ""
+                     : argv[i][1] == 'g' ? "cgroup="
+                     : argv[i][1] == 'm' ? "memory.max="
+                                         : "cpu.max=",
+                     arg);
+        }
+    }
+    if (!ok || argv[i] == NULL ||
+        ((memoryMax != NULL || cpuMax != NULL) && policy.cgroup[0] == '\0')) {
+        fprintf(stderr, "limit: syntax error\n");
+        return 1;
+    }
+    // Sets up the cgroup, whose limits then hold for everything in it
+    if (policy.cgroup[0] != '\0') {
+        if (mkdir(policy.cgroup, 0755) == -1 && errno != EEXIST) {
+            fprintf(stderr, "limit: %s: %s\n", policy.cgroup,
+                    strerror(errno));
+            return 1;
+        }
+        char quota[64];
+        if (cpuMax != NULL) {
+            // quota/period is written as "quota period"
+            snprintf(quota, sizeof(quota), "%s", cpuMax);
+            char *slash = strchr(quota, '/');
+            if (slash != NULL) {
+                *slash = ' ';
+            }
+        }
+        if ((memoryMax != NULL &&
+             writeCgroup(policy.cgroup, "memory.max", memoryMax) == -1) ||
+            (cpuMax != NULL &&
+             writeCgroup(policy.cgroup, "cpu.max", quota) == -1)) {
+            return 1;
+        }
+    }
+    launch_policy_t saved = launchPolicy;
+    launchPolicy = policy;
+    pl->cmds[0].argv = argv + i;
+    int status = runPipeline(pl);
+    pl->cmds[0].argv = argv;
+    launchPolicy = saved;
+    return status;
+}
+
+/*  Description:
+        Starts a coprocess: runs the pipeline after coproc NAME as a
+        background job reading from one pipe and writing to another, whose
+        other ends the shell keeps under NAME. It starts right away rather
+        than queueing behind other background jobs, since commands are about
+        to talk to it. A name is only reused once its coprocess has
+        finished, and the slot of a finished one is reused if need be.
+    Arguments:
+        pl: the pipeline, whose first words are coproc and the name
+    Returns:
+        0 on success, 1 on error, 127 if no stage could be started, or
+        RUN_EXTERNAL if coproc is not followed by a name */
+int coprocPipeline(pipeline_t *pl) {
+    char **argv = pl->cmds[0].argv;
+    const char *name = argv[1];
+    // coproc alone or with an option is the built-in
+    if (name == NULL || name[0] == '-') {
+        return RUN_EXTERNAL;
+    }
+    size_t len = strspn(name, "abcdefghijklmnopqrstuvwxyz"
+                              "ABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789");
+    if (argv[2] == NULL) {
+        fprintf(stderr, "coproc: syntax error\n");
+        return 1;
+    }
+    if (name[len] != '\0' || len >= COPROC_NAME_MAX ||
+        (name[0] >= '0' && name[0] <= '9')) {
+        fprintf(stderr, "coproc: %s: invalid name\n", name);
+        return 1;
+    }
+    coproc_t *cp = findCoproc(name);
+    if (cp != NULL && get_job_state(jobList, cp->jid) != _STATE_NONE) {
+        fprintf(stderr, "coproc: %s: already running\n", name);
+        return 1;
+    }
+    if (cp != NULL) {
+        closeCoproc(cp);
+    }
+    cp = NULL;
+    for (int i = 0; i < COPROC_MAX && cp == NULL; i++) {
+        if (coprocs[i].name[0] == '\0') {
+            cp = &coprocs[i];
+        }
+    }
+    // With every slot taken, takes that of a coprocess that has finished
+    for (int i = 0; i < COPROC_MAX && cp == NULL; i++) {
+        if (get_job_state(jobList, coprocs[i].jid) == _STATE_NONE) {
+            cp = &coprocs[i];
+            closeCoproc(cp);
+        }
+    }
+    if (cp == NULL) {
+        fprintf(stderr, "coproc: too many coprocesses\n");
+        return 1;
+    }
+    int toFds[2];
+    int fromFds[2];
+    if (pipe2(toFds, O_CLOEXEC) == -1 || pipe2(fromFds, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    pl->cmds[0].argv = argv + 2;
+    pid_t pgid = startJob(pl->cmds, pl->ncmds, job, 1, toFds[0], fromFds[1]);
+    pl->cmds[0].argv = argv;
+    close(toFds[0]);
+    close(fromFds[1]);
+    if (pgid == 0) {
+        close(toFds[1]);
+        close(fromFds[0]);
+        return 127;
+    }
+    strcpy(cp->name, name);
+    cp->jid = job;
+    cp->inFd = toFds[1];
+    cp->outFd = fromFds[0];
+    if (printf("[%d] (%d)\n", job, pgid) < 0) {
+        fprintf(stderr, "Error: Could not print job and process id.\n");
+    }
+    job++;
+    return 0;
+}
+
+/*  Description:
+        Runs a pipeline ending in parallel, which runs in the shell as
+        always: since it reads all of its input before it starts any
+        command, the stages before it run first as a pipeline of their own,
+        their output gathered as for a command substitution and handed to
+        parallel as its stdin
+    Arguments:
+        pl: the pipeline
+    Returns:
+        the exit status of parallel, or of the stages before it if Ctrl-C
+        ended them, 2 if parallel also has an input file */
+int parallelPipeline(pipeline_t *pl) {
+    command_t *last = &pl->cmds[pl->ncmds - 1];
+    if (last->input != NULL) {
+        fprintf(stderr, "parallel: input both piped and redirected\n");
+        return 2;
+    }
+    word_buf_t input = {NULL, 0, 0};
+    pipeline_t producer = {pl->cmds, pl->ncmds - 1, 0, pl->connector};
+    capture_t outer;
+    beginCapture(&input, &outer);
+    int status = runPipeline(&producer);
+    endCapture(&outer);
+    if (status == 128 + SIGINT) {
+        free(input.data);
+        return status;
+    }
+    int fd = memfd_create("parallel", MFD_CLOEXEC);
+    if (fd == -1) {
+        perror("memfd_create");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    for (size_t off = 0; off < input.len;) {
+        ssize_t count = write(fd, input.data + off, input.len - off);
+        if (count == -1) {
+            perror("write");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        off += (size_t)count;
+    }
+    free(input.data);
+    lseek(fd, 0, SEEK_SET);
+    int saved;
+    replaceFd(0, fd, &saved);
+    status = runBuiltin(findBuiltin("parallel"), last);
+    restoreFd(0, saved);
+    return status;
+}
+
+/*  Description:
+        Runs one pipeline, either as a built-in or by executing it
+    Arguments:
+        pl: the pipeline
+    Returns:
+        its exit status */
+int runPipeline(pipeline_t *pl) {
+    // Runs a copy with its words expanded, which changes from run to run
+    if (needsExpansion(pl)) {
+        expanded_t expanded;
+        long before = substitutions;
+        if (expandPipeline(pl, &expanded) == -1) {
+            return 1;
+        }
+        int status = runPipeline(&expanded.pl);
+        // Assignments alone end with the status of their last substitution
+        if (expanded.pl.ncmds == 1 && expanded.pl.cmds[0].argv[0] == NULL &&
+            substitutions != before) {
+            status = lastStatus;
+        }
+        freeExpanded(&expanded);
+        return status;
+    }
+    // Only expansion can leave a stage of a longer pipeline without a
+    // command
+    for (int i = 0; i < pl->ncmds && pl->ncmds > 1; i++) {
+        if (pl->cmds[i].argv[0] == NULL) {
+            fprintf(stderr, "syntax error: missing command in pipe\n");
+            return 2;
+        }
+    }
+    // Assignments alone set shell variables, and a command expanded to
+    // nothing does nothing
+    if (pl->cmds[0].argv[0] == NULL) {
+        for (int a = 0; a < pl->cmds[0].nassigns; a++) {
+            const char *assign = pl->cmds[0].assigns[a];
+            size_t len = varNameLen(assign);
+            setVar(assign, len, assign + len + 1, 0);
+        }
+        return 0;
+    }
+    // Prefix words take the whole pipeline rather than their command
+    const builtin_t *prefix = findBuiltin(pl->cmds[0].argv[0]);
+    if (prefix != NULL && prefix->prefix != NULL) {
+        int status = prefix->prefix(pl);
+        if (status != RUN_EXTERNAL) {
+            return status;
+        }
+    }
+    // Functions run in the shell itself, as a command of their own
+    for (int i = 0; i < pl->ncmds && nfunctions > 0 &&
+                    (pl->ncmds > 1 || pl->background);
+         i++) {
+        if (findFunction(pl->cmds[i].argv[0]) != -1) {
+            fprintf(stderr,
+                    "%s: functions cannot be run in the background or in a "
+                    "pipeline\n",
+                    pl->cmds[i].argv[0]);
+            return 2;
+        }
+    }
+    // parallel stays a built-in at the end of a pipeline, which is the
+    // only stage it can be
+    for (int i = 0; i < pl->ncmds && pl->ncmds > 1; i++) {
+        if (!strcmp(pl->cmds[i].argv[0], "parallel") &&
+            (i < pl->ncmds - 1 || pl->background)) {
+            fprintf(stderr, "parallel: can only be the last command of a "
+                            "foreground pipeline\n");
+            return 2;
+        }
+    }
+    if (pl->ncmds > 1 &&
+        !strcmp(pl->cmds[pl->ncmds - 1].argv[0], "parallel")) {
+        return parallelPipeline(pl);
+    }
+    /* Checks for function and built-in calls; as other pipeline stages
+     * built-ins run in a forked copy of the shell instead, and utilities
+     * sent to the background, run under a policy or writing to several
+     * files run as programs */
+    if (pl->ncmds == 1) {
+        builtin_t function = {pl->cmds[0].argv[0], runFunction, 0, NULL};
+        const builtin_t *b =
+            nfunctions > 0 && findFunction(pl->cmds[0].argv[0]) != -1
+                ? &function
+                : findBuiltin(pl->cmds[0].argv[0]);
+        if (b != NULL && b->run != NULL &&
+            !(b->utility && (pl->background || hasPolicy(&launchPolicy) ||
+                             pl->cmds[0].ntees > 0))) {
+            char **saved = pl->cmds[0].nassigns > 0
+                               ? applyAssigns(&pl->cmds[0])
+                               : NULL;
+            int status = runBuiltin(b, &pl->cmds[0]);
+            if (saved != NULL) {
+                restoreAssigns(&pl->cmds[0], saved);
+            }
+            if (status != RUN_EXTERNAL) {
+                return status;
+            }
+        }
+    }
+    /* Calls function to fork a child to run command */
+    return execute(pl->cmds, pl->ncmds, pl->background);
+}
+
+/*  Description:
+        Runs the pipelines of a parsed line in order, skipping a pipeline
+        after && when the last status was non-zero, and after || when it
+        was zero
+    Arguments:
+        line: the parsed line */
+void runLine(parsed_line_t *line) {
+    linesRunning++;
+    for (int i = 0; i < line->npipelines; i++) {
+        pipeline_t *pl = &line->pipelines[i];
+        if ((pl->connector == TOK_AND && lastStatus != 0) ||
+            (pl->connector == TOK_OR && lastStatus == 0)) {
+            continue;
+        }
+        lastStatus = runPipeline(pl);
+        // Ctrl-C ends a command substitution as a whole
+        if (subshell && lastStatus == 128 + SIGINT) {
+            exitSubshell(lastStatus);
+        }
+    }
+    linesRunning--;
+    // Built-ins print through stdio, which is not line buffered when stdout
+    // is a pipe or file
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+}
+
+/* A reserved word or a pipeline of a compound command being read */
+typedef struct block_item {
+    keyword_t keyword;  // KW_NONE for a pipeline
+    pipeline_t *pl;     // the pipeline, or the header of a for loop
+    char *word;         // name of a function
+} block_item_t;
+
+/* Instructions compound commands are compiled to */
+typedef enum {
+    OP_RUN,     // runs pl, honoring its && or ||
+    OP_TEST,    // jumps to target if the last status is not 0, making it 0
+    OP_JUMP,    // jumps to target
+    OP_FOR,     // expands the words of the for loop pl, jumping to target
+                // if they could not be
+    OP_NEXT,    // sets the variable of the innermost for loop to its next
+                // word, or ends the loop and jumps to target
+    OP_DEFINE,  // defines function word as the instructions up to target,
+                // and jumps there
+} op_kind_t;
+
+typedef struct op {
+    op_kind_t kind;
+    int target;
+    pipeline_t *pl;
+    const char *word;
+} op_t;
+
+/* Compound commands compiled once into instructions, which point into the
+ * lines they were parsed from; shared by the functions it defines */
+typedef struct program {
+    op_t *ops;
+    int nops;
+    int capacity;
+    parsed_line_t **lines;
+    int nlines;
+    int maxLoops;  // deepest nesting of for loops
+    int refs;
+} program_t;
+
+/* A shell function: the instructions of its body in a program */
+typedef struct function {
+    const char *name;
+    program_t *program;
+    int start;
+    int end;
+} function_t;
+
+/* A for loop running: its words and the offset of the next one */
+typedef struct loop {
+    word_buf_t words;
+    size_t next;
+} loop_t;
+
+// Lines of the compound command being read, which ends once every reserved
+// word opening one has been closed
+parsed_line_t **blockLines = NULL;
+int nblockLines = 0;
+int blockLinesCapacity = 0;
+block_item_t *blockItems = NULL;
+int nblockItems = 0;
+int blockItemsCapacity = 0;
+int blockDepth = 0;
+keyword_t blockLast = KW_NONE;
+
+function_t *functions = NULL;
+
+// Set when Ctrl-C ends the compound commands running, with the number of
+// them running
+int blockInterrupted = 0;
+int blocksRunning = 0;
+
+// Function calls running
+int functionDepth = 0;
+
+/*  Description:
+        Appends an instruction to a program
+    Arguments:
+        p: the program
+        kind: kind of the instruction
+        pl: its pipeline, or NULL
+        word: its word, or NULL
+    Returns:
+        the index of the instruction, for its target to be set later */
+int emitOp(program_t *p, op_kind_t kind, pipeline_t *pl, const char *word) {
+    if (p->nops == p->capacity) {
+        p->capacity = p->capacity == 0 ? 64 : p->capacity * 2;
+        p->ops = (op_t *)realloc(p->ops, p->capacity * sizeof(op_t));
+        if (p->ops == NULL) {
+            perror("realloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    p->ops[p->nops] = (op_t){kind, -1, pl, word};
+    return p->nops++;
+}
+
+/*  Description:
+        Frees a program once nothing refers to it any more
+    Arguments:
+        p: the program */
+void releaseProgram(program_t *p) {
+    if (--p->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < p->nlines; i++) {
+        free(p->lines[i]);
+    }
+    free(p->lines);
+    free(p->ops);
+    free(p);
+}
+
+/*  Description:
+        Returns the index of a function in the functions array, -1 if no
+        function has that name */
+int findFunction(const char *name) {
+    for (int i = 0; i < nfunctions; i++) {
+        if (!strcmp(functions[i].name, name)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*  Description:
+        Defines a function, or redefines it
+    Arguments:
+        name: its name, in the program's lines
+        p: the program holding its body
+        start: first instruction of the body
+        end: instruction following the body */
+void defineFunction(const char *name, program_t *p, int start, int end) {
+    int i = findFunction(name);
+    if (i == -1) {
+        function_t *grown = (function_t *)realloc(
+            functions, (nfunctions + 1) * sizeof(function_t));
+        if (grown == NULL) {
+            perror("realloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+        functions = grown;
+        i = nfunctions++;
+    } else {
+        releaseProgram(functions[i].program);
+    }
+    p->refs++;
+    functions[i] = (function_t){name, p, start, end};
+}
+
+/* Compiles the items of a compound command into a program */
+typedef struct compiler {
+    const block_item_t *items;
+    int nitems;
+    int next;  // item to compile next
+    program_t *p;
+    int loops;  // for loops the next item is in
+    int failed;
+} compiler_t;
+
+/*  Description:
+        Reports a compound command missing a reserved word, or having
+        another one in its place
+    Arguments:
+        c: the compiler, marked as failed
+        found: the reserved word found, KW_NONE at the end of the command
+        wanted: the reserved word expected */
+void keywordError(compiler_t *c, keyword_t found, keyword_t wanted) {
+    if (!c->failed) {
+        if (found == KW_NONE) {
+            fprintf(stderr, "syntax error: missing %s\n",
+                    keywordText[wanted]);
+        } else {
+            fprintf(stderr, "syntax error near unexpected %s\n",
+                    keywordText[found]);
+        }
+    }
+    c->failed = 1;
+}
+
+keyword_t compileList(compiler_t *c);
+
+/*  Description:
+        Compiles a list of commands that has to end with a given reserved
+        word, which is consumed
+    Arguments:
+        c: the compiler
+        wanted: the reserved word
+    Returns:
+        0 on success, -1 on a syntax error (which was reported) */
+int compileUntil(compiler_t *c, keyword_t wanted) {
+    keyword_t found = compileList(c);
+    if (found != wanted) {
+        keywordError(c, found, wanted);
+        return -1;
+    }
+    c->next++;
+    return 0;
+}
+
+/*  Description:
+        Compiles if CONDITION; then LIST [elif CONDITION; then LIST]...
+        [else LIST] fi. The jumps from the end of each branch to the end
+        of the whole command are chained through their targets until that
+        end is known.
+    Arguments:
+        c: the compiler, at the if */
+void compileIf(compiler_t *c) {
+    program_t *p = c->p;
+    int chain = -1;
+    c->next++;
+    while (compileUntil(c, KW_THEN) == 0) {
+        int test = emitOp(p, OP_TEST, NULL, NULL);
+        keyword_t found = compileList(c);
+        if (found == KW_ELIF || found == KW_ELSE) {
+            int jump = emitOp(p, OP_JUMP, NULL, NULL);
+            p->ops[jump].target = chain;
+            chain = jump;
+        }
+        p->ops[test].target = p->nops;
+        if (found == KW_ELIF) {
+            c->next++;
+            continue;
+        }
+        if (found == KW_ELSE) {
+            c->next++;
+            compileUntil(c, KW_FI);
+        } else if (found == KW_FI) {
+            c->next++;
+        } else {
+            keywordError(c, found, KW_FI);
+        }
+        break;
+    }
+    while (chain != -1) {
+        int previous = p->ops[chain].target;
+        p->ops[chain].target = p->nops;
+        chain = previous;
+    }
+}
+
+/*  Description:
+        Compiles while CONDITION; do LIST; done
+    Arguments:
+        c: the compiler, at the while */
+void compileWhile(compiler_t *c) {
+    program_t *p = c->p;
+    int start = p->nops;
+    c->next++;
+    if (compileUntil(c, KW_DO) == -1) {
+        return;
+    }
+    int test = emitOp(p, OP_TEST, NULL, NULL);
+    if (compileUntil(c, KW_DONE) == -1) {
+        return;
+    }
+    p->ops[emitOp(p, OP_JUMP, NULL, NULL)].target = start;
+    p->ops[test].target = p->nops;
+}
+
+/*  Description:
+        Compiles for NAME [in WORDS]; do LIST; done
+    Arguments:
+        c: the compiler, at the for */
+void compileFor(compiler_t *c) {
+    program_t *p = c->p;
+    pipeline_t *pl = c->items[c->next++].pl;
+    char **argv = pl->cmds[0].argv;
+    if (argv[1] == NULL || varNameLen(argv[1]) != strlen(argv[1]) ||
+        (argv[2] != NULL && strcmp(argv[2], "in"))) {
+        if (!c->failed) {
+            fprintf(stderr, "for: syntax error\n");
+        }
+        c->failed = 1;
+        return;
+    }
+    int forOp = emitOp(p, OP_FOR, pl, NULL);
+    int nextOp = emitOp(p, OP_NEXT, NULL, argv[1]);
+    keyword_t found =
+        c->next < c->nitems ? c->items[c->next].keyword : KW_NONE;
+    if (found != KW_DO) {
+        keywordError(c, found, KW_DO);
+        return;
+    }
+    c->next++;
+    if (++c->loops > p->maxLoops) {
+        p->maxLoops = c->loops;
+    }
+    compileUntil(c, KW_DONE);
+    c->loops--;
+    p->ops[emitOp(p, OP_JUMP, NULL, NULL)].target = nextOp;
+    p->ops[forOp].target = p->nops;
+    p->ops[nextOp].target = p->nops;
+}
+
+/*  Description:
+        Compiles NAME() { LIST; }, the definition of a function
+    Arguments:
+        c: the compiler, at the name */
+void compileFunction(compiler_t *c) {
+    program_t *p = c->p;
+    const char *name = c->items[c->next++].word;
+    keyword_t found =
+        c->next < c->nitems ? c->items[c->next].keyword : KW_NONE;
+    if (found != KW_LBRACE) {
+        keywordError(c, found, KW_LBRACE);
+        return;
+    }
+    c->next++;
+    int define = emitOp(p, OP_DEFINE, NULL, name);
+    compileUntil(c, KW_RBRACE);
+    p->ops[define].target = p->nops;
+}
+
+/*  Description:
+        Compiles commands until a reserved word that ends a list, or the
+        end of the compound command
+    Arguments:
+        c: the compiler
+    Returns:
+        the reserved word, not consumed, or KW_NONE at the end */
+keyword_t compileList(compiler_t *c) {
+    while (c->next < c->nitems && !c->failed) {
+        const block_item_t *item = &c->items[c->next];
+        switch (item->keyword) {
+            case KW_NONE:
+                emitOp(c->p, OP_RUN, item->pl, NULL);
+                c->next++;
+                break;
+            case KW_IF:
+                compileIf(c);
+                break;
+            case KW_WHILE:
+                compileWhile(c);
+                break;
+            case KW_FOR:
+                compileFor(c);
+                break;
+            case KW_LBRACE:
+                c->next++;
+                compileUntil(c, KW_RBRACE);
+                break;
+            case KW_FUNCTION:
+                compileFunction(c);
+                break;
+            default:
+                return item->keyword;
+        }
+    }
+    return KW_NONE;
+}
+
+/*  Description:
+        Appends an item to the compound command being read
+    Arguments:
+        keyword: the reserved word, KW_NONE for a pipeline
+        pl: the pipeline, or NULL
+        word: the name of a function, or NULL */
+void addBlockItem(keyword_t keyword, pipeline_t *pl, char *word) {
+    if (nblockItems == blockItemsCapacity) {
+        blockItemsCapacity =
+            blockItemsCapacity == 0 ? 64 : blockItemsCapacity * 2;
+        blockItems = (block_item_t *)realloc(
+            blockItems, blockItemsCapacity * sizeof(block_item_t));
+        if (blockItems == NULL) {
+            perror("realloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    blockItems[nblockItems++] = (block_item_t){keyword, pl, word};
+    blockLast = keyword;
+}
+
+/*  Description:
+        Takes the reserved words off the start of a pipeline of a compound
+        command being read, adding them and what is left of the pipeline to
+        blockItems, and keeps count of the compound commands left open. The
+        pipeline belongs to a line parsed for the block alone, so its words
+        are moved in place.
+    Arguments:
+        pl: the pipeline
+    Returns:
+        0 on success, -1 on a syntax error (which was reported) */
+int splitKeywords(pipeline_t *pl) {
+    command_t *cmd = &pl->cmds[0];
+    char **argv = cmd->argv;
+    int alone = pl->ncmds == 1 && !pl->background && cmd->input == NULL &&
+                cmd->output == NULL && cmd->ntees == 0;
+    while (cmd->nassigns == 0 && argv[0] != NULL) {
+        keyword_t kw = keywordOf(argv[0]);
+        if (kw == KW_NONE) {
+            break;
+        }
+        // Compound commands cannot be joined by && and || or redirected
+        int closing = kw == KW_FI || kw == KW_DONE || kw == KW_RBRACE;
+        if ((argv == cmd->argv && pl->connector != TOK_SEMI) ||
+            ((kw == KW_FOR || closing) && !alone) ||
+            (closing && argv[1] != NULL)) {
+            fprintf(stderr, "syntax error near unexpected %s\n",
+                    keywordText[kw]);
+            return -1;
+        }
+        if (closing) {
+            blockDepth--;
+        } else if (kw == KW_IF || kw == KW_WHILE || kw == KW_FOR ||
+                   kw == KW_FUNCTION ||
+                   // The brace of a function opens nothing its name did not
+                   (kw == KW_LBRACE && blockLast != KW_FUNCTION)) {
+            blockDepth++;
+        }
+        if (kw == KW_FOR) {
+            // The rest of the pipeline is the loop's header
+            cmd->argv = argv;
+            addBlockItem(kw, pl, NULL);
+            return 0;
+        } else if (kw == KW_FUNCTION) {
+            argv[0][strlen(argv[0]) - 2] = '\0';
+        }
+        addBlockItem(kw, NULL, kw == KW_FUNCTION ? argv[0] : NULL);
+        argv++;
+    }
+    if (argv[0] == NULL && cmd->nassigns == 0 && argv != cmd->argv) {
+        if (!alone) {
+            fprintf(stderr, "syntax error: missing command\n");
+            return -1;
+        }
+        return 0;
+    }
+    // NAME=value words after reserved words are assignments too
+    if (argv != cmd->argv) {
+        cmd->assigns = argv;
+        while (argv[0] != NULL && varNameLen(argv[0]) > 0 &&
+               argv[0][varNameLen(argv[0])] == '=') {
+            cmd->nassigns++;
+            argv++;
+        }
+    }
+    cmd->argv = argv;
+    addBlockItem(KW_NONE, pl, NULL);
+    return 0;
+}
+
+/*  Description:
+        Tells whether Ctrl-C was pressed while compound commands of built-ins
+        run, which takes the SIGINT that runCode left pending. Checking is
+        only done every so many calls, since it costs a system call.
+    Arguments:
+        ticks: count of the calls, kept by the caller
+    Returns:
+        whether the commands are to end */
+int checkInterrupt(unsigned *ticks) {
+    if ((++*ticks & 255) == 0) {
+        sigset_t pending;
+        if (sigpending(&pending) == 0 && sigismember(&pending, SIGINT)) {
+            sigset_t intMask;
+            sigemptyset(&intMask);
+            sigaddset(&intMask, SIGINT);
+            struct timespec now = {0, 0};
+            sigtimedwait(&intMask, NULL, &now);
+            lastStatus = 128 + SIGINT;
+            blockInterrupted = 1;
+        }
+    }
+    return blockInterrupted;
+}
+
+/*  Description:
+        Gathers the words a for loop goes through: those after in, expanded
+        and split, or the arguments of the running function without in
+    Arguments:
+        pl: the header of the loop, for NAME [in WORDS]
+        words: the words are appended to it, each NUL terminated
+    Returns:
+        0 on success, -1 if a word could not be expanded */
+int forWords(const pipeline_t *pl, word_buf_t *words) {
+    const command_t *cmd = &pl->cmds[0];
+    if (cmd->argv[2] == NULL) {
+        for (int i = 0; i < npositional; i++) {
+            appendBytes(words, positional[i], strlen(positional[i]) + 1);
+        }
+        return 0;
+    }
+    for (char **arg = cmd->argv + 3; *arg != NULL; arg++) {
+        if (!cmd->expand) {
+            appendBytes(words, *arg, strlen(*arg) + 1);
+        } else if (expandWord(*arg, 1, words) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*  Description:
+        Interprets the instructions of a program from start up to end, or
+        until Ctrl-C is pressed. Jumping back, where loops go round, is where
+        Ctrl-C is checked for.
+    Arguments:
+        p: the program
+        pc: first instruction to run
+        end: instruction to stop at */
+void runProgram(program_t *p, int pc, int end) {
+    loop_t *loops = NULL;
+    int nloops = 0;
+    if (p->maxLoops > 0) {
+        loops = (loop_t *)malloc(p->maxLoops * sizeof(loop_t));
+        if (loops == NULL) {
+            perror("malloc");
+            cleanup_job_list(jobList);
+            exit(1);
+        }
+    }
+    unsigned ticks = 0;
+    while (pc < end && !blockInterrupted) {
+        const op_t *op = &p->ops[pc++];
+        switch (op->kind) {
+            case OP_RUN:
+                if ((op->pl->connector == TOK_AND && lastStatus != 0) ||
+                    (op->pl->connector == TOK_OR && lastStatus == 0)) {
+                    break;
+                }
+                lastStatus = runPipeline(op->pl);
+                // A job or built-in ended by Ctrl-C ends the rest too
+                blockInterrupted |= lastStatus == 128 + SIGINT;
+                break;
+            case OP_TEST:
+                if (lastStatus != 0) {
+                    lastStatus = 0;
+                    pc = op->target;
+                }
+                break;
+            case OP_JUMP:
+                pc = op->target;
+                checkInterrupt(&ticks);
+                break;
+            case OP_FOR:
+                loops[nloops] = (loop_t){{NULL, 0, 0}, 0};
+                if (forWords(op->pl, &loops[nloops].words) == -1) {
+                    free(loops[nloops].words.data);
+                    lastStatus = 1;
+                    pc = op->target;
+                } else {
+                    nloops++;
+                    lastStatus = 0;
+                }
+                break;
+            case OP_NEXT: {
+                loop_t *loop = &loops[nloops - 1];
+                if (loop->next < loop->words.len) {
+                    const char *word = loop->words.data + loop->next;
+                    loop->next += strlen(word) + 1;
+                    setVar(op->word, strlen(op->word), word, 0);
+                } else {
+                    free(loop->words.data);
+                    nloops--;
+                    pc = op->target;
+                }
+                break;
+            }
+            case OP_DEFINE:
+                defineFunction(op->word, p, pc, op->target);
+                pc = op->target;
+                lastStatus = 0;
+                break;
+        }
+    }
+    while (nloops > 0) {
+        free(loops[--nloops].words.data);
+    }
+    free(loops);
+}
+
+/*  Description:
+        Runs instructions of a program as a whole, from the shell or from a
+        function: Ctrl-C, which the shell ignores, is caught to end them,
+        and the program is kept while it runs, even if a function it
+        defined is redefined
+    Arguments:
+        p: the program
+        start: first instruction to run
+        end: instruction to stop at */
+void runCode(program_t *p, int start, int end) {
+    sigset_t intMask;
+    sigset_t oldMask;
+    catchInterrupt(&intMask, &oldMask);
+    p->refs++;
+    blocksRunning++;
+    runProgram(p, start, end);
+    if (--blocksRunning == 0) {
+        blockInterrupted = 0;
+    }
+    releaseProgram(p);
+    releaseInterrupt(&oldMask);
+}
+
+/*  Description:
+        Function for calling a shell function, with its arguments as $1, $2
+        and so on
+    Arguments:
+        tokens: array of strings representing the function's name and its
+        arguments
+    Returns:
+        the status of the last command of the function, or 1 if calls are
+        nested too deeply, which ends the commands running */
+int runFunction(char *tokens[]) {
+    if (functionDepth == MAX_FUNCTION_NESTING) {
+        fprintf(stderr, "%s: maximum function nesting exceeded\n", tokens[0]);
+        blockInterrupted = 1;
+        return 1;
+    }
+    const function_t *f = &functions[findFunction(tokens[0])];
+    char **outerPositional = positional;
+    int outerCount = npositional;
+    positional = tokens + 1;
+    for (npositional = 0; positional[npositional] != NULL; npositional++) {
+    }
+    lastStatus = 0;
+    functionDepth++;
+    runCode(f->program, f->start, f->end);
+    functionDepth--;
+    positional = outerPositional;
+    npositional = outerCount;
+    return lastStatus;
+}
+
+/*  Description:
+        Forgets the compound command being read, after a syntax error */
+void discardBlock() {
+    for (int i = 0; i < nblockLines; i++) {
+        free(blockLines[i]);
+    }
+    nblockLines = 0;
+    nblockItems = 0;
+    blockDepth = 0;
+    blockLast = KW_NONE;
+}
+
+/*  Description:
+        Adds a line to the compound command being read. It is parsed on its
+        own, not through the line cache, since the pipelines that follow
+        reserved words are changed in place.
+    Arguments:
+        text: the line, without its newline; it is not modified
+        len: length of the line
+    Returns:
+        0 on success, -1 on a syntax error (which was reported and the
+        command discarded) */
+int readBlockLine(const char *text, size_t len) {
+    parsed_line_t *line = parseText(text, len);
+    if (line == NULL) {
+        discardBlock();
+        return -1;
+    }
+    if (nblockLines == blockLinesCapacity) {
+        blockLinesCapacity =
+            blockLinesCapacity == 0 ? 16 : blockLinesCapacity * 2;
+        blockLines = (parsed_line_t **)realloc(
+            blockLines, blockLinesCapacity * sizeof(parsed_line_t *));
+        if (blockLines == NULL) {
+            perror("realloc");
             cleanup_job_list(jobList);
             exit(1);
         }
-        // Gets child PGID and sets it as controlling process group if its
-        // a foreground process
-        if (!background) {
-            pid_t pgroup;
-            if ((pgroup = getpgid(0)) == -1) {
-                perror("getpgid");
-                cleanup_job_list(jobList);
-                exit(1);
-            }
-            if (tcsetpgrp(0, pgroup) == -1) {
-                perror("tcsetpgrp");
-                cleanup_job_list(jobList);
-                exit(1);
+    }
+    blockLines[nblockLines++] = line;
+    for (int i = 0; i < line->npipelines; i++) {
+        if (splitKeywords(&line->pipelines[i]) == -1) {
+            discardBlock();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*  Description:
+        Compiles the compound command read so far and runs it, reporting a
+        reserved word it is missing
+    Returns:
+        0 on success, -1 on a syntax error */
+int finishBlock() {
+    program_t *p = (program_t *)calloc(1, sizeof(program_t));
+    if (p == NULL) {
+        perror("calloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    compiler_t c = {blockItems, nblockItems, 0, p, 0, 0};
+    keyword_t found = compileList(&c);
+    if (found != KW_NONE) {
+        keywordError(&c, found, KW_NONE);
+    }
+    if (c.failed) {
+        free(p->ops);
+        free(p);
+        discardBlock();
+        lastStatus = 2;
+        return -1;
+    }
+    // The lines now belong to the program, and another command can be read
+    // while it runs (by source or a command substitution)
+    p->lines = (parsed_line_t **)malloc(nblockLines * sizeof(parsed_line_t *));
+    if (p->lines == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    memcpy(p->lines, blockLines, nblockLines * sizeof(parsed_line_t *));
+    p->nlines = nblockLines;
+    p->refs = 1;
+    nblockLines = 0;
+    discardBlock();
+    runCode(p, 0, p->nops);
+    releaseProgram(p);
+    // Built-ins print through stdio, which is not line buffered when stdout
+    // is a pipe or file
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    return 0;
+}
+
+/*  Description:
+        Ends the copy of the shell running a command substitution: what it
+        gathered from its jobs is written to the memory file its stdout
+        already is, after what the built-ins wrote there
+    Arguments:
+        status: its exit status */
+void exitSubshell(int status) {
+    collectCapture();
+    for (size_t off = 0; off < captureBuf->len;) {
+        ssize_t count =
+            write(captureFd, captureBuf->data + off, captureBuf->len - off);
+        if (count == -1 && errno != EINTR) {
+            perror("write");
+            _exit(1);
+        }
+        off += count > 0 ? (size_t)count : 0;
+    }
+    _exit(status);
+}
+
+/*  Description:
+        Tells whether the line of a command substitution is a single call
+        of a utility that changes nothing in the shell (echo, printf, true,
+        false, test, [, pwd or cat), which then runs in the shell itself
+        rather than in a copy of it
+    Arguments:
+        line: the parsed line */
+int isPureCommand(const parsed_line_t *line) {
+    static const char *pure[] = {"echo",  "printf", "true", "false",
+                                 "test",  "[",      "pwd",  "cat"};
+    if (line->npipelines != 1 || line->keywords ||
+        line->pipelines[0].ncmds != 1 || line->pipelines[0].background) {
+        return 0;
+    }
+    const command_t *cmd = &line->pipelines[0].cmds[0];
+    if (cmd->nassigns > 0 || cmd->argv[0] == NULL ||
+        (nfunctions > 0 && findFunction(cmd->argv[0]) != -1)) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(pure) / sizeof(pure[0]); i++) {
+        if (!strcmp(cmd->argv[0], pure[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*  Description:
+        Runs the command of a command substitution in a copy of the shell,
+        so that cd, assignments, exit and jobs in it leave the shell as it
+        was. The copy is a foreground job of its own; its stdout is the
+        memory file of the capture, and the output of its own jobs is added
+        there once it is done. lastStatus is set to its exit status.
+    Arguments:
+        line: the parsed command
+        command: its text, for the jobs list and for a compound command
+        len: length of the text */
+void runSubshell(parsed_line_t *line, const char *command, size_t len) {
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        lastStatus = 1;
+        return;
+    }
+    if (pid == 0) {
+        subshell = 1;
+        // Its jobs are its own children, which the fork server's are not
+        if (spawnBackend == SPAWN_SERVER) {
+            spawnBackend = SPAWN_FORK;
+        }
+        setpgid(0, 0);
+        if (terminal && tcsetpgrp(0, getpgrp()) == -1) {
+            perror("tcsetpgrp");
+        }
+        if (!line->keywords) {
+            runLine(line);
+        } else if (readBlockLine(command, len) == 0) {
+            finishBlock();
+        }
+        exitSubshell(lastStatus);
+    }
+    setpgid(pid, pid);
+    char *text = strndup(command, len);
+    if (text == NULL || add_job(jobList, job, pid, RUNNING, text) == -1) {
+        fprintf(stderr, "Error: Could not add command substitution job.\n");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    free(text);
+    int status = waitCaptured(job);
+    if (WIFSIGNALED(status) || WIFSTOPPED(status)) {
+        job++;
+    }
+    lastStatus = exitStatus(status);
+}
+
+/*  Description:
+        Runs the command of a command substitution and gathers its output,
+        without its trailing newlines. Its stdout is moved to a memory file
+        and the command runs in a copy of the shell, or in the shell itself
+        when it is a utility that changes nothing there, which then needs no
+        fork.
+    Arguments:
+        text: the substitution, $(command) or `command` (in which a
+        backslash before $ ` or \ is removed)
+        len: its length
+        out: filled with the output, NUL terminated; to be freed
+    Returns:
+        0 on success, -1 if the command had a syntax error */
+int substitute(const char *text, size_t len, word_buf_t *out) {
+    substitutions++;
+    char *command = (char *)malloc(len);
+    if (command == NULL) {
+        perror("malloc");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    size_t n = 0;
+    if (text[0] == '`') {
+        for (size_t i = 1; i < len - 1; i++) {
+            i += text[i] == '\\' && strchr("$`\\", text[i + 1]) != NULL;
+            command[n++] = text[i];
+        }
+    } else {
+        memcpy(command, text + 2, len - 3);
+        n = len - 3;
+    }
+    parsed_line_t *line = parseLine(command, n);
+    if (line == NULL) {
+        free(command);
+        return -1;
+    }
+    // A substitution inside this one gathers its output on its own
+    capture_t outer;
+    beginCapture(out, &outer);
+    if (isPureCommand(line)) {
+        runLine(line);
+    } else {
+        runSubshell(line, command, n);
+    }
+    free(command);
+    endCapture(&outer);
+    while (out->len > 0 && out->data[out->len - 1] == '\n') {
+        out->len--;
+    }
+    appendBytes(out, "", 1);
+    return 0;
+}
+
+/*  Description:
+        Parses (through the line cache) and runs one line of input,
+        timing both steps. A line starting a compound command, and those
+        that follow until it ends, are instead read into it, which runs once
+        complete.
+    Arguments:
+        text: the line, without its newline
+        len: length of the line */
+void runText(const char *text, size_t len) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (nblockLines == 0) {
+        parsed_line_t *line = parseLine(text, len);
+        if (line == NULL || !line->keywords) {
+            addElapsed(&parseTime, &start);
+            if (line != NULL) {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                runLine(line);
+                addElapsed(&executeTime, &start);
+                linesRun++;
+            }
+            return;
+        }
+    }
+    int read = readBlockLine(text, len);
+    addElapsed(&parseTime, &start);
+    if (read == 0 && blockDepth <= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        finishBlock();
+        addElapsed(&executeTime, &start);
+        linesRun++;
+    }
+}
+
+/*  Description:
+        Runs every line of a script file. The file is mapped into memory
+        rather than read, lines are found in the mapping with memchr, and
+        each one is only parsed the first time its text is seen.
+    Arguments:
+        file: path of the script */
+void runScript(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(file);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        close(fd);
+        return;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    const char *line = map;
+    const char *end = map + size;
+    while (line < end) {
+        const char *newline = memchr(line, '\n', (size_t)(end - line));
+        if (newline == NULL) {
+            newline = end;
+        }
+        // Reaps and reports every child that changed state since the last
+        // line
+        reapChildren();
+        runText(line, (size_t)(newline - line));
+        line = newline + 1;
+    }
+    munmap(map, size);
+    // A compound command left open is missing its end
+    if (nblockLines > 0) {
+        finishBlock();
+    }
+}
+
+#ifdef BENCH
+/* Where bench prints its results: the shell's stdout from before the cases
+ * ran, since during them it goes to /dev/null */
+typedef struct bench_output {
+    FILE *file;
+    int json;
+    int rows;      // rows printed so far, to place the JSON commas
+    double bytes;  // bytes each operation of the next row handles, for its
+                   // throughput; 0 if it has none
+} bench_output_t;
+
+/*  Description:
+        Orders two samples for qsort */
+int compareSamples(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*  Description:
+        Returns the nanoseconds since start */
+double benchNs(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e9 +
+           (double)(now.tv_nsec - start->tv_nsec);
+}
+
+/*  Description:
+        Prints one benchmark result as a CSV row or JSON object: the mean,
+        median, 90th and 99th percentile (nearest rank) and maximum of its
+        samples, and the throughput in MB/s at the mean when the case set
+        out->bytes (which is then reset)
+    Arguments:
+        name: the benchmark case
+        param: what the case was run with (job count, line length), or 0
+        samples: time per operation of each sample, in nanoseconds; sorted
+        n: number of samples
+        out: where to print */
+void benchReport(const char *name, long param, double *samples, int n,
+                 bench_output_t *out) {
+    qsort(samples, n, sizeof(double), compareSamples);
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+    double p50 = samples[(n * 50 + 99) / 100 - 1];
+    double p90 = samples[(n * 90 + 99) / 100 - 1];
+    double p99 = samples[(n * 99 + 99) / 100 - 1];
+    // Bytes per nanosecond times 1000 is MB per second
+    char rate[32] = "";
+    if (out->bytes > 0) {
+        snprintf(rate, sizeof(rate), "%.1f", out->bytes * 1e3 / (sum / n));
+    }
+    int ret;
+    if (out->json) {
+        ret = fprintf(out->file,
+                      "%s\n  {\"case\": \"%s\", \"param\": %ld, \"samples\": "
+                      "%d, \"mean_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": "
+                      "%.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, \"mb_s\": "
+                      "%s}",
+                      out->rows > 0 ? "," : "", name, param, n, sum / n, p50,
+                      p90, p99, samples[n - 1],
+                      rate[0] != '\0' ? rate : "null");
+    } else {
+        ret = fprintf(out->file, "%s,%ld,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%s\n",
+                      name, param, n, sum / n, p50, p90, p99, samples[n - 1],
+                      rate);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "Error: Could not print benchmark result.\n");
+    }
+    out->rows++;
+    out->bytes = 0;
+}
+
+/*  Description:
+        Times launching and waiting for /bin/true through execute, with
+        each spawn backend (the fork server being started if need be), then
+        the pipeline echo x | cat started by the shell against the same
+        pipeline run by sh -c */
+void benchLaunch(double *samples, int n, bench_output_t *out) {
+    char *argv[] = {"true", NULL};
+    command_t cmd = {.argv = argv};
+    int backend = spawnBackend;
+    static const char *names[] = {"launch-fork", "launch-posix_spawn",
+                                  "launch-server"};
+    for (int b = SPAWN_FORK; b <= SPAWN_SERVER; b++) {
+        if (b == SPAWN_SERVER && serverFd == -1 && startServer() == -1) {
+            break;
+        }
+        spawnBackend = b;
+        for (int i = 0; i < n; i++) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            execute(&cmd, 1, 0);
+            samples[i] = benchNs(&start);
+        }
+        benchReport(names[b], 0, samples, n, out);
+    }
+    spawnBackend = backend;
+    // The same two-stage pipeline, started by the shell and by sh -c
+    char *echoArgv[] = {"echo", "x", NULL};
+    char *catArgv[] = {"cat", NULL};
+    char *shArgv[] = {"sh", "-c", "echo x | cat", NULL};
+    command_t pipeline[] = {{.argv = echoArgv}, {.argv = catArgv}};
+    command_t shell = {.argv = shArgv};
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        execute(pipeline, 2, 0);
+        samples[i] = benchNs(&start);
+    }
+    benchReport("launch-pipe", 2, samples, n, out);
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        execute(&shell, 1, 0);
+        samples[i] = benchNs(&start);
+    }
+    benchReport("launch-sh-c", 2, samples, n, out);
+}
+
+/*  Description:
+        Times parse on a short line using every kind of token, then on
+        synthetic lines of 4 KiB and 64 KiB made of quoted words, escapes
+        and operators, in batches holding about as many bytes as
+        BENCH_BATCH short lines, reporting the throughput of each */
+void benchParse(double *samples, int n, bench_output_t *out) {
+    static const char line[] =
+        "cat < in.txt | grep -v 'foo bar' | sort -u > out.txt && "
+        "echo \"done here\" ; ls -l /tmp >> log || true &";
+    static const char segment[] =
+        "printf \"%s: \\\"%d\\\"\\n\" 'single | quoted ; text' plain\\ word "
+        "\"mixed 'inner' quotes\" | grep -v 'a b' >> out.txt && ";
+    static const size_t sizes[] = {sizeof(line) - 1, 4096, 65536};
+    for (int k = 0; k < 3; k++) {
+        // The line, then the scratch space parse needs for it
+        word_buf_t text = {NULL, 0, 0};
+        if (k == 0) {
+            appendBytes(&text, line, sizeof(line) - 1);
+        } else {
+            while (text.len + sizeof(segment) - 1 + 4 <= sizes[k]) {
+                appendBytes(&text, segment, sizeof(segment) - 1);
             }
+            appendBytes(&text, "true", 4);
         }
-        // Reinstates default signal handling behavior
-        if (signal(SIGINT, SIG_DFL) == SIG_ERR) {
-            perror("signal");
+        size_t len = text.len;
+        appendBytes(&text, "", 1);
+        char *buf = (char *)malloc(len + 1);
+        char **argv = (char **)malloc((len + 1) * sizeof(char *));
+        command_t *cmds = (command_t *)malloc((len + 1) * sizeof(command_t));
+        redirect_t *redirects =
+            (redirect_t *)malloc((len + 1) * sizeof(redirect_t));
+        pipeline_t *pipelines =
+            (pipeline_t *)malloc((len + 1) * sizeof(pipeline_t));
+        if (buf == NULL || argv == NULL || cmds == NULL || redirects == NULL ||
+            pipelines == NULL) {
+            perror("malloc");
             cleanup_job_list(jobList);
             exit(1);
         }
-        if (signal(SIGTSTP, SIG_DFL) == SIG_ERR) {
-            perror("signal");
-            cleanup_job_list(jobList);
-            exit(1);
+        int batch = (int)(BENCH_BATCH * (sizeof(line) - 1) / len);
+        batch = batch > 0 ? batch : 1;
+        int npipelines;
+        for (int i = 0; i < n; i++) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int j = 0; j < batch; j++) {
+                memcpy(buf, text.data, len + 1);
+                parse(buf, argv, cmds, redirects, pipelines, &npipelines);
+            }
+            samples[i] = benchNs(&start) / batch;
         }
-        if (signal(SIGQUIT, SIG_DFL) == SIG_ERR) {
-            perror("signal");
-            cleanup_job_list(jobList);
-            exit(1);
+        out->bytes = (double)len;
+        benchReport("parse", (long)len, samples, n, out);
+        free(text.data);
+        free(buf);
+        free(argv);
+        free(cmds);
+        free(redirects);
+        free(pipelines);
+    }
+}
+
+/*  Description:
+        Times looking names up in the built-in table, half of them built-ins,
+        and running the true built-in through runPipeline */
+void benchDispatch(double *samples, int n, bench_output_t *out) {
+    static const char *names[] = {"cd",  "echo",  "ls", "grep",
+                                  "[",   "sleep", "sort", "cat"};
+    const builtin_t *volatile found = NULL;
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0; j < BENCH_BATCH; j++) {
+            found = findBuiltin(names[j & 7]);
         }
-        if (signal(SIGTTOU, SIG_DFL) == SIG_ERR) {
-            perror("signal");
-            cleanup_job_list(jobList);
-            exit(1);
+        samples[i] = benchNs(&start) / BENCH_BATCH;
+    }
+    (void)found;
+    benchReport("dispatch-lookup", 0, samples, n, out);
+    char *argv[] = {"true", NULL};
+    command_t cmd = {.argv = argv};
+    pipeline_t pl = {&cmd, 1, 0, TOK_SEMI};
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int j = 0; j < BENCH_BATCH; j++) {
+            runPipeline(&pl);
         }
-        /* Converts path in argv[0] to just the last branch of path and saves in
-         * argv[0] */
-        char *path = strrchr(argv[0], '/');
-        if (path != NULL && (path + 1) != NULL) {
-            argv[0] = (path + 1);
+        samples[i] = benchNs(&start) / BENCH_BATCH;
+    }
+    benchReport("dispatch-true", 0, samples, n, out);
+}
+
+/*  Description:
+        Times reapChildren reaping one exited child while jobList holds
+        increasing numbers of other jobs. The other jobs have PIDs above any
+        the kernel hands out, so they are never signalled or reaped. */
+void benchReap(double *samples, int n, bench_output_t *out) {
+    static const int counts[] = {1, 100, 10000};
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < counts[c]; k++) {
+            add_job(jobList, BENCH_JID + 1 + k, BENCH_PID + k, RUNNING,
+                    "bench");
         }
-        /* Redirects file descriptor 0 to input */
-        if (input != NULL) {
-            if (close(0) == -1) {
-                perror("close");
+        for (int i = 0; i < n; i++) {
+            pid_t pid = fork();
+            if (pid == -1) {
+                perror("fork");
                 cleanup_job_list(jobList);
                 exit(1);
             }
-            if (open(input, O_RDONLY) == -1) {
-                perror("open");
-                cleanup_job_list(jobList);
-                exit(1);
+            if (pid == 0) {
+                _exit(0);
             }
+            add_job(jobList, BENCH_JID, pid, RUNNING, "bench");
+            // Waits for the SIGCHLD before timing the reaping itself
+            struct pollfd chld = {sigchldFd, POLLIN, 0};
+            poll(&chld, 1, -1);
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            reapChildren();
+            samples[i] = benchNs(&start);
         }
-        /* Redirects file descriptor 1 to output */
-        if (output != NULL) {
-            if (close(1) == -1) {
-                perror("close");
-                cleanup_job_list(jobList);
-                exit(1);
+        for (int k = 0; k < counts[c]; k++) {
+            remove_job_jid(jobList, BENCH_JID + 1 + k);
+        }
+        benchReport("reap", counts[c], samples, n, out);
+    }
+}
+
+/*  Description:
+        Times adding, looking up and removing jobs in job lists of
+        increasing size, per operation */
+void benchJobs(double *samples, int n, bench_output_t *out) {
+    static const int counts[] = {100, 10000, 100000};
+    for (int c = 0; c < 3; c++) {
+        int count = counts[c];
+        double *ops[3] = {samples, samples + n, samples + 2 * n};
+        for (int i = 0; i < n; i++) {
+            job_list_t *list = init_job_list();
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int k = 0; k < count; k++) {
+                add_job(list, k + 1, BENCH_PID + k, RUNNING, "bench job");
             }
-            /* Checks which of >> or > was specified and responds accordingly */
-            if (append) {
-                if (open(output, O_WRONLY | O_CREAT | O_APPEND, 0666) == -1) {
-                    perror("open");
-                    cleanup_job_list(jobList);
-                    exit(1);
-                }
-            } else {
-                if (open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666) == -1) {
-                    perror("open");
-                    cleanup_job_list(jobList);
-                    exit(1);
-                }
+            ops[0][i] = benchNs(&start) / count;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            // Strides through the PIDs so lookups do not follow the table
+            for (int k = 0; k < count; k++) {
+                get_job_jid(list, BENCH_PID + (int)((k * 7919L) % count));
+            }
+            ops[1][i] = benchNs(&start) / count;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (int k = 0; k < count; k++) {
+                remove_job_pid(list, BENCH_PID + k);
             }
+            ops[2][i] = benchNs(&start) / count;
+            cleanup_job_list(list);
         }
-        /*  Executes program in new process image with filepath being the full
-            file path, and argv[0] now containing only the file binary name */
-        execv(filepath, argv);
-        /* We wonâ€™t get here unless execv failed, meaning an error occurred */
-        perror("execv");
-        cleanup_job_list(jobList);
-        exit(1);
+        benchReport("jobs-add", count, ops[0], n, out);
+        benchReport("jobs-lookup", count, ops[1], n, out);
+        benchReport("jobs-remove", count, ops[2], n, out);
     }
-    // Body of parent process:
-    // Increments jobID counter if background process was forked and prints
-    // jobID and processID of background job and adds it to job list
-    if (background) {
-        if (printf("[%d] (%d)\n", job, childPID) < 0) {
-            fprintf(stderr, "Error: Could not print job and process id.\n");
-            return;
-        }
-        add_job(jobList, job, childPID, RUNNING, filepath);
-        job++;
-    } else {
-        /*  Waits for child to finish running before continuing unless supplied
-            the background argument as 1, in which case it doesn't wait */
-        int status;
-        int waitReturn = waitpid(childPID, &status, WUNTRACED);
-        if (waitReturn == -1) {
-            perror("waitpid");
-            cleanup_job_list(jobList);
-            exit(1);
+}
+
+/*  Description:
+        Times writing BENCH_FANOUT bytes to two files, through a relay
+        (head > /dev/null > /dev/null) and through tee(1) (head | tee
+        /dev/null > /dev/null), at most 5 samples each */
+void benchFanout(double *samples, int n, bench_output_t *out) {
+    char count[32];
+    snprintf(count, sizeof(count), "%ld", BENCH_FANOUT);
+    char *headArgv[] = {"head", "-c", count, "/dev/zero", NULL};
+    char *teeArgv[] = {"tee", "/dev/null", NULL};
+    redirect_t tee = {"/dev/null", 0};
+    command_t relay = {
+        .argv = headArgv, .output = "/dev/null", .tees = &tee, .ntees = 1};
+    command_t pipeline[] = {{.argv = headArgv},
+                            {.argv = teeArgv, .output = "/dev/null"}};
+    n = n < 5 ? n : 5;
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        execute(&relay, 1, 0);
+        samples[i] = benchNs(&start);
+    }
+    benchReport("fanout-splice", BENCH_FANOUT, samples, n, out);
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        execute(pipeline, 2, 0);
+        samples[i] = benchNs(&start);
+    }
+    benchReport("fanout-tee", BENCH_FANOUT, samples, n, out);
+}
+
+/*  Description:
+        Times a request to a coprocess, cat, started once (sending a line
+        with echo >&NAME and reading the reply with coproc -r) against
+        starting echo as a program for each one */
+void benchCoproc(double *samples, int n, bench_output_t *out) {
+    char *startArgv[] = {"coproc", "BENCH", "cat", NULL};
+    char *echoArgv[] = {"echo", "request", NULL};
+    char *readArgv[] = {"coproc", "-r", "BENCH", NULL};
+    char *closeArgv[] = {"coproc", "-c", "BENCH", NULL};
+    command_t start = {.argv = startArgv};
+    command_t send = {
+        .argv = echoArgv, .output = "BENCH", .coproc = COPROC_OUT};
+    command_t reply = {.argv = readArgv};
+    pipeline_t pl = {&start, 1, 0, TOK_SEMI};
+    // The coprocess's job, waited for once its input is closed
+    char jobSpec[16];
+    snprintf(jobSpec, sizeof(jobSpec), "%%%d", job);
+    char *waitArgv[] = {"wait", jobSpec, NULL};
+    if (runPipeline(&pl) != 0) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pl.cmds = &send;
+        runPipeline(&pl);
+        pl.cmds = &reply;
+        runPipeline(&pl);
+        samples[i] = benchNs(&start);
+    }
+    coprocCommand(closeArgv);
+    waitJobs(waitArgv);
+    benchReport("coproc-warm", 0, samples, n, out);
+    command_t cold = {.argv = echoArgv};
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        execute(&cold, 1, 0);
+        samples[i] = benchNs(&start);
+    }
+    benchReport("coproc-cold", 0, samples, n, out);
+}
+
+/*  Description:
+        Times expanding patterns in a directory of BENCH_GLOB_FILES files,
+        half of them .log and half .txt, with globWord and glob(3): a single
+        * (the literal suffix fast path) and a general pattern, at most 5
+        samples each */
+void benchGlob(double *samples, int n, bench_output_t *out) {
+    char dir[] = "/tmp/33sh-glob-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return;
+    }
+    char name[64];
+    for (int k = 0; k < BENCH_GLOB_FILES; k++) {
+        snprintf(name, sizeof(name), "%s/f%06d.%s", dir, k,
+                 k % 2 ? "txt" : "log");
+        int fd = open(name, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            perror("open");
+            break;
         }
-        // Checks waitpid status update and prints out informative message if
-        // child process was terminated or suspended by a signal
-        if (WIFSIGNALED(status)) {
-            int signalNum = WTERMSIG(status);
-            if (printf("[%d] (%d) terminated by signal %d\n", job, childPID,
-                       signalNum) < 0) {
-                fprintf(stderr,
-                        "Error: Could not print signal terminated process "
-                        "message.\n");
-                return;
+        close(fd);
+    }
+    static const char *patterns[] = {"*.log", "f1?2*[0-4].txt"};
+    static const char *names[] = {"glob-star", "glob-star-libc",
+                                  "glob-pattern", "glob-pattern-libc"};
+    n = n < 5 ? n : 5;
+    for (int p = 0; p < 2; p++) {
+        char pattern[64];
+        snprintf(pattern, sizeof(pattern), "%s/%s", dir, patterns[p]);
+        for (int libc = 0; libc < 2; libc++) {
+            for (int i = 0; i < n; i++) {
+                struct timespec start;
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                if (libc) {
+                    glob_t g;
+                    glob(pattern, 0, NULL, &g);
+                    globfree(&g);
+                } else {
+                    word_buf_t words = {NULL, 0, 0};
+                    globWord(pattern, &words);
+                    free(words.data);
+                }
+                samples[i] = benchNs(&start);
             }
-            job++;
+            benchReport(names[p * 2 + libc], BENCH_GLOB_FILES, samples, n,
+                        out);
         }
-        if (WIFSTOPPED(status)) {
-            int signalNum = WSTOPSIG(status);
-            if (printf("[%d] (%d) suspended by signal %d\n", job, childPID,
-                       signalNum) < 0) {
-                fprintf(stderr,
-                        "Error: Could not print signal suspended process "
-                        "message.\n");
-                return;
-            }
-            add_job(jobList, job, childPID, STOPPED, filepath);
-            job++;
+    }
+    for (int k = 0; k < BENCH_GLOB_FILES; k++) {
+        snprintf(name, sizeof(name), "%s/f%06d.%s", dir, k,
+                 k % 2 ? "txt" : "log");
+        unlink(name);
+    }
+    rmdir(dir);
+}
+
+/*  Description:
+        Times the command substitutions $(echo x), run by the echo built-in
+        in the shell itself, and $(/bin/echo x), which starts a process */
+void benchSubstitute(double *samples, int n, bench_output_t *out) {
+    static const char *texts[] = {"$(echo x)", "$(/bin/echo x)"};
+    static const char *names[] = {"substitute-builtin", "substitute-exec"};
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < n; i++) {
+            word_buf_t output = {NULL, 0, 0};
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            substitute(texts[t], strlen(texts[t]), &output);
+            samples[i] = benchNs(&start);
+            free(output.data);
         }
-        // Gets PID of main REPL (calling process) and sets it
-        // back as controlling process group
-        pid_t pgroup;
-        if ((pgroup = getpgrp()) == -1) {
-            perror("getpgrp");
-            cleanup_job_list(jobList);
-            exit(1);
+        benchReport(names[t], 0, samples, n, out);
+    }
+}
+
+/*  Description:
+        Times a for loop over BENCH_LOOP words running the true and echo
+        built-ins, compiled once, against as many lines of true, each looked
+        up in the line cache, per iteration and at most 5 samples each */
+void benchLoop(double *samples, int n, bench_output_t *out) {
+    static const char *texts[] = {"for i in $BENCH_WORDS; do true; done",
+                                  "for i in $BENCH_WORDS; do echo $i; done"};
+    static const char *names[] = {"loop-true", "loop-echo"};
+    word_buf_t words = {NULL, 0, 0};
+    for (int k = 0; k < BENCH_LOOP; k++) {
+        char word[16];
+        appendBytes(&words, word,
+                    (size_t)snprintf(word, sizeof(word), "%d ", k));
+    }
+    appendBytes(&words, "", 1);
+    setVar("BENCH_WORDS", 11, words.data, 0);
+    free(words.data);
+    n = n < 5 ? n : 5;
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < n; i++) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            runText(texts[t], strlen(texts[t]));
+            samples[i] = benchNs(&start) / BENCH_LOOP;
         }
-        if (tcsetpgrp(0, pgroup) == -1) {
-            perror("tcsetpgrp");
-            cleanup_job_list(jobList);
-            exit(1);
+        benchReport(names[t], 0, samples, n, out);
+    }
+    for (int i = 0; i < n; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int k = 0; k < BENCH_LOOP; k++) {
+            runText("true", 4);
         }
+        samples[i] = benchNs(&start) / BENCH_LOOP;
     }
+    benchReport("loop-lines", 0, samples, n, out);
+    unsetVar("BENCH_WORDS", 11);
 }
 
-/*  Description: sets up REPL as a command line for user input,
-    parses these commands and executes while handling errors,
-    exits upon control-D */
-int main() {
-    ssize_t status;
-    // Initializes jobList
-    jobList = init_job_list();
-    /* REPL while loop */
-    while (1) {
-        /* Blocks signals in shell REPL */
-        if (signal(SIGINT, SIG_IGN) == SIG_ERR) {
-            perror("signal");
-            cleanup_job_list(jobList);
-            exit(1);
+/*  Description:
+        Times the buffered reader the REPL reads stdin with, splitting
+        BENCH_READER_LINES lines read from a memory file put on stdin, per
+        line */
+void benchReader(double *samples, int n, bench_output_t *out) {
+    static const char line[] =
+        "cat < in.txt | grep -v 'foo bar' | sort -u > out.txt\n";
+    word_buf_t input = {NULL, 0, 0};
+    for (int k = 0; k < BENCH_READER_LINES; k++) {
+        appendBytes(&input, line, sizeof(line) - 1);
+    }
+    int fd = memfd_create("reader", MFD_CLOEXEC);
+    int saved = -1;
+    if (fd == -1 || write(fd, input.data, input.len) != (ssize_t)input.len ||
+        replaceFd(0, fcntl(fd, F_DUPFD_CLOEXEC, 10), &saved) == -1) {
+        perror("bench reader");
+        free(input.data);
+        if (fd != -1) {
+            close(fd);
         }
-        if (signal(SIGTSTP, SIG_IGN) == SIG_ERR) {
-            perror("signal");
-            cleanup_job_list(jobList);
-            exit(1);
+        return;
+    }
+    free(input.data);
+    for (int i = 0; i < n; i++) {
+        lseek(fd, 0, SEEK_SET);
+        line_reader_t reader = {(char *)malloc(BUFSIZE), BUFSIZE, 0, 0, 0, 0};
+        if (reader.buf == NULL) {
+            perror("malloc");
+            break;
         }
-        if (signal(SIGQUIT, SIG_IGN) == SIG_ERR) {
-            perror("signal");
-            cleanup_job_list(jobList);
-            exit(1);
+        size_t len;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            fillReader(&reader);
+            while (readLine(&reader, &len) != NULL) {
+            }
+        } while (!reader.eof);
+        samples[i] = benchNs(&start) / BENCH_READER_LINES;
+        free(reader.buf);
+    }
+    restoreFd(0, saved);
+    close(fd);
+    out->bytes = sizeof(line) - 1;
+    benchReport("reader", BENCH_READER_LINES, samples, n, out);
+}
+
+/*  Description:
+        Function for benchmarking the shell's hot paths: launching a process
+        through execute, parse, built-in dispatch, reaping with many jobs,
+        the jobs.c operations, writing to several files, requests to a
+        coprocess, globbing, command substitution, compiled loops and the
+        input reader. Each
+        case is run a number of times and summarized with percentiles in CSV
+        or JSON. The shell's own output during the cases (job notices) is
+        sent to /dev/null.
+    Arguments:
+        tokens: array of strings representing bench command, optionally -n
+        followed by the number of samples per case and -f followed by csv or
+        json, then the cases to run: launch, parse, dispatch, reap, jobs,
+        fanout, coproc, glob, substitute, loop or reader (all of them by
+        default)
+    Returns:
+        0 on success, 1 on error */
+int benchmark(char *tokens[]) {
+    static const char *caseNames[] = {"launch", "parse",  "dispatch",
+                                      "reap",   "jobs",   "fanout",
+                                      "coproc", "glob",   "substitute",
+                                      "loop",   "reader"};
+    static void (*cases[])(double *, int, bench_output_t *) = {
+        benchLaunch, benchParse,  benchDispatch, benchReap,
+        benchJobs,   benchFanout, benchCoproc,   benchGlob,
+        benchSubstitute, benchLoop, benchReader};
+    const int ncases = (int)(sizeof(cases) / sizeof(cases[0]));
+    int n = 100;
+    int json = 0;
+    int i = 1;
+    for (; tokens[i] != NULL && tokens[i][0] == '-'; i += 2) {
+        if (!strcmp(tokens[i], "-n") && tokens[i + 1] != NULL &&
+            atoi(tokens[i + 1]) > 0) {
+            n = atoi(tokens[i + 1]);
+        } else if (!strcmp(tokens[i], "-f") && tokens[i + 1] != NULL &&
+                   (!strcmp(tokens[i + 1], "csv") ||
+                    !strcmp(tokens[i + 1], "json"))) {
+            json = !strcmp(tokens[i + 1], "json");
+        } else {
+            fprintf(stderr, "bench: syntax error\n");
+            return 1;
         }
-        if (signal(SIGTTOU, SIG_IGN) == SIG_ERR) {
-            perror("signal");
-            cleanup_job_list(jobList);
-            exit(1);
+    }
+    int selected[sizeof(cases) / sizeof(cases[0])];
+    for (int c = 0; c < ncases; c++) {
+        selected[c] = tokens[i] == NULL;
+    }
+    for (; tokens[i] != NULL; i++) {
+        int c = 0;
+        while (c < ncases && strcmp(tokens[i], caseNames[c])) {
+            c++;
         }
-        // Iterates through jobList and reaps terminated processes
-        pid_t pid;
-        while ((pid = get_next_pid(jobList)) != -1) {
-            int status;
-            int waitReturn =
-                waitpid(pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
-            if (waitReturn == -1) {
-                perror("waitpid");
-                cleanup_job_list(jobList);
-                exit(1);
-            }
-            // Checks waitpid status update and prints out informative message
-            // if child process was terminated or updates status accordingly
-            if (waitReturn != 0) {
-                if (WIFEXITED(status)) {
-                    int signalNum = WEXITSTATUS(status);
-                    if (printf("[%d] (%d) terminated with exit status %d\n",
-                               get_job_jid(jobList, pid), pid, signalNum) < 0) {
-                        fprintf(stderr,
-                                "Error: Could not print signal terminated "
-                                "process message.\n");
-                        cleanup_job_list(jobList);
-                        exit(1);
-                    }
-                    remove_job_pid(jobList, pid);
-                }
-                if (WIFSIGNALED(status)) {
-                    int signalNum = WTERMSIG(status);
-                    if (printf("[%d] (%d) terminated by signal %d\n",
-                               get_job_jid(jobList, pid), pid, signalNum) < 0) {
-                        fprintf(stderr,
-                                "Error: Could not print signal terminated "
-                                "process message.\n");
-                        cleanup_job_list(jobList);
-                        exit(1);
-                    }
-                    remove_job_pid(jobList, pid);
-                }
-                if (WIFSTOPPED(status)) {
-                    int signalNum = WSTOPSIG(status);
-                    if (printf("[%d] (%d) suspended by signal %d\n",
-                               get_job_jid(jobList, pid), pid, signalNum) < 0) {
-                        fprintf(stderr,
-                                "Error: Could not print signal suspended "
-                                "process message.\n");
-                        cleanup_job_list(jobList);
-                        exit(1);
-                    }
-                    update_job_pid(jobList, pid, STOPPED);
-                }
-                if (WIFCONTINUED(status)) {
-                    if (printf("[%d] (%d) resumed\n", get_job_jid(jobList, pid),
-                               pid) < 0) {
-                        fprintf(stderr,
-                                "Error: Could not print process resumed "
-                                "message.\n");
-                        cleanup_job_list(jobList);
-                        exit(1);
-                    }
-                    update_job_pid(jobList, pid, RUNNING);
-                }
-            }
+        if (c == ncases) {
+            fprintf(stderr, "bench: unknown case %s\n", tokens[i]);
+            return 1;
         }
-        /* Setup buffer */
-        char buffer[BUFSIZE];
-        for (int i = 0; i < 1024; i++) {
-            buffer[i] = '\0';
+        selected[c] = 1;
+    }
+    // Room for the three operations of benchJobs
+    double *samples = (double *)malloc(3 * n * sizeof(double));
+    if (samples == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    // The cases print job notices and the like, which are dropped
+    bench_output_t out = {NULL, json, 0, 0};
+    int savedOut;
+    if (fflush(stdout) < 0 ||
+        redirectBuiltin(1, "/dev/null", O_WRONLY, &savedOut) == -1) {
+        free(samples);
+        return 1;
+    }
+    int outFd = savedOut == -1 ? -1 : fcntl(savedOut, F_DUPFD_CLOEXEC, 10);
+    out.file = outFd == -1 ? NULL : fdopen(outFd, "w");
+    if (out.file == NULL) {
+        perror("fdopen");
+        free(samples);
+        restoreFd(1, savedOut);
+        return 1;
+    }
+    if ((json ? fprintf(out.file, "[")
+              : fprintf(out.file, "case,param,samples,mean_ns,p50_ns,"
+                                  "p90_ns,p99_ns,max_ns,mb_s\n")) < 0) {
+        fprintf(stderr, "Error: Could not print benchmark result.\n");
+    }
+    for (int c = 0; c < ncases; c++) {
+        if (selected[c]) {
+            cases[c](samples, n, &out);
+            fflush(out.file);
         }
+    }
+    if (json && fprintf(out.file, "\n]\n") < 0) {
+        fprintf(stderr, "Error: Could not print benchmark result.\n");
+    }
+    fclose(out.file);
+    if (fflush(stdout) < 0) {
+        clearerr(stdout);
+    }
+    restoreFd(1, savedOut);
+    free(samples);
+    return 0;
+}
+#endif
+
+/*  Description:
+        Displays the command-line prompt when built with the PROMPT flag */
+void showPrompt() {
 /* Handles PROMPT flag and displays the command-line prompt */
 #ifdef PROMPT
-        if (printf("33sh> ") < 0) {
-            fprintf(stderr, "Error: Could not print REPL prompt in terminal\n");
+    if (printf(nblockLines > 0 ? "> " : "33sh> ") < 0) {
+        fprintf(stderr, "Error: Could not print REPL prompt in terminal\n");
+    }
+    promptShown = 1;
+#endif
+    promptCovered = 0;
+    if (fflush(stdout) < 0) {
+        perror("fflush");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+}
+
+/*  Description:
+        Adds a file descriptor to the event loop's epoll instance
+    Arguments:
+        epollFd: the epoll instance
+        fd: descriptor to wait on for input
+    Returns:
+        0 on success, -1 if fd cannot be polled (a regular file) */
+int watchFd(int epollFd, int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data = {.fd = fd}};
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        if (errno == EPERM) {
+            return -1;
         }
-        if (fflush(stdout) < 0) {
-            perror("fflush");
+        perror("epoll_ctl");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    return 0;
+}
+
+/*  Description:
+        REPL built around one epoll instance watching stdin, the SIGCHLD
+        signalfd and a timer. Lines are run as soon as they are complete,
+        background jobs are reported as soon as they change state, even
+        while the prompt waits for input, and the prompt is drawn again
+        under the notices once children have been quiet for NOTICE_QUIET_MS,
+        so a burst of completions redraws it once. Nothing but epoll_wait
+        blocks: stdin is only read once it has data.
+    Arguments:
+        reader: the reader stdin is read into */
+void runEventLoop(line_reader_t *reader) {
+    int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (epollFd == -1 || timerFd == -1) {
+        perror(epollFd == -1 ? "epoll_create1" : "timerfd_create");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    watchFd(epollFd, sigchldFd);
+    watchFd(epollFd, timerFd);
+    // A regular file cannot be polled, but is always ready to be read
+    int inputPolled = watchFd(epollFd, 0) == 0;
+    showPrompt();
+    while (1) {
+        // Runs every complete line read so far
+        size_t len;
+        char *buffer;
+        while ((buffer = readLine(reader, &len)) != NULL) {
+            promptShown = 0;
+            runText(buffer, len);
+            // Reports jobs that changed state while the line ran
+            reapChildren();
+            showPrompt();
+        }
+        // Exits the loop upon control-D or end of input
+        if (reader->eof) {
+            break;
+        }
+        if (!inputPolled) {
+            fillReader(reader);
+            continue;
+        }
+        // Queued jobs waiting on the load average are checked every second
+        struct epoll_event events[3];
+        int n = epoll_wait(epollFd, events, 3,
+                           queueCount > 0 && loadLimit > 0 ? 1000 : -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
             cleanup_job_list(jobList);
             exit(1);
         }
-#endif
-        /*  Reads stdin input to buffer for parsing, handles errors, and
-            exits while loop upon control-D */
-        status = read(0, buffer, 1024);
-        if (status > 0) {
-            /* Sets up arguments for parse */
-            char *argv[status];
-            char *input = NULL;
-            char *output = NULL;
-            int append = 0;
-            int background = 0;
-            for (int i = 0; i < status; i++) {
-                argv[i] = NULL;
-            }
-            /* Calls parse */
-            parse(buffer, argv, &input, &output, &append, &background);
-            if (argv[0] == NULL) {
-                continue;
+        if (n == 0) {
+            admitJobs();
+            if (promptCovered) {
+                showPrompt();
             }
-            /* Checks for built-in calls */
-            if (!strcmp(argv[0], "cd")) {
-                changeDir(argv);
-            } else if (!strcmp(argv[0], "ln")) {
-                addLink(argv);
-            } else if (!strcmp(argv[0], "rm")) {
-                removeLink(argv);
-            } else if (!strcmp(argv[0], "exit")) {
-                exitHelper(argv);
-            } else if (!strcmp(argv[0], "jobs")) {
-                printJobs(argv);
-            } else if (!strcmp(argv[0], "fg")) {
-                fg(argv);
-            } else if (!strcmp(argv[0], "bg")) {
-                bg(argv);
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == 0) {
+                fillReader(reader);
+            } else if (fd == sigchldFd) {
+                reapChildren();
+                if (fflush(stdout) < 0) {
+                    perror("fflush");
+                    cleanup_job_list(jobList);
+                    exit(1);
+                }
+                // Redraws the prompt once the burst is over
+                if (promptCovered) {
+                    struct itimerspec quiet = {
+                        {0, 0}, {0, NOTICE_QUIET_MS * 1000000L}};
+                    timerfd_settime(timerFd, 0, &quiet, NULL);
+                }
             } else {
-                /* Calls function to fork a child to run command */
-                execute(argv, input, output, append, background);
+                uint64_t expirations;
+                if (read(timerFd, &expirations, sizeof(expirations)) > 0 &&
+                    promptCovered) {
+                    showPrompt();
+                }
             }
-        } else if (status == -1) {
-            perror("read");
+        }
+    }
+    close(timerFd);
+    close(epollFd);
+}
+
+/*  Description: sets up REPL as a command line for user input,
+    parses these commands and executes while handling errors,
+    exits upon control-D. Given a script file it runs that instead, and
+    with -t it reports the time spent parsing and executing lines on exit.
+    Usage: 33sh [-t] [script] */
+int main(int argc, char *argv[]) {
+    if (argc == 2 && !strcmp(argv[1], FORK_SERVER_ARG)) {
+        return runServer(3);
+    }
+    // Handles the command line
+    int timing = 0;
+    char *script = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t")) {
+            timing = 1;
+        } else if (script == NULL) {
+            script = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [-t] [script]\n", argv[0]);
+            return 1;
+        }
+    }
+    // Initializes jobList and the variables
+    jobList = init_job_list();
+    importEnvironment();
+    terminal = script == NULL && isatty(0);
+    // Blocks SIGCHLD and receives it through a signalfd instead
+    sigset_t chldMask;
+    sigemptyset(&chldMask);
+    sigaddset(&chldMask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chldMask, &shellMask) == -1) {
+        perror("sigprocmask");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    if ((sigchldFd = signalfd(-1, &chldMask, SFD_NONBLOCK | SFD_CLOEXEC)) ==
+        -1) {
+        perror("signalfd");
+        cleanup_job_list(jobList);
+        exit(1);
+    }
+    // The shell ignores the job control signals once and for all; children
+    // restore the defaults before they exec
+    ignoreSignals();
+    if (script != NULL) {
+        runScript(script);
+    } else {
+        line_reader_t reader = {(char *)malloc(BUFSIZE), BUFSIZE, 0, 0, 0, 0};
+        if (reader.buf == NULL) {
+            perror("malloc");
             cleanup_job_list(jobList);
             exit(1);
-        } else {
-            break;
         }
+        runEventLoop(&reader);
+        free(reader.buf);
+    }
+    if (nblockLines > 0) {
+        finishBlock();
+    }
+    if (timing) {
+        fprintf(stderr,
+                "%ld lines run, %ld parsed: parse %ld.%06lds, execute "
+                "%ld.%06lds\n",
+                linesRun, linesParsed, (long)parseTime.tv_sec,
+                parseTime.tv_nsec / 1000, (long)executeTime.tv_sec,
+                executeTime.tv_nsec / 1000);
     }
     cleanup_job_list(jobList);
     return 0;
-}
\ No newline at end of file
+}
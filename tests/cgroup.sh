@@ -0,0 +1,48 @@
+#!/bin/sh
+# Checks limit -g against a local cgroup v2 hierarchy: the job has to run in
+# the cgroup, created by the shell, and with -m the cgroup's memory.max has to
+# be set. Skipped when no cgroup v2 hierarchy is mounted writable.
+#
+# usage: tests/cgroup.sh [shell]    (default ./33noprompt)
+
+shell=${1:-./33noprompt}
+root=$(awk '$3 == "cgroup2" { print $2; exit }' /proc/mounts)
+if [ -z "$root" ] || [ ! -w "$root" ]; then
+    echo "SKIP: no writable cgroup v2 hierarchy"
+    exit 0
+fi
+name=33sh-test-$$
+group=$root/$name
+status=0
+
+# Runs one command line in the shell, printing its output
+run() {
+    printf '%s\n' "$1" | "$shell" 2>&1
+}
+
+out=$(run "limit -g $group cat /proc/self/cgroup")
+case $out in
+    *"0::"*"/$name") echo "PASS: job runs in $group" ;;
+    *) echo "FAIL: job not in $group: $out"; status=1 ;;
+esac
+
+# memory.max only exists where the memory controller is enabled for children
+if grep -qw memory "$root/cgroup.subtree_control" 2>/dev/null; then
+    out=$(run "limit -g $group -m 64M cat /proc/self/cgroup")
+    max=$(cat "$group/memory.max" 2>/dev/null)
+    case $out in
+        *"0::"*"/$name") ;;
+        *) echo "FAIL: job not in $group: $out"; status=1 ;;
+    esac
+    if [ "$max" = 67108864 ]; then
+        echo "PASS: memory.max is 64M"
+    else
+        echo "FAIL: memory.max is '$max', not 67108864"
+        status=1
+    fi
+else
+    echo "SKIP: memory controller not enabled in $root"
+fi
+
+rmdir "$group" 2>/dev/null
+exit $status